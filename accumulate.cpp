@@ -1,17 +1,44 @@
 
+#include <fstream>
 #include <iostream>
 
+#include "lua_histogram.h"
 #include "serializer.h"
 
 /*
  * Reads events from standard input, runs the program specified on the command
- * line and prints an histogram list to standard output.
+ * line and prints an histogram list to standard output. When a list of fields
+ * is given with -f, the other fields are skipped when reading events.
  */
 int main(int argc, char **argv)
 {
+  // Read options
+  field_set fields = field_set::everything();
+  while (argc > 2 && argv[1][0] == '-') {
+    std::string option = argv[1];
+    int used = 1;
+    if (option == "-f") {
+      // List of fields to decode
+      std::ifstream in(argv[2]);
+      if (!in) {
+        std::cerr << "ERROR: Could not open " << argv[2] << std::endl;
+        return 1;
+      }
+      fields = field_set::read(in);
+      used = 2;
+    } else {
+      break;
+    }
+    // Remove the option
+    argv[used] = argv[0];
+    argv += used;
+    argc -= used;
+  }
+
   // Read the program file name from the command line.
   if (argc != 2) {
-    std::cout << "Usage: " << argv[0] << " program.lua" << std::endl;
+    std::cout << "Usage: " << argv[0] << " [-f fields.txt] program.lua"
+              << std::endl;
     return 1;
   }
   std::string filename = argv[1];
@@ -37,10 +64,12 @@ int main(int argc, char **argv)
   sol::protected_function program = lr;
 
   // Load the histogram library and create the H variable
+  register_histograms(lua);
   lua.script("require \"histogram\"; H = histogram_list.new()");
 
   // Read one event at a time and print them all
   unserializer uns(std::cin);
+  uns.select(fields);
   auto lua_e = lua["e"];
   bool eof = false;
   while (std::cin && std::cout) {
@@ -59,7 +88,14 @@ int main(int argc, char **argv)
 
   // Write the histograms to stdout
   serializer ser(std::cout);
-  ser.write(lua["H"]);
+  sol::table H = lua["H"];
+  sol::table packed = H["pack"](H);
+  ser.write(packed);
+
+  if (uns.skipped_bytes() > 0) {
+    std::cerr << "[INFO] Skipped " << uns.skipped_bytes() << " bytes"
+              << std::endl;
+  }
 
   return 0;
 }
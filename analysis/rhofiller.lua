@@ -27,6 +27,6 @@ if e.rho then
   H.zdc_plus:fill(e.zdc.plus)
   H.zdc_minus:fill(e.zdc.minus)
 
-  H.rho_mass:fill(e.rho.p:norm())
-  H.rho_pt2:fill(sumsq(e.rho.p.x, e.rho.p.y))
+  H:book("rho_mass", 0, 4, 400):fill(e.rho.p:norm())
+  H:book("rho_pt2", 0, 1, 200):fill(sumsq(e.rho.p.x, e.rho.p.y))
 end
@@ -0,0 +1,85 @@
+
+#include <chrono>
+#include <cstdlib>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <string>
+
+#include <TFile.h>
+
+#include "hlt_ntuple.h"
+#include "parsers.h"
+
+namespace // anonymous
+{
+  /*
+   * Reads all events of the file and prints statistics.
+   */
+  void measure(const std::string &filename, long long cache_size,
+               int read_ahead)
+  {
+    Long64_t bytes = TFile::GetFileBytesRead();
+    Int_t calls = TFile::GetFileReadCalls();
+    auto start = std::chrono::steady_clock::now();
+
+    hlt_parser in(filename);
+    in.set_cache_size(cache_size);
+    in.set_read_ahead(read_ahead);
+    long events = 0;
+    while (!in.end()) {
+      in.read();
+      ++events;
+    }
+
+    std::chrono::duration<double> time =
+      std::chrono::steady_clock::now() - start;
+    bytes = TFile::GetFileBytesRead() - bytes;
+    calls = TFile::GetFileReadCalls() - calls;
+
+    std::cout << std::setw(10)
+              << (cache_size < 0 ? std::string("default")
+                                 : std::to_string(cache_size >> 20) + " MB")
+              << std::setw(12) << read_ahead
+              << std::setw(10) << std::fixed << std::setprecision(2)
+              << time.count()
+              << std::setw(12) << std::setprecision(0)
+              << events / time.count()
+              << std::setw(10) << std::setprecision(1) << bytes / 1048576.
+              << std::setw(12) << calls << std::endl;
+  }
+} // anonymous namespace
+
+/*
+ * Compares the throughput of hlt_parser with and without the tree cache and
+ * read-ahead. The file is created with random contents if it doesn't exist.
+ *
+ * The first pass leaves the file in the page cache of the system, which hides
+ * the cost of seeking. Drop it between runs (or use a file on a network
+ * filesystem) for a comparison closer to real conditions.
+ */
+int main(int argc, char **argv)
+{
+  if (argc != 2 && argc != 3) {
+    std::cout << "Usage: " << argv[0] << " file.root [entries]" << std::endl;
+    return 1;
+  }
+  std::string filename = argv[1];
+  long entries = argc == 3 ? std::atol(argv[2]) : 100000;
+
+  if (!std::ifstream(filename)) {
+    std::cerr << "[INFO] Generating " << entries << " entries in " << filename
+              << std::endl;
+    write_hlt_ntuple(filename, entries);
+  }
+
+  std::cout << "     cache  read-ahead  time (s)    events/s   MB read"
+            << "  read calls" << std::endl;
+  measure(filename, 0, 0);
+  measure(filename, -1, 0);
+  measure(filename, 100 << 20, 0);
+  measure(filename, -1, 16);
+  measure(filename, 0, 16);
+
+  return 0;
+}
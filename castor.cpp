@@ -50,3 +50,9 @@ void castor::add_hit(int module, int sector, double data)
                     * castor_overall_gain;
   }
 }
+
+void castor::clear()
+{
+  _hits.clear();
+  _energy = 0;
+}
@@ -1,22 +1,40 @@
 #ifndef CASTOR_H
 #define CASTOR_H
 
-#include <vector>
+#include <cstddef>
+
+#include "small_vector.h"
 
 class castor
 {
+public:
   struct hit
   {
     int module;
     int sector;
     double data;
   };
-  std::vector<hit> _hits;
-  double _energy;
+
+private:
+  small_vector<hit, 16> _hits;
+  double _energy = 0;
 
 public:
   void add_hit(int module, int sector, double data);
+  void clear();
+
+  /// Adds a hit without changing the energy, when restoring a copy
+  void restore_hit(int module, int sector, double data)
+  { _hits.push_back(hit{ module, sector, data }); }
+  /// Sets the energy, when restoring a copy
+  void restore_energy(double energy) { _energy = energy; }
+
+  /// Makes room for \c count hits
+  void reserve(std::size_t count) { _hits.reserve(count); }
+  /// Sets the arena used for the hits that don't fit in place
+  void set_arena(arena *a) { _hits.set_arena(a); }
 
+  const small_vector<hit, 16> &hits() const { return _hits; }
   double energy() const { return _energy; }
 };
 
@@ -0,0 +1,90 @@
+#include <atomic>
+#include <chrono>
+#include <iostream>
+#include <string>
+#include <thread>
+
+#include "prefetch_event_source.h"
+
+namespace // anonymous
+{
+  /*
+   * Source of a few empty events, which tells when all of them were read.
+   */
+  class counting_source : public event_source
+  {
+    int _count, _read = 0;
+    event _event;
+
+  public:
+    std::atomic<bool> exhausted{ false };
+
+    explicit counting_source(int count) : _count(count) {}
+
+    bool end()
+    {
+      bool end = _read >= _count;
+      if (end) {
+        exhausted = true;
+      }
+      return end;
+    }
+    void read() { _event.id = _read++; }
+    const event &rec() { return _event; }
+    const event &gen() { return _event; }
+    void reset() { _read = 0; exhausted = false; }
+  };
+
+  /*
+   * Reads all events with the usual loop and checks their number. If wait is
+   * true, the background thread reads everything before the first read().
+   * Returns false and prints an error on failure.
+   */
+  bool check(const std::string &name, int count, std::size_t depth,
+             bool wait)
+  {
+    counting_source source(count);
+    prefetch_event_source in(&source, depth);
+    if (wait) {
+      in.end(); // Starts the background thread
+      while (!source.exhausted) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+      }
+      // Let it mark itself as done
+      std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    }
+    int events = 0;
+    while (!in.end()) {
+      in.read();
+      if (in.rec().id != events) {
+        std::cerr << "ERROR: " << name << ": event " << in.rec().id
+                  << " instead of " << events << std::endl;
+        return false;
+      }
+      ++events;
+    }
+    if (events != count) {
+      std::cerr << "ERROR: " << name << ": read " << events << " events out of "
+                << count << std::endl;
+      return false;
+    }
+    std::cerr << "[INFO] " << name << ": read " << events << " events"
+              << std::endl;
+    return true;
+  }
+} // anonymous namespace
+
+/*
+ * Checks that prefetch_event_source hands out every event of the wrapped
+ * source, whether or not the background thread is done when the events are
+ * read. Returns a non-zero status on failure.
+ */
+int main()
+{
+  bool ok = true;
+  ok = check("immediate", 5, 64, false) && ok;
+  ok = check("after the reader is done", 5, 64, true) && ok;
+  ok = check("ring smaller than the source", 100, 4, false) && ok;
+  ok = check("empty source", 0, 64, true) && ok;
+  return ok ? 0 : 1;
+}
@@ -0,0 +1,58 @@
+#include <iostream>
+#include <string>
+
+#include "hlt_ntuple.h"
+#include "parsers.h"
+
+namespace // anonymous
+{
+  /*
+   * Reads the entries of the given range with the usual loop and checks
+   * their number. Returns false and prints an error on failure.
+   */
+  bool check(const std::string &filename, int read_ahead, long first,
+             long last, long expected)
+  {
+    std::string name = filename + " [" + std::to_string(first) + ", " +
+                       std::to_string(last) + ") with read-ahead " +
+                       std::to_string(read_ahead);
+    hlt_parser in(filename);
+    in.set_read_ahead(read_ahead);
+    in.set_range(first, last);
+    long events = 0;
+    while (!in.end()) {
+      in.read();
+      ++events;
+    }
+    // Reading past the end must return without an event
+    in.read();
+    if (events != expected || !in.end()) {
+      std::cerr << "ERROR: " << name << ": read " << events
+                << " entries instead of " << expected << std::endl;
+      return false;
+    }
+    std::cerr << "[INFO] " << name << ": read " << events << " entries"
+              << std::endl;
+    return true;
+  }
+} // anonymous namespace
+
+/*
+ * Checks that hlt_parser reads every entry of a range, with and without
+ * read-ahead, and that reading at the end of a range returns. A failure makes
+ * the program return a non-zero status, and a hang makes it time out.
+ */
+int main()
+{
+  write_hlt_ntuple("checkreadahead.root", 20);
+  write_hlt_ntuple("checkreadahead-empty.root", 0);
+
+  bool ok = true;
+  for (int read_ahead : { 0, 4 }) {
+    ok = check("checkreadahead.root", read_ahead, 0, 20, 20) && ok;
+    ok = check("checkreadahead.root", read_ahead, 18, 100, 2) && ok;
+    ok = check("checkreadahead.root", read_ahead, 5, 5, 0) && ok;
+    ok = check("checkreadahead-empty.root", read_ahead, 0, 100, 0) && ok;
+  }
+  return ok ? 0 : 1;
+}
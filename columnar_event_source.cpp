@@ -0,0 +1,338 @@
+#include "columnar_event_source.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+
+#include <sys/mman.h>
+#include <unistd.h>
+
+/**
+ * \brief Creates a cache for the events of \c in.
+ *
+ * If given, \c size_hint is the expected number of events. When
+ * \c memory_budget isn't zero, the events that don't fit in this number of
+ * bytes are written to a temporary file in $TMPDIR (or /tmp).
+ */
+columnar_event_source::columnar_event_source(event_source *in,
+                                             std::size_t size_hint,
+                                             std::size_t memory_budget) :
+  _in(in),
+  _budget(memory_budget),
+  _position(-1)
+{
+  _blocks.reserve(size_hint / BLOCK_EVENTS + 1);
+}
+
+columnar_event_source::~columnar_event_source()
+{
+  close_spill();
+}
+
+bool columnar_event_source::end()
+{
+  if (_valid) {
+    return _position + 1 >= _size;
+  } else {
+    bool end = _in->end();
+    if (end) {
+      finish();
+    }
+    return end;
+  }
+}
+
+void columnar_event_source::fill_rec(sol::state &lua, sol::table &event)
+{
+  _in->fill_rec(lua, event);
+}
+
+void columnar_event_source::prepare(sol::state &lua)
+{
+  _in->prepare(lua);
+}
+
+void columnar_event_source::read()
+{
+  _position++;
+  if (_valid) {
+    if (_position < _size) {
+      fetch(_position / BLOCK_EVENTS).get(_position % BLOCK_EVENTS, _current);
+      _view = &_current;
+    }
+  } else {
+    _in->read();
+    add(_in->rec());
+    _view = &_in->rec();
+  }
+}
+
+/**
+ * \brief Reads up to \c count events into \c slots.
+ *
+ * During the first pass, the events are read in a batch from the wrapped
+ * source. Later passes copy them directly from the blocks, fetching every
+ * block once per batch.
+ */
+std::size_t columnar_event_source::read_batch(event_slot *slots,
+                                              std::size_t count,
+                                              sol::state *lua)
+{
+  if (!_valid) {
+    std::size_t n = _in->read_batch(slots, count, lua);
+    for (std::size_t i = 0; i < n; ++i) {
+      event_slot &slot = slots[i];
+      if (slot.rec == nullptr) {
+        slot.rec_copy.clear();
+        slot.rec = &slot.rec_copy;
+      }
+      slot.gen = slot.rec;
+      add(*slot.rec);
+    }
+    _position += n;
+    if (n < count) {
+      // Like read() when it reaches the end
+      ++_position;
+      add(_in->rec());
+      finish();
+    }
+    return n;
+  }
+
+  // The event at _position + 1 is read if it isn't the last one
+  std::size_t i = 0;
+  while (i < count && _position + 2 < _size) {
+    std::size_t index = (_position + 1) / BLOCK_EVENTS;
+    const event_store &events = fetch(index);
+    std::size_t last = std::min((index + 1) * BLOCK_EVENTS, _size - 1);
+    for (; i < count && _position + 1 < last; ++i) {
+      ++_position;
+      event_slot &slot = slots[i];
+      events.get(_position % BLOCK_EVENTS, slot.rec_copy);
+      slot.gen = &slot.rec_copy;
+      slot.rec = &slot.rec_copy;
+      if (lua != nullptr) {
+        slot.reset_fill(*lua);
+        _in->fill_rec(*lua, slot.fill);
+      }
+    }
+  }
+  if (i < count) {
+    ++_position;
+  }
+  return i;
+}
+
+const event &columnar_event_source::rec()
+{
+  return *_view;
+}
+
+const event &columnar_event_source::gen()
+{
+  return *_view;
+}
+
+void columnar_event_source::reset()
+{
+  _position = -1;
+  if (!_valid) {
+    _in->reset();
+    _blocks.clear();
+    _size = 0;
+    _lru.clear();
+    _resident = 0;
+    close_spill();
+  }
+}
+
+/**
+ * \brief Returns the number of bytes used by the events in memory.
+ */
+std::size_t columnar_event_source::memory() const
+{
+  if (!_valid && !_blocks.empty()) {
+    // The block being filled isn't in _lru yet
+    return _resident + _blocks.back().events->memory();
+  }
+  return _resident;
+}
+
+/*
+ * Appends an event to the last block, starting a new one if it's full.
+ */
+void columnar_event_source::add(const event &e)
+{
+  if (_blocks.empty() || _blocks.back().events->size() == BLOCK_EVENTS) {
+    if (!_blocks.empty()) {
+      finish_block();
+    }
+    _blocks.emplace_back();
+    _blocks.back().events.reset(new event_store);
+    // Most events have a few tracks
+    _blocks.back().events->reserve(BLOCK_EVENTS, 4 * BLOCK_EVENTS, 0);
+  }
+  _blocks.back().events->add(e);
+  ++_size;
+}
+
+/*
+ * Counts the last block in the memory used, once it's full. Blocks are then
+ * evicted if needed.
+ */
+void columnar_event_source::finish_block()
+{
+  block &b = _blocks.back();
+  b.events->shrink_to_fit();
+  b.memory = b.events->memory();
+  _lru.push_front(_blocks.size() - 1);
+  b.lru = _lru.begin();
+  _resident += b.memory;
+  evict();
+}
+
+/*
+ * Called at the end of the first pass.
+ */
+void columnar_event_source::finish()
+{
+  if (!_blocks.empty()) {
+    finish_block();
+  }
+  _valid = true;
+}
+
+/*
+ * Returns a block, loading it from the spill file if needed.
+ */
+const event_store &columnar_event_source::fetch(std::size_t index)
+{
+  block &b = _blocks[index];
+  if (b.events) {
+    touch(index);
+    return *b.events;
+  }
+
+  if (_map_size < _spill_size) {
+    // Blocks were written since the file was mapped
+    if (_map != nullptr) {
+      munmap((void *) _map, _map_size);
+      _map = nullptr;
+      _map_size = 0;
+    }
+    void *map = mmap(nullptr, _spill_size, PROT_READ, MAP_SHARED, _spill_fd,
+                     0);
+    if (map == MAP_FAILED) {
+      throw std::runtime_error(std::string("could not map the event cache: ")
+                               + std::strerror(errno));
+    }
+    madvise(map, _spill_size, MADV_SEQUENTIAL);
+    _map = (const char *) map;
+    _map_size = _spill_size;
+  }
+
+  std::unique_ptr<event_store> events(new event_store);
+  events->load(_map + b.offset, b.bytes);
+  b.events = std::move(events);
+  // The copy is enough, don't keep the pages in the address space
+  std::size_t page = sysconf(_SC_PAGESIZE);
+  std::size_t start = b.offset / page * page;
+  madvise((void *) (_map + start), b.offset + b.bytes - start, MADV_DONTNEED);
+  b.memory = b.events->memory();
+  _lru.push_front(index);
+  b.lru = _lru.begin();
+  _resident += b.memory;
+  evict();
+  return *b.events;
+}
+
+/*
+ * Marks a block in memory as the most recently used.
+ */
+void columnar_event_source::touch(std::size_t index)
+{
+  block &b = _blocks[index];
+  if (b.lru != _lru.begin()) {
+    _lru.splice(_lru.begin(), _lru, b.lru);
+  }
+}
+
+/*
+ * Removes the least recently used blocks from memory until the budget is
+ * met, writing them to the spill file if they aren't there already. The most
+ * recent block is always kept.
+ */
+void columnar_event_source::evict()
+{
+  if (_budget == 0) {
+    return;
+  }
+  while (_resident > _budget && _lru.size() > 1) {
+    std::size_t index = _lru.back();
+    block &b = _blocks[index];
+    if (!b.spilled) {
+      spill(index);
+    }
+    _resident -= b.memory;
+    b.events.reset();
+    b.memory = 0;
+    _lru.pop_back();
+  }
+}
+
+/*
+ * Appends a block to the spill file, creating it if needed.
+ */
+void columnar_event_source::spill(std::size_t index)
+{
+  if (_spill_fd < 0) {
+    const char *tmpdir = std::getenv("TMPDIR");
+    std::string filename = std::string(tmpdir ? tmpdir : "/tmp")
+                         + "/memoire-XXXXXX";
+    _spill_fd = mkstemp(&filename[0]);
+    if (_spill_fd < 0) {
+      throw std::runtime_error("could not create " + filename + ": " +
+                               std::strerror(errno));
+    }
+    // Deleted when closed
+    unlink(filename.c_str());
+  }
+
+  block &b = _blocks[index];
+  std::string bytes;
+  b.events->save(bytes);
+  std::size_t done = 0;
+  while (done < bytes.size()) {
+    ssize_t written = pwrite(_spill_fd, bytes.data() + done,
+                             bytes.size() - done, _spill_size + done);
+    if (written < 0) {
+      throw std::runtime_error(std::string("could not write the event cache: ")
+                               + std::strerror(errno));
+    }
+    done += written;
+  }
+  b.spilled = true;
+  b.offset = _spill_size;
+  b.bytes = bytes.size();
+  _spill_size += bytes.size();
+}
+
+/*
+ * Unmaps and deletes the spill file.
+ */
+void columnar_event_source::close_spill()
+{
+  if (_map != nullptr) {
+    munmap((void *) _map, _map_size);
+    _map = nullptr;
+    _map_size = 0;
+  }
+  if (_spill_fd >= 0) {
+    close(_spill_fd);
+    _spill_fd = -1;
+  }
+  _spill_size = 0;
+}
@@ -0,0 +1,89 @@
+#ifndef COLUMNAR_EVENT_SOURCE_H
+#define COLUMNAR_EVENT_SOURCE_H
+
+#include <list>
+#include <memory>
+#include <vector>
+
+#include "event.h"
+#include "event_source.h"
+#include "event_store.h"
+
+/**
+ * \brief Caches the events of another source in an event_store
+ *
+ * Works like cached_event_source, but uses much less memory and reads it in
+ * order. rec() and gen() return a copy of the current event, which is
+ * overwritten by the next call to read().
+ *
+ * Events are kept in blocks. When a memory budget is given, the blocks that
+ * don't fit in it are written to a temporary file, which is mapped in memory
+ * after the first pass. Later passes load the blocks back from it, keeping
+ * the most recently used ones within the budget.
+ */
+class columnar_event_source : public event_source
+{
+  /// Events [index * BLOCK_EVENTS, (index + 1) * BLOCK_EVENTS)
+  struct block
+  {
+    std::unique_ptr<event_store> events; ///< Null if not in memory
+    std::size_t memory = 0; ///< Memory used by events
+    bool spilled = false;
+    std::size_t offset = 0, bytes = 0; ///< Location in the spill file
+    std::list<std::size_t>::iterator lru;
+  };
+
+  static const std::size_t BLOCK_EVENTS = 4096;
+
+  event_source *_in;
+
+  std::size_t _budget;
+  std::vector<block> _blocks;
+  std::size_t _size = 0;
+  std::list<std::size_t> _lru; ///< Blocks in memory, most recent first
+  std::size_t _resident = 0; ///< Memory used by the blocks in _lru
+
+  int _spill_fd = -1;
+  std::size_t _spill_size = 0;
+  const char *_map = nullptr;
+  std::size_t _map_size = 0;
+
+  event _current;
+  const event *_view = nullptr;
+  std::size_t _position;
+  bool _valid = false;
+
+  columnar_event_source(const columnar_event_source &) = delete;
+  columnar_event_source &operator=(const columnar_event_source &) = delete;
+
+public:
+  explicit columnar_event_source(event_source *in, std::size_t size_hint = 0,
+                                 std::size_t memory_budget = 0);
+  ~columnar_event_source();
+
+  bool end();
+  void read();
+  std::size_t read_batch(event_slot *slots, std::size_t count,
+                         sol::state *lua);
+  void prepare(sol::state &lua);
+  void fill_rec(sol::state &lua, sol::table &event);
+  const event &rec();
+  const event &gen();
+  void reset();
+
+  std::size_t memory() const;
+  /// Returns the size of the spill file
+  std::size_t spilled() const { return _spill_size; }
+
+private:
+  void add(const event &e);
+  void finish_block();
+  void finish();
+  const event_store &fetch(std::size_t index);
+  void touch(std::size_t index);
+  void evict();
+  void spill(std::size_t index);
+  void close_spill();
+};
+
+#endif // COLUMNAR_EVENT_SOURCE_H
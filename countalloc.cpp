@@ -0,0 +1,121 @@
+#include <cstdlib>
+#include <iostream>
+#include <new>
+#include <string>
+
+#include "event.h"
+
+namespace // anonymous
+{
+  /// Number of calls to operator new since the start of the program
+  long allocations = 0;
+
+  /*
+   * Fills an event with the given number of tracks and CASTOR hits, reserving
+   * them first like hlt_parser does.
+   */
+  void fill(event &e, int tracks, int hits)
+  {
+    e.id = tracks;
+    e.tracks.reserve(tracks);
+    e.castor_status.reserve(hits);
+    for (int i = 0; i < tracks; ++i) {
+      track t;
+      t.pdgid = 211;
+      t.gpid = 8;
+      t.charge = i % 2 ? 1 : -1;
+      t.chi2 = i;
+      t.ndof = 10;
+      e.add_track(t);
+    }
+    for (int i = 0; i < hits; ++i) {
+      e.castor_status.add_hit(i % 14 + 1, i % 16 + 1, i);
+    }
+  }
+
+  /*
+   * Fills the event several times and checks that no allocation was made.
+   * The arena, if any, is cleared before every event like in the parsers.
+   * Returns false and prints an error otherwise.
+   */
+  bool check(const std::string &name, event &e, int tracks, int hits,
+             arena *storage = nullptr)
+  {
+    long before = allocations;
+    for (int i = 0; i < 10; ++i) {
+      if (storage != nullptr) {
+        storage->clear();
+      }
+      e.clear();
+      fill(e, tracks, hits);
+    }
+    long count = allocations - before;
+    if (e.tracks.size() != std::size_t(tracks) ||
+        e.castor_status.hits().size() != std::size_t(hits)) {
+      std::cerr << "ERROR: " << name << ": wrong number of elements"
+                << std::endl;
+      return false;
+    }
+    if (count != 0) {
+      std::cerr << "ERROR: " << name << ": " << count << " allocations"
+                << std::endl;
+      return false;
+    }
+    std::cerr << "[INFO] " << name << ": no allocations" << std::endl;
+    return true;
+  }
+} // anonymous namespace
+
+void *operator new(std::size_t size)
+{
+  ++allocations;
+  void *p = std::malloc(size == 0 ? 1 : size);
+  if (p == nullptr) {
+    throw std::bad_alloc();
+  }
+  return p;
+}
+
+void operator delete(void *p) noexcept
+{
+  std::free(p);
+}
+
+void operator delete(void *p, std::size_t) noexcept
+{
+  std::free(p);
+}
+
+/*
+ * Checks that filling events doesn't allocate memory in the cases where the
+ * parsers rely on it: tracks and CASTOR hits that fit in place, larger sizes
+ * that fit in an arena, and events refilled after their heap storage grew.
+ * Returns a non-zero status on failure.
+ */
+int main()
+{
+  bool ok = true;
+
+  // Sizes stored in place don't allocate, even for the first event
+  {
+    event e;
+    ok = check("in place", e, 4, 16) && ok;
+  }
+
+  // Larger sizes are taken from the arena
+  {
+    arena storage(100 * sizeof(track) + 200 * sizeof(castor::hit) + 64);
+    event e;
+    e.set_arena(&storage);
+    ok = check("arena", e, 100, 200, &storage) && ok;
+  }
+
+  // Heap storage is kept by clear()
+  {
+    event e;
+    fill(e, 100, 200);
+    ok = check("heap reuse", e, 100, 200) && ok;
+  }
+
+  return ok ? 0 : 1;
+}
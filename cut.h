@@ -12,6 +12,8 @@ public:
   explicit cut(const std::string &name) : _name(name) {}
   virtual ~cut() {}
 
+  const std::string &name() const { return _name; }
+
   virtual bool operator() (const event &e) = 0;
 };
 
@@ -42,6 +44,8 @@ class lua_cut
 public:
   explicit lua_cut(const std::string &name, const std::string &code);
 
+  const std::string &name() const { return _name; }
+
   sol::load_result load_into(sol::state &lua);
 };
 
@@ -61,7 +61,7 @@ void print_histogram(const hist::histogram &h)
   }
 
   // Find the total number of events
-  double total = std::accumulate(h.begin(), h.end(), 0);
+  double total = std::accumulate(h.begin(), h.end(), 0.);
   total += h.out_of_range().underflow();
   total += h.out_of_range().overflow();
 
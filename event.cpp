@@ -2,7 +2,7 @@
 
 #include <algorithm>
 
-void track::match(const std::vector<track> &tracks)
+void track::match(const track_list &tracks)
 {
   auto it = std::min_element(tracks.cbegin(), tracks.cend(),
     [this](const track &a, const track &b) {
@@ -16,3 +16,30 @@ void event::add_track(const track& t)
   p += t.p;
   tracks.push_back(t);
 }
+
+/**
+ * \brief Resets the event to its default state, keeping the memory allocated
+ *        for the tracks and CASTOR hits.
+ *
+ * Storage taken from an arena is given up: the arena can be cleared after
+ * the event.
+ */
+void event::clear()
+{
+  id = 0;
+  tracks.clear();
+  p = lorentz::vec();
+  castor_status.clear();
+  hcal = hadronic_calorimeter();
+  ecal = barrel_endcap();
+}
+
+/**
+ * \brief Sets the arena used for the tracks and CASTOR hits that don't fit in
+ *        place.
+ */
+void event::set_arena(arena *a)
+{
+  tracks.set_arena(a);
+  castor_status.set_arena(a);
+}
@@ -1,12 +1,16 @@
 #ifndef EVENT_H
 #define EVENT_H
 
-#include <vector>
-
 #include "sol.hpp"
 
 #include "castor.h"
 #include "lorentz.h"
+#include "small_vector.h"
+
+struct track;
+
+/// Tracks of an event, stored in place when there are few of them
+typedef small_vector<track, 4> track_list;
 
 struct track
 {
@@ -19,7 +23,7 @@ struct track
   int ndof;
   lorentz::vec x; ///< Temporal component == 0!
 
-  void match(const std::vector<track> &tracks);
+  void match(const track_list &tracks);
 };
 
 struct plus_minus
@@ -42,13 +46,15 @@ struct hadronic_calorimeter : public barrel_endcap
 struct event
 {
   int id;
-  std::vector<track> tracks;
+  track_list tracks;
   lorentz::vec p;
   castor castor_status;
   hadronic_calorimeter hcal;
   barrel_endcap ecal;
 
   void add_track(const track &t);
+  void clear();
+  void set_arena(arena *a);
 };
 
 #endif // EVENT_H
@@ -0,0 +1,48 @@
+#include "event_source.h"
+
+/**
+ * \brief Reads up to \c count events into \c slots.
+ *
+ * This does the same as calling read() until end() returns true, one slot
+ * per event. The events pointed to by the slots remain valid until the next
+ * call to read_batch(), read() or reset(). If \c lua isn't null, the tables
+ * of the slots are created in it and filled with fill_rec(); prepare() must
+ * have been called first.
+ *
+ * Returns the number of events read. It is smaller than \c count only when
+ * the end of the source was reached, after which the source must be reset
+ * before reading again.
+ *
+ * The default implementation copies the events returned by rec() and gen().
+ * Sources that keep their events around can point to them instead.
+ */
+std::size_t event_source::read_batch(event_slot *slots, std::size_t count,
+                                     sol::state *lua)
+{
+  for (std::size_t i = 0; i < count; ++i) {
+    read();
+    if (end()) {
+      return i;
+    }
+    event_slot &slot = slots[i];
+    slot.gen = nullptr;
+    slot.rec = nullptr;
+    if (has_gen()) {
+      slot.gen_copy = gen();
+      slot.gen = &slot.gen_copy;
+    }
+    if (has_rec()) {
+      if (slot.gen != nullptr && &rec() == &gen()) {
+        slot.rec = slot.gen;
+      } else {
+        slot.rec_copy = rec();
+        slot.rec = &slot.rec_copy;
+      }
+    }
+    if (lua != nullptr) {
+      slot.reset_fill(*lua);
+      fill_rec(*lua, slot.fill);
+    }
+  }
+  return count;
+}
@@ -1,9 +1,29 @@
 #ifndef EVENT_SOURCE_H
 #define EVENT_SOURCE_H
 
+#include <cstddef>
+#include <utility>
+
 #include "sol.hpp"
 
-class event;
+#include "event.h"
+
+/// An event read by event_source::read_batch()
+struct event_slot
+{
+  const event *gen = nullptr; ///< Null if the source has no generated event
+  const event *rec = nullptr; ///< Null if the source has no reconstructed event
+  sol::table fill; ///< Table filled by fill_rec()
+  event gen_copy, rec_copy; ///< Storage for sources that can't point elsewhere
+
+  /// Replaces the table with an empty one
+  void reset_fill(sol::state &lua)
+  {
+    // Assigning to a sol::reference doesn't release what it referred to
+    sol::table empty = lua.create_table();
+    std::swap(fill, empty);
+  }
+};
 
 class event_source
 {
@@ -15,6 +35,8 @@ public:
   virtual bool has_rec() { return true; }
   virtual void prepare(sol::state &lua) {};
   virtual void read() = 0;
+  virtual std::size_t read_batch(event_slot *slots, std::size_t count,
+                                 sol::state *lua);
   /// The returned reference has to remain valid until the next call to read()
   virtual void fill_rec(sol::state &lua, sol::table &event) {};
   virtual const event &rec() = 0;
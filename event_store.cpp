@@ -0,0 +1,167 @@
+#include "event_store.h"
+
+#include <cstring>
+#include <stdexcept>
+
+/**
+ * \brief Appends an event.
+ */
+void event_store::add(const event &e)
+{
+  _id.push_back(e.id);
+  _p.push_back(e.p);
+  _hcal.push_back(e.hcal);
+  _ecal.push_back(e.ecal);
+  _castor_energy.push_back(e.castor_status.energy());
+
+  for (const track &t : e.tracks) {
+    _pdgid.push_back(t.pdgid);
+    _gpid.push_back(t.gpid);
+    _charge.push_back(t.charge);
+    _matched.push_back(t.matched);
+    _ndof.push_back(t.ndof);
+    _track_p.push_back(t.p);
+    _track_x.push_back(t.x);
+    _chi2.push_back(t.chi2);
+  }
+  _track_end.push_back(_chi2.size());
+
+  for (const castor::hit &h : e.castor_status.hits()) {
+    _module.push_back(h.module);
+    _sector.push_back(h.sector);
+    _data.push_back(h.data);
+  }
+  _hit_end.push_back(_data.size());
+}
+
+/**
+ * \brief Copies event \c index to \c e.
+ *
+ * The memory used by \c e is reused, so that nothing is allocated when the
+ * tracks and hits fit in it.
+ */
+void event_store::get(std::size_t index, event &e) const
+{
+  e.clear();
+  e.id = _id[index];
+  e.hcal = _hcal[index];
+  e.ecal = _ecal[index];
+
+  std::size_t begin = index == 0 ? 0 : _track_end[index - 1];
+  std::size_t end = _track_end[index];
+  e.tracks.reserve(end - begin);
+  for (std::size_t i = begin; i < end; ++i) {
+    track t;
+    t.pdgid = _pdgid[i];
+    t.gpid = _gpid[i];
+    t.p = _track_p[i];
+    t.charge = _charge[i];
+    t.matched = _matched[i];
+    t.chi2 = _chi2[i];
+    t.ndof = _ndof[i];
+    t.x = _track_x[i];
+    e.tracks.push_back(t);
+  }
+  // Not recomputed from the tracks, it may have been set differently
+  e.p = _p[index];
+
+  begin = index == 0 ? 0 : _hit_end[index - 1];
+  end = _hit_end[index];
+  e.castor_status.reserve(end - begin);
+  for (std::size_t i = begin; i < end; ++i) {
+    e.castor_status.restore_hit(_module[i], _sector[i], _data[i]);
+  }
+  e.castor_status.restore_energy(_castor_energy[index]);
+}
+
+/**
+ * \brief Makes room for the given numbers of events, tracks and CASTOR hits.
+ */
+void event_store::reserve(std::size_t events, std::size_t tracks,
+                          std::size_t hits)
+{
+  _id.reserve(events);
+  _p.reserve(events);
+  _hcal.reserve(events);
+  _ecal.reserve(events);
+  _castor_energy.reserve(events);
+  _track_end.reserve(events);
+  _hit_end.reserve(events);
+
+  _pdgid.reserve(tracks);
+  _gpid.reserve(tracks);
+  _charge.reserve(tracks);
+  _matched.reserve(tracks);
+  _ndof.reserve(tracks);
+  _track_p.reserve(tracks);
+  _track_x.reserve(tracks);
+  _chi2.reserve(tracks);
+
+  _module.reserve(hits);
+  _sector.reserve(hits);
+  _data.reserve(hits);
+}
+
+/**
+ * \brief Frees the memory that isn't used.
+ */
+void event_store::shrink_to_fit()
+{
+  for_each_column(*this, [](auto &column) { column.shrink_to_fit(); });
+}
+
+/**
+ * \brief Removes all events, keeping the memory.
+ */
+void event_store::clear()
+{
+  for_each_column(*this, [](auto &column) { column.clear(); });
+}
+
+/**
+ * \brief Returns the number of bytes allocated by the store.
+ */
+std::size_t event_store::memory() const
+{
+  std::size_t bytes = 0;
+  for_each_column(*this, [&bytes](const auto &column) {
+    bytes += column.capacity() * sizeof(column[0]);
+  });
+  return bytes;
+}
+
+/**
+ * \brief Appends the events to \c bytes, in a format understood by load().
+ */
+void event_store::save(std::string &bytes) const
+{
+  for_each_column(*this, [&bytes](const auto &column) {
+    std::uint64_t size = column.size();
+    bytes.append((const char *) &size, sizeof(size));
+    bytes.append((const char *) column.data(), size * sizeof(column[0]));
+  });
+}
+
+/**
+ * \brief Replaces the events with those saved in \c bytes by save().
+ *
+ * Throws std::runtime_error if the data is truncated.
+ */
+void event_store::load(const char *bytes, std::size_t size)
+{
+  const char *end = bytes + size;
+  for_each_column(*this, [&bytes, end](auto &column) {
+    std::uint64_t count;
+    if (std::size_t(end - bytes) < sizeof(count)) {
+      throw std::runtime_error("truncated event data");
+    }
+    std::memcpy(&count, bytes, sizeof(count));
+    bytes += sizeof(count);
+    if (std::size_t(end - bytes) / sizeof(column[0]) < count) {
+      throw std::runtime_error("truncated event data");
+    }
+    column.resize(count);
+    std::memcpy((void *) column.data(), bytes, count * sizeof(column[0]));
+    bytes += count * sizeof(column[0]);
+  });
+}
@@ -0,0 +1,89 @@
+#ifndef EVENT_STORE_H
+#define EVENT_STORE_H
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "event.h"
+
+/**
+ * \brief Compact storage for many events
+ *
+ * Every field is stored in its own contiguous array: one entry per event for
+ * the event fields, one per track for the tracks and one per hit for the
+ * CASTOR hits. The tracks and hits of event \c i are found between the ends
+ * of events <tt>i - 1</tt> and \c i. Walking over the events thus reads
+ * memory in order, and the whole store only uses a few heap blocks.
+ *
+ * Events are copied back to an event structure with get(), which reuses its
+ * memory. The CASTOR energy is stored so that it doesn't need to be computed
+ * again from the hits.
+ *
+ * The columns can be saved to a string of bytes in the native format of the
+ * machine, and loaded back.
+ */
+class event_store
+{
+  // Events
+  std::vector<int> _id;
+  std::vector<lorentz::vec> _p;
+  std::vector<hadronic_calorimeter> _hcal;
+  std::vector<barrel_endcap> _ecal;
+  std::vector<double> _castor_energy;
+  std::vector<std::size_t> _track_end, _hit_end;
+
+  // Tracks
+  std::vector<int> _pdgid, _gpid, _charge, _matched, _ndof;
+  std::vector<lorentz::vec> _track_p, _track_x;
+  std::vector<double> _chi2;
+
+  // CASTOR hits
+  std::vector<std::uint8_t> _module, _sector;
+  std::vector<double> _data;
+
+public:
+  void add(const event &e);
+  void get(std::size_t index, event &e) const;
+
+  /// Returns the number of events
+  std::size_t size() const { return _id.size(); }
+  /// Returns true if there is no event
+  bool empty() const { return _id.empty(); }
+
+  void reserve(std::size_t events, std::size_t tracks, std::size_t hits);
+  void shrink_to_fit();
+  void clear();
+  std::size_t memory() const;
+
+  void save(std::string &bytes) const;
+  void load(const char *bytes, std::size_t size);
+
+private:
+  /// Calls \c f with every column of \c store
+  template<class Store, class F>
+  static void for_each_column(Store &store, F f)
+  {
+    f(store._id);
+    f(store._p);
+    f(store._hcal);
+    f(store._ecal);
+    f(store._castor_energy);
+    f(store._track_end);
+    f(store._hit_end);
+    f(store._pdgid);
+    f(store._gpid);
+    f(store._charge);
+    f(store._matched);
+    f(store._ndof);
+    f(store._track_p);
+    f(store._track_x);
+    f(store._chi2);
+    f(store._module);
+    f(store._sector);
+    f(store._data);
+  }
+};
+
+#endif // EVENT_STORE_H
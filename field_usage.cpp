@@ -0,0 +1,283 @@
+#include "field_usage.h"
+
+#include <set>
+#include <sstream>
+
+#include "lua_lexer.h"
+
+const field_set::node *field_set::node::child(const std::string &name) const
+{
+  auto it = children.find(name);
+  return it == children.end() ? nullptr : &it->second;
+}
+
+field_set field_set::everything()
+{
+  field_set fields;
+  fields._root.all = true;
+  return fields;
+}
+
+void field_set::add(const std::vector<std::string> &path)
+{
+  node *n = &_root;
+  for (const std::string &name : path) {
+    if (n->all) {
+      return; // Already included
+    }
+    n = &n->children[name];
+  }
+  n->all = true;
+  n->children.clear();
+}
+
+void field_set::add(const std::string &path)
+{
+  if (path == "*") {
+    add(std::vector<std::string>());
+    return;
+  }
+  std::vector<std::string> components;
+  std::istringstream in(path);
+  std::string name;
+  while (std::getline(in, name, '.')) {
+    components.push_back(name);
+  }
+  add(components);
+}
+
+namespace // anonymous
+{
+  void merge_node(const field_set::node &n, std::vector<std::string> &path,
+                  field_set &into)
+  {
+    if (n.all) {
+      into.add(path);
+      return;
+    }
+    for (auto &child : n.children) {
+      path.push_back(child.first);
+      merge_node(child.second, path, into);
+      path.pop_back();
+    }
+  }
+
+  void write_node(const field_set::node &n, const std::string &path,
+                  std::ostream &out)
+  {
+    if (n.all) {
+      out << (path.empty() ? "*" : path) << "\n";
+      return;
+    }
+    for (auto &child : n.children) {
+      write_node(child.second,
+                 path.empty() ? child.first : path + "." + child.first,
+                 out);
+    }
+  }
+} // anonymous namespace
+
+void field_set::merge(const field_set &other)
+{
+  std::vector<std::string> path;
+  merge_node(other._root, path, *this);
+}
+
+bool field_set::needs(const std::string &path) const
+{
+  const node *n = &_root;
+  std::size_t begin = 0;
+  while (!n->all && begin <= path.size()) {
+    std::size_t end = path.find('.', begin);
+    if (end == std::string::npos) {
+      end = path.size();
+    }
+    n = n->child(path.substr(begin, end - begin));
+    if (n == nullptr) {
+      return false;
+    }
+    begin = end + 1;
+  }
+  return true;
+}
+
+field_set field_set::read(std::istream &in)
+{
+  field_set fields;
+  std::string line;
+  while (std::getline(in, line)) {
+    // Trim
+    std::size_t begin = line.find_first_not_of(" \t");
+    std::size_t end = line.find_last_not_of(" \t\r");
+    if (begin == std::string::npos || line[begin] == '#') {
+      continue;
+    }
+    fields.add(line.substr(begin, end - begin + 1));
+  }
+  return fields;
+}
+
+void field_set::write(std::ostream &out) const
+{
+  write_node(_root, "", out);
+}
+
+namespace // anonymous
+{
+  typedef lua_token token;
+
+  /// Names that give access to the event in ways we can't follow
+  const std::set<std::string> unsupported = {
+    "_G", "debug", "dofile", "getfenv", "load", "loadstring", "rawget",
+    "require", "setfenv"
+  };
+
+  /*
+   * Returns true if an expression can end before t, i.e. t can't continue
+   * it.
+   */
+  bool ends_statement(const token &t)
+  {
+    if (t.kind == token::eof || t.is_op(";")) {
+      return true;
+    }
+    if (t.kind == token::name) {
+      return t.text != "and" && t.text != "or";
+    }
+    return false;
+  }
+
+  typedef std::vector<std::string> path;
+  typedef std::map<std::string, std::vector<path>> alias_map;
+
+  /*
+   * Adds every base + suffix to fields.
+   */
+  void add_all(const std::vector<path> &bases, const path &suffix,
+               field_set &fields)
+  {
+    for (auto base : bases) {
+      base.insert(base.end(), suffix.begin(), suffix.end());
+      fields.add(base);
+    }
+  }
+} // anonymous namespace
+
+field_set analyze_fields(const std::string &code, std::string &diagnostic)
+{
+  diagnostic.clear();
+
+  std::vector<std::string> comments;
+  std::vector<token> tokens = lua_tokenize(code, &comments);
+
+  // Fields declared in comments
+  std::vector<std::string> declared;
+  for (const std::string &comment : comments) {
+    std::istringstream in(comment);
+    std::string word;
+    if (in >> word && word == "fields:") {
+      while (in >> word) {
+        declared.push_back(word);
+      }
+    }
+  }
+
+  // Variables known to refer to (parts of) the event
+  alias_map aliases;
+  aliases["e"] = { path() };
+
+  field_set fields;
+  for (std::size_t i = 0; i < tokens.size(); ++i) {
+    const token &t = tokens[i];
+    if (t.kind != token::name) {
+      continue;
+    }
+    if (unsupported.count(t.text) > 0) {
+      diagnostic = "script uses \"" + t.text + "\"";
+      break;
+    }
+    if (aliases.count(t.text) == 0) {
+      continue;
+    }
+    // Skip field names and declarations
+    if (i > 0 && (tokens[i - 1].is_op(".") || tokens[i - 1].is_op(":") ||
+                  tokens[i - 1].is_name("local") ||
+                  tokens[i - 1].is_name("function"))) {
+      continue;
+    }
+    // Rebinding the variable itself isn't a read
+    if (tokens[i + 1].is_op("=")) {
+      continue;
+    }
+
+    // Follow the chain of constant indices
+    path suffix;
+    std::size_t k = i + 1;
+    bool whole = false;
+    while (true) {
+      if (tokens[k].is_op(".") && tokens[k + 1].kind == token::name) {
+        suffix.push_back(tokens[k + 1].text);
+        k += 2;
+      } else if (k + 2 < tokens.size() && tokens[k].is_op("[") &&
+                 tokens[k + 2].is_op("]") &&
+                 tokens[k + 1].kind == token::string) {
+        suffix.push_back(tokens[k + 1].text);
+        k += 3;
+      } else if (k + 2 < tokens.size() && tokens[k].is_op("[") &&
+                 tokens[k + 2].is_op("]") &&
+                 tokens[k + 1].kind == token::number) {
+        suffix.push_back("[]");
+        k += 3;
+      } else {
+        // Computed index, method or function call: we can't tell which
+        // fields are used
+        whole = tokens[k].is_op("[") || tokens[k].is_op(":") ||
+                tokens[k].is_op("(") || tokens[k].is_op("{") ||
+                tokens[k].kind == token::string;
+        break;
+      }
+    }
+    const std::vector<path> bases = aliases[t.text];
+
+    if (!whole && tokens[k].is_op("=")) {
+      // Assignment to a field. Only the table that receives it is needed.
+      if (suffix.size() > 1) {
+        suffix.pop_back();
+        add_all(bases, suffix, fields);
+      }
+      continue;
+    }
+
+    // Is this "[local] name = chain"?
+    if (!whole && i >= 2 && tokens[i - 1].is_op("=") &&
+        tokens[i - 2].kind == token::name && ends_statement(tokens[k]) &&
+        !tokens[i - 2].is_keyword() &&
+        (i < 3 || !tokens[i - 3].is_op(",")) &&
+        (i < 3 || !tokens[i - 3].is_op("."))) {
+      std::vector<path> &alias = aliases[tokens[i - 2].text];
+      for (auto base : bases) {
+        base.insert(base.end(), suffix.begin(), suffix.end());
+        alias.push_back(base);
+      }
+      continue;
+    }
+
+    // Everything else reads the value as a whole
+    add_all(bases, suffix, fields);
+  }
+
+  if (!diagnostic.empty()) {
+    if (declared.empty()) {
+      diagnostic += "; assuming it reads the whole event";
+      return field_set::everything();
+    }
+    diagnostic += "; using the declared fields";
+    field_set declared_fields;
+    for (const std::string &name : declared) {
+      declared_fields.add(name);
+    }
+    return declared_fields;
+  }
+
+  return fields;
+}
@@ -0,0 +1,65 @@
+#ifndef FIELD_USAGE_H
+#define FIELD_USAGE_H
+
+#include <iostream>
+#include <map>
+#include <string>
+#include <vector>
+
+/**
+ * \brief Set of event fields
+ *
+ * Fields are identified by their path in the event table, for instance
+ * "tracks.n" or "hcal.fm.t". The elements of an array are designated by "[]",
+ * as in "tracks.[].q". When a path is in the set, everything below it is too.
+ *
+ * The text form has one path per line. "*" stands for the whole event and
+ * lines starting with "#" are ignored.
+ */
+class field_set
+{
+public:
+  struct node
+  {
+    bool all = false;
+    std::map<std::string, node> children;
+
+    /// Returns the child called \c name, or nullptr if it isn't needed
+    const node *child(const std::string &name) const;
+  };
+
+private:
+  node _root;
+
+public:
+  /// Creates a set containing the whole event
+  static field_set everything();
+
+  void add(const std::vector<std::string> &path);
+  void add(const std::string &path);
+  void merge(const field_set &other);
+
+  bool all() const { return _root.all; }
+  bool needs(const std::string &path) const;
+  const node &root() const { return _root; }
+
+  static field_set read(std::istream &in);
+  void write(std::ostream &out) const;
+};
+
+/**
+ * \brief Finds the event fields read by a Lua script
+ *
+ * The analysis looks for expressions starting with the global \c e and follows
+ * local aliases such as <tt>local e = e</tt> or <tt>local t = e.tracks</tt>.
+ * Any value that is used as a whole (passed to a function, iterated over,
+ * indexed with a computed key...) is considered read in full.
+ *
+ * When the script does something the analysis can't follow, \c diagnostic is
+ * set and the fields declared in a comment of the form
+ * <tt>-- fields: tracks castor_energy</tt> are used instead. If there is no
+ * such comment, the whole event is returned.
+ */
+field_set analyze_fields(const std::string &code, std::string &diagnostic);
+
+#endif // FIELD_USAGE_H
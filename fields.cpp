@@ -0,0 +1,41 @@
+
+#include <fstream>
+#include <iostream>
+#include <sstream>
+
+#include "field_usage.h"
+
+/*
+ * Analyzes the programs given on the command line and prints the list of event
+ * fields they read to standard output. The list can be given to readroot,
+ * accumulate and process with the -f option.
+ */
+int main(int argc, char **argv)
+{
+  // Read the program file names from the command line.
+  if (argc < 2) {
+    std::cout << "Usage: " << argv[0] << " program.lua..." << std::endl;
+    return 1;
+  }
+
+  field_set fields;
+  for (int i = 1; i < argc; ++i) {
+    std::ifstream in(argv[i]);
+    if (!in) {
+      std::cerr << "ERROR: Could not open " << argv[i] << std::endl;
+      return 2;
+    }
+    std::stringstream code;
+    code << in.rdbuf();
+
+    std::string diagnostic;
+    fields.merge(analyze_fields(code.str(), diagnostic));
+    if (!diagnostic.empty()) {
+      std::cerr << "[WARN] " << argv[i] << ": " << diagnostic << std::endl;
+    }
+  }
+
+  fields.write(std::cout);
+
+  return 0;
+}
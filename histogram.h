@@ -1,7 +1,9 @@
 #ifndef HISTOGRAM_H
 #define HISTOGRAM_H
 
+#include <algorithm>
 #include <cmath>
+#include <cstddef>
 #include <iostream>
 #include <stdexcept>
 #include <vector>
@@ -23,7 +25,9 @@ public:
   explicit linear_axis(const axis_type &begin, const axis_type &end,
                        int bin_count);
 
-  int operator() (const axis_type &data) const
+  int operator() (const axis_type &data) const { return position(data); }
+  /// Same as operator(), without the conversion to int
+  axis_type position(const axis_type &data) const
   { return std::floor(data / _bin_width - _begin / _bin_width); }
 
   int bin_count() const { return _end / _bin_width - _begin / _bin_width; }
@@ -44,6 +48,7 @@ public:
 
   void bin_overflow(bin_type) {}
   void bin_underflow(bin_type) {}
+  void merge(const out_of_range_discard &) {}
 };
 
 template<typename _bin_type_>
@@ -53,12 +58,18 @@ public:
   typedef _bin_type_ bin_type;
 
 private:
-  bin_type _underflow, _overflow;
+  bin_type _underflow = bin_type(), _overflow = bin_type();
 
 public:
   void bin_overflow(bin_type weight) { _overflow += weight; }
   void bin_underflow(bin_type weight) { _underflow += weight; }
 
+  void merge(const out_of_range_record &other)
+  {
+    _underflow += other._underflow;
+    _overflow += other._overflow;
+  }
+
   bin_type underflow() const { return _underflow; }
   bin_type overflow() const { return _overflow; }
 };
@@ -135,6 +146,8 @@ public:
 
   void bin(const binned_type &value) { bin(value, bin_type(1)); }
   void bin(const binned_type &value, const bin_type &weight);
+  void bin(const binned_type *values, std::size_t count);
+  void merge(const basic_histogram &other);
 
   const_iterator begin() const { return _data.cbegin(); }
   const_iterator cbegin() const { return _data.cbegin(); }
@@ -183,6 +196,67 @@ void basic_histogram<BASIC_HISTOGRAM_PARAMS>::bin(const binned_type &value,
   }
 }
 
+/**
+ * \brief Increments the bins corresponding to \arg count values, with unit
+ *        weights.
+ *
+ * The bins are computed by blocks without branching, which lets the compiler
+ * vectorize the loop, and counted before being added to the histogram. This
+ * requires an axis with a \c position() method, such as linear_axis. Values
+ * that aren't numbers are counted as underflow.
+ */
+BASIC_HISTOGRAM_PARAMS_DEF
+void basic_histogram<BASIC_HISTOGRAM_PARAMS>::bin(const binned_type *values,
+                                                  std::size_t count)
+{
+  const std::size_t block_size = 256;
+  const binned_type size = _data.size();
+
+  // 0 is the underflow and size + 1 the overflow
+  std::vector<std::size_t> counts(_data.size() + 2);
+  int index[block_size];
+  for (std::size_t start = 0; start < count; start += block_size) {
+    std::size_t n = std::min(block_size, count - start);
+    for (std::size_t i = 0; i < n; ++i) {
+      binned_type p = _axis.position(values[start + i]);
+      p = p >= 0 ? p : -1;
+      p = p < size ? p : size;
+      index[i] = int(p) + 1;
+    }
+    for (std::size_t i = 0; i < n; ++i) {
+      ++counts[index[i]];
+    }
+  }
+
+  for (std::size_t i = 0; i < _data.size(); ++i) {
+    _data[i] += counts[i + 1];
+  }
+  if (counts.front() > 0) {
+    _out_of_range.bin_underflow(counts.front());
+  }
+  if (counts.back() > 0) {
+    _out_of_range.bin_overflow(counts.back());
+  }
+}
+
+/**
+ * \brief Adds the contents of \arg other to this histogram.
+ *
+ * Both histograms must have the same axis.
+ */
+BASIC_HISTOGRAM_PARAMS_DEF
+void basic_histogram<BASIC_HISTOGRAM_PARAMS>::merge(
+    const basic_histogram<BASIC_HISTOGRAM_PARAMS> &other)
+{
+  if (other._data.size() != _data.size()) {
+    throw std::invalid_argument("merging histograms with different axes");
+  }
+  for (std::size_t i = 0; i < _data.size(); ++i) {
+    _data[i] += other._data[i];
+  }
+  _out_of_range.merge(other._out_of_range);
+}
+
 typedef basic_histogram<double, double> histogram;
 
 template<typename _binned_type_1_, typename _binned_type_2_>
@@ -1,9 +1,12 @@
 #include "histogram_reader.h"
 
+#include <algorithm>
+#include <cmath>
 #include <fstream>
 #include <stdexcept>
 
 #include "serializer.h"
+#include "sketch.h"
 
 histogram_reader::histogram_reader(const std::string &filename)
 {
@@ -44,8 +47,103 @@ std::vector<std::string> histogram_reader::names() const
   return ret;
 }
 
+namespace // anonymous
+{
+  /*
+   * Copies the contents of a binned histogram table: each non-empty bin gives
+   * one range.
+   */
+  void read_binned(const sol::table &t,
+                   std::vector<histogram_reader::range> &ranges)
+  {
+    double min = t["min"], max = t["max"];
+    int bins = t["bins"];
+    auto axis = hist::linear_axis<double>(min, max, bins);
+    double width = (max - min) / bins;
+    sol::table content = t["content"];
+    content.for_each([&](const sol::object &key, const sol::object &value) {
+      if (key.get_type() == sol::type::number &&
+          value.get_type() == sol::type::number) {
+        int bin = key.as<int>() - 1;
+        double low = min + bin * width;
+        ranges.push_back(histogram_reader::range{
+          low, low + width, axis.bin_center(bin), value.as<double>() });
+      }
+    });
+  }
+
+  /*
+   * Copies the buckets of a packed store (see lua_histogram.cpp). The sign is
+   * -1 for the store of negative values.
+   */
+  void read_sketch_store(const hist::sketch &s, const sol::table &t, int sign,
+                         std::vector<histogram_reader::range> &ranges)
+  {
+    sol::object offset = t["offset"];
+    if (offset.get_type() != sol::type::number) {
+      return; // Empty
+    }
+    int first = offset.as<int>() - 1;
+    t.for_each([&](const sol::object &key, const sol::object &value) {
+      if (key.get_type() == sol::type::number &&
+          value.get_type() == sol::type::number) {
+        int index = first + key.as<int>();
+        double low = sign * s.lower_bound(index);
+        double high = sign * s.upper_bound(index);
+        ranges.push_back(histogram_reader::range{
+          std::min(low, high), std::max(low, high), sign * s.value(index),
+          value.as<double>() });
+      }
+    });
+  }
+
+  /*
+   * Copies the contents of a sketch table: each non-empty bucket gives one
+   * range, and zero is a point.
+   */
+  void read_sketch(const sol::table &t,
+                   std::vector<histogram_reader::range> &ranges)
+  {
+    // Only used to compute the bucket boundaries
+    double relative_error = t["relative_error"];
+    auto s = hist::sketch(relative_error);
+    read_sketch_store(s, t["negative"], -1, ranges);
+    double zero = t["zero"];
+    if (zero != 0) {
+      ranges.push_back(histogram_reader::range{ 0, 0, 0, zero });
+    }
+    read_sketch_store(s, t["positive"], 1, ranges);
+  }
+
+  /*
+   * Copies the contents of an unbinned histogram table: there is one point
+   * per distinct value.
+   */
+  void read_unbinned(const sol::table &t,
+                     std::vector<histogram_reader::range> &ranges)
+  {
+    t.for_each([&](const sol::object &key, const sol::object &value) {
+      if (key.get_type() == sol::type::number &&
+          value.get_type() == sol::type::number) {
+        double x = key.as<double>();
+        ranges.push_back(histogram_reader::range{ x, x, x, value.as<double>() });
+      }
+    });
+  }
+} // anonymous namespace
+
 std::vector<std::pair<double, double>>
 histogram_reader::data(const std::string &name) const
+{
+  auto vector = std::vector<std::pair<double, double>>();
+  for (auto &r : ranges(name)) {
+    vector.push_back(std::make_pair(r.value, r.weight));
+  }
+  return vector;
+}
+
+std::vector<histogram_reader::range>
+histogram_reader::ranges(const std::string &name) const
 {
   // Find the histogram data
   sol::object data = _data[name];
@@ -55,17 +153,61 @@ histogram_reader::data(const std::string &name) const
   sol::table t = data;
 
   // Copy it
-  auto vector = std::vector<std::pair<double, double>>();
-  t.for_each([&](const sol::object &key, const sol::object &value) {
-    if (key.get_type() == sol::type::number &&
-        value.get_type() == sol::type::number) {
-      vector.push_back(std::make_pair(key.as<double>(), value.as<double>()));
-    }
-  });
+  auto vector = std::vector<range>();
+  sol::object kind = t["kind"];
+  if (kind.get_type() != sol::type::string) {
+    read_unbinned(t, vector);
+  } else if (kind.as<std::string>() == "binned") {
+    read_binned(t, vector);
+  } else if (kind.as<std::string>() == "sketch") {
+    read_sketch(t, vector);
+  } else {
+    throw std::runtime_error("Histogram \"" + name + "\" has unknown kind \"" +
+                             kind.as<std::string>() + "\"");
+  }
 
   return vector;
 }
 
+/**
+ * \brief Fills \arg h with the contents of \arg ranges.
+ *
+ * The weight of every range is spread uniformly over the bins it overlaps.
+ */
+void histogram_reader::rebin(const std::vector<range> &ranges,
+                             hist::histogram &h)
+{
+  const auto axis = h.axis();
+  const double width = (axis.max() - axis.min()) / axis.bin_count();
+
+  for (auto &r : ranges) {
+    if (r.high <= r.low) {
+      h.bin(r.value, r.weight);
+      continue;
+    }
+    double density = r.weight / (r.high - r.low);
+    double low = r.low;
+    while (low < r.high) {
+      // Find the end of the bin containing low
+      double next;
+      if (low < axis.min()) {
+        next = axis.min();
+      } else if (low >= axis.max()) {
+        next = r.high;
+      } else {
+        int bin = std::floor((low - axis.min()) / width);
+        next = axis.min() + (bin + 1) * width;
+        if (next <= low) {
+          next = axis.min() + (bin + 2) * width;
+        }
+      }
+      next = std::min(next, r.high);
+      h.bin(0.5 * (low + next), density * (next - low));
+      low = next;
+    }
+  }
+}
+
 hist::histogram histogram_reader::histogram(const std::string &name,
                                             double min, double max,
                                             int nbins) const
@@ -79,41 +221,29 @@ hist::histogram histogram_reader::histogram(const std::string &name,
   }
 
   // Find the histogram data
-  sol::object data = _data[name];
-  if (data.get_type() != sol::type::table) {
-    throw std::range_error("No histogram named \"" + name + "\" found!");
-  }
-  sol::table t = data;
+  auto data = ranges(name);
 
   // Find the bounds
   double data_min = std::numeric_limits<double>::max();
   double data_max = std::numeric_limits<double>::lowest();
-  t.for_each([&](const sol::object &key, const sol::object &value) {
-    if (key.get_type() == sol::type::number &&
-        value.get_type() == sol::type::number) {
-      if (data_max < key.as<double>() && key.as<double>() < max) {
-        data_max = key.as<double>();
-      }
-      if (data_min > key.as<double>() && key.as<double>() >= min) {
-        data_min = key.as<double>();
-      }
+  for (auto &r : data) {
+    if (data_max < r.high && r.high < max) {
+      data_max = r.high;
     }
-  });
+    if (data_min > r.low && r.low >= min) {
+      data_min = r.low;
+    }
+  }
 
   // Avoid empty ranges
-  if (data_max == data_min) {
+  if (data_max <= data_min) {
     data_min = min;
     data_max = max;
   }
 
   // Accumulate data
   auto h = hist::histogram(data_min, data_max, nbins);
-  t.for_each([&](const sol::object &key, const sol::object &value) {
-    if (key.get_type() == sol::type::number &&
-        value.get_type() == sol::type::number) {
-      h.bin(key.as<double>(), value.as<double>());
-    }
-  });
+  rebin(data, h);
 
   return h;
 }
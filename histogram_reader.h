@@ -16,11 +16,22 @@ class histogram_reader
   sol::state _lua; // Keep this first!
   sol::table _data;
 public:
+  /// Weight recorded for values in [low, high], represented by value
+  struct range
+  {
+    double low, high;
+    double value;
+    double weight;
+  };
+
   explicit histogram_reader(const std::string &filename);
   explicit histogram_reader(std::istream &in);
 
   std::vector<std::string> names() const;
   std::vector<std::pair<double, double>> data(const std::string &name) const;
+  std::vector<range> ranges(const std::string &name) const;
+
+  static void rebin(const std::vector<range> &ranges, hist::histogram &h);
 
   [[deprecated]]
   hist::histogram histogram(const std::string &name,
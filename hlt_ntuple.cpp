@@ -0,0 +1,125 @@
+#include "hlt_ntuple.h"
+
+#include <algorithm>
+#include <cmath>
+#include <random>
+
+#include <TFile.h>
+#include <TTree.h>
+
+#include "parsers.h"
+
+namespace // anonymous
+{
+  /*
+   * Adds the branches of the highest energy deposits of a calorimeter to a
+   * tree.
+   */
+  void add_maxima(TTree *tree, const std::string &prefix, double *values)
+  {
+    const char *names[] = { "EnergyMaxPlus", "EtaMaxPlus", "PhiMaxPlus",
+                            "EnergyMaxMinus", "EtaMaxMinus", "PhiMaxMinus" };
+    for (int i = 0; i < 6; ++i) {
+      std::string name = prefix + names[i];
+      tree->Branch(name.c_str(), &values[i], (name + "/D").c_str());
+    }
+  }
+} // anonymous namespace
+
+/**
+ * \brief Writes a file with the layout of the HLT ntuples and \c entries
+ *        entries of random contents.
+ *
+ * The contents only depend on the number of entries.
+ */
+void write_hlt_ntuple(const std::string &filename, long entries)
+{
+  TFile file(filename.c_str(), "RECREATE");
+  std::mt19937 gen(42);
+  std::poisson_distribution<int> track_count(8);
+  std::poisson_distribution<int> hit_count(40);
+  std::uniform_real_distribution<double> uniform(0, 1);
+  std::normal_distribution<double> normal(0, 1);
+
+  // Trees are owned by the file
+  TTree *tracks = new TTree("generalTracksTree", "Tracks");
+  int ntracks;
+  const int n = hlt_parser::BIG_TRACK_COUNT;
+  double chi2[n], lambda[n];
+  int ndof[n];
+  double p[n], x[n], y[n], z[n], phi[n], qoverp[n];
+  tracks->Branch("nTracks", &ntracks, "nTracks/I");
+  tracks->Branch("chi2", chi2, "chi2[nTracks]/D");
+  tracks->Branch("lambda", lambda, "lambda[nTracks]/D");
+  tracks->Branch("ndof", ndof, "ndof[nTracks]/I");
+  tracks->Branch("p", p, "p[nTracks]/D");
+  tracks->Branch("x", x, "x[nTracks]/D");
+  tracks->Branch("y", y, "y[nTracks]/D");
+  tracks->Branch("z", z, "z[nTracks]/D");
+  tracks->Branch("phi", phi, "phi[nTracks]/D");
+  tracks->Branch("qoverp", qoverp, "qoverp[nTracks]/D");
+
+  TTree *castor = new TTree("CastorRecTree", "CASTOR");
+  unsigned nhits;
+  int module[hlt_parser::BIG_HIT_COUNT], sector[hlt_parser::BIG_HIT_COUNT];
+  float data[hlt_parser::BIG_HIT_COUNT];
+  castor->Branch("nCastorRecHits", &nhits, "nCastorRecHits/i");
+  castor->Branch("CastorRecHitModule", module,
+                 "CastorRecHitModule[nCastorRecHits]/I");
+  castor->Branch("CastorRecHitSector", sector,
+                 "CastorRecHitSector[nCastorRecHits]/I");
+  castor->Branch("CastorRecHitData", data,
+                 "CastorRecHitData[nCastorRecHits]/F");
+
+  double hb[6], he[6], hf[6], eb[6], ee[6];
+  TTree *hbhe = new TTree("HBHERecHitTree", "HB and HE");
+  add_maxima(hbhe, "HB", hb);
+  add_maxima(hbhe, "HE", he);
+  TTree *hftree = new TTree("HFRecHitTree", "HF");
+  add_maxima(hftree, "HF", hf);
+  TTree *ebtree = new TTree("EBRecHitTree", "EB");
+  add_maxima(ebtree, "EB", eb);
+  TTree *eetree = new TTree("EERecHitTree", "EE");
+  add_maxima(eetree, "EE", ee);
+
+  TTree *zdc = new TTree("ZDCDigiTree", "ZDC");
+  float zdc_plus[10], zdc_minus[10];
+  zdc->Branch("posHD1fC", zdc_plus, "posHD1fC[10]/F");
+  zdc->Branch("negHD1fC", zdc_minus, "negHD1fC[10]/F");
+
+  for (long entry = 0; entry < entries; ++entry) {
+    ntracks = std::min(track_count(gen), hlt_parser::BIG_TRACK_COUNT);
+    for (int i = 0; i < ntracks; ++i) {
+      chi2[i] = 10 * uniform(gen);
+      lambda[i] = normal(gen);
+      ndof[i] = 5 + 10 * uniform(gen);
+      p[i] = 0.1 + 2 * uniform(gen);
+      x[i] = 0.1 * normal(gen);
+      y[i] = 0.1 * normal(gen);
+      z[i] = 5 * normal(gen);
+      phi[i] = 2 * M_PI * uniform(gen);
+      qoverp[i] = (uniform(gen) > 0.5 ? 1 : -1) / p[i];
+    }
+    nhits = std::min(hit_count(gen), hlt_parser::BIG_HIT_COUNT);
+    for (unsigned i = 0; i < nhits; ++i) {
+      module[i] = 1 + 14 * uniform(gen);
+      sector[i] = 1 + 16 * uniform(gen);
+      data[i] = 100 * uniform(gen);
+    }
+    for (double *values : { hb, he, hf, eb, ee }) {
+      for (int i = 0; i < 6; ++i) {
+        values[i] = 10 * uniform(gen);
+      }
+    }
+    for (int i = 0; i < 10; ++i) {
+      zdc_plus[i] = 100 * uniform(gen);
+      zdc_minus[i] = 100 * uniform(gen);
+    }
+    for (TTree *tree : { tracks, castor, hbhe, hftree, ebtree, eetree,
+                         zdc }) {
+      tree->Fill();
+    }
+  }
+  file.Write();
+  file.Close();
+}
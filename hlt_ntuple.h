@@ -0,0 +1,8 @@
+#ifndef HLT_NTUPLE_H
+#define HLT_NTUPLE_H
+
+#include <string>
+
+void write_hlt_ntuple(const std::string &filename, long entries);
+
+#endif // HLT_NTUPLE_H
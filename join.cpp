@@ -0,0 +1,285 @@
+
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <tuple>
+#include <unordered_map>
+#include <vector>
+
+#include "serializer.h"
+
+namespace // anonymous
+{
+  /// Value of the key field of an event
+  struct key
+  {
+    bool valid = false; ///< False if the event has no key
+    bool is_string = false;
+    double number = 0;
+    std::string string;
+
+    bool operator<(const key &other) const
+    {
+      return std::tie(is_string, number, string) <
+             std::tie(other.is_string, other.number, other.string);
+    }
+
+    bool operator==(const key &other) const
+    {
+      return is_string == other.is_string && number == other.number &&
+             string == other.string;
+    }
+  };
+
+  struct key_hash
+  {
+    std::size_t operator()(const key &k) const
+    {
+      return k.is_string ? std::hash<std::string>()(k.string)
+                         : std::hash<double>()(k.number);
+    }
+  };
+
+  /*
+   * Events of an input file with their keys.
+   */
+  class input
+  {
+    std::string _filename, _field;
+    std::ifstream _file;
+    unserializer _in;
+    std::vector<std::string> _path;
+    bool _sorted;
+    key _last;
+
+  public:
+    input(const std::string &filename, const std::string &field, bool sorted);
+
+    bool good() const { return bool(_file); }
+    bool next(record &event, key &k);
+  };
+
+  /*
+   * Opens a file. The key is read from the field, whose parts are separated
+   * by dots. If sorted is set, next() checks that the keys don't decrease.
+   */
+  input::input(const std::string &filename, const std::string &field,
+               bool sorted) :
+    _filename(filename),
+    _field(field),
+    _file(filename, std::ios::binary),
+    _in(_file),
+    _sorted(sorted)
+  {
+    std::istringstream parts(field);
+    std::string part;
+    while (std::getline(parts, part, '.')) {
+      _path.push_back(part);
+    }
+  }
+
+  /*
+   * Reads the next event and its key. Returns false at the end of the file.
+   * Events that don't have the key field, or where it isn't a number or a
+   * string, get an invalid key.
+   */
+  bool input::next(record &event, key &k)
+  {
+    bool eof;
+    event = record();
+    _in.read(event, eof);
+    if (eof) {
+      return false;
+    }
+
+    k = key();
+    const record *value = &event;
+    for (const std::string &name : _path) {
+      value = value->is_table() ? value->get(name) : nullptr;
+      if (value == nullptr) {
+        return true;
+      }
+    }
+    if (value->type() == record::kind::number) {
+      k.valid = true;
+      k.number = value->as_number();
+    } else if (value->type() == record::kind::string) {
+      k.valid = true;
+      k.is_string = true;
+      k.string = value->as_string();
+    }
+
+    if (_sorted && k.valid) {
+      if (_last.valid && k < _last) {
+        throw std::runtime_error(_filename + " isn't sorted by " + _field +
+                                 ", use -u");
+      }
+      _last = k;
+    }
+    return true;
+  }
+
+  /*
+   * Writes an event with gen and rec subtables. rec is left out if null.
+   */
+  void write_joined(serializer &ser, const record &gen, const record *rec)
+  {
+    record out = record::table();
+    out.add("gen", gen);
+    if (rec != nullptr) {
+      out.add("rec", *rec);
+    }
+    ser.write(out);
+  }
+
+  /*
+   * Joins two streams sorted by key. Only the rec events with the current key
+   * are kept in memory.
+   */
+  long merge_join(input &gen, input &rec, bool left, serializer &ser,
+                  long &total)
+  {
+    long matched = 0;
+    std::vector<record> group; // rec events with group_key
+    key group_key;
+    record r;
+    key rk;
+    bool rec_more = rec.next(r, rk);
+
+    record g;
+    key gk;
+    while (std::cout && gen.next(g, gk)) {
+      ++total;
+      if (gk.valid && (group.empty() || group_key < gk)) {
+        group.clear();
+        // Skip rec events before gk
+        while (rec_more && (!rk.valid || rk < gk)) {
+          rec_more = rec.next(r, rk);
+        }
+        if (rec_more && rk == gk) {
+          group_key = rk;
+          while (rec_more && rk == group_key) {
+            group.push_back(std::move(r));
+            rec_more = rec.next(r, rk);
+          }
+        }
+      }
+
+      if (gk.valid && !group.empty() && group_key == gk) {
+        ++matched;
+        for (const record &match : group) {
+          write_joined(ser, g, &match);
+        }
+      } else if (left) {
+        write_joined(ser, g, nullptr);
+      }
+    }
+    return matched;
+  }
+
+  /*
+   * Joins two streams in any order. The rec events are kept in memory.
+   */
+  long hash_join(input &gen, input &rec, bool left, serializer &ser,
+                 long &total)
+  {
+    std::unordered_map<key, std::vector<record>, key_hash> table;
+    record r;
+    key rk;
+    while (rec.next(r, rk)) {
+      if (rk.valid) {
+        table[rk].push_back(std::move(r));
+      }
+    }
+
+    long matched = 0;
+    record g;
+    key gk;
+    while (std::cout && gen.next(g, gk)) {
+      ++total;
+      auto it = gk.valid ? table.find(gk) : table.end();
+      if (it != table.end()) {
+        ++matched;
+        for (const record &match : it->second) {
+          write_joined(ser, g, &match);
+        }
+      } else if (left) {
+        write_joined(ser, g, nullptr);
+      }
+    }
+    return matched;
+  }
+} // anonymous namespace
+
+/*
+ * Reads two event streams and prints the events whose key fields are equal to
+ * standard output, as a table with the gen and rec events. The key is "id"
+ * unless given with -k, and can be a field of a subtable ("a.b"). An event
+ * matching several events of the other stream is written once per match.
+ *
+ * Both streams must be sorted by key: they are then read once in parallel,
+ * in constant memory. Unsorted streams are an error, unless -u is given; the
+ * rec events are then all loaded in memory.
+ *
+ * Only matching events are written by default. With -l, gen events without a
+ * match are also written, without rec.
+ */
+int main(int argc, char **argv)
+{
+  // Read options
+  std::string field = "id";
+  bool left = false;
+  bool sorted = true;
+  while (argc > 3 && argv[1][0] == '-') {
+    std::string option = argv[1];
+    int used = 1;
+    if (option == "-k") {
+      // Key field
+      field = argv[2];
+      used = 2;
+    } else if (option == "-l") {
+      // Left join
+      left = true;
+    } else if (option == "-u") {
+      // Unsorted input
+      sorted = false;
+    } else {
+      break;
+    }
+    // Remove the option
+    argv[used] = argv[0];
+    argv += used;
+    argc -= used;
+  }
+
+  if (argc != 3) {
+    std::cout << "Usage: " << argv[0]
+              << " [-k field] [-l] [-u] gen.events rec.events" << std::endl;
+    return 1;
+  }
+  input gen(argv[1], field, sorted);
+  input rec(argv[2], field, sorted);
+  for (int i = 1; i <= 2; ++i) {
+    if (!(i == 1 ? gen : rec).good()) {
+      std::cerr << "ERROR: Could not open " << argv[i] << std::endl;
+      return 1;
+    }
+  }
+
+  serializer ser(std::cout);
+  long matched, total = 0;
+  try {
+    matched = sorted ? merge_join(gen, rec, left, ser, total)
+                     : hash_join(gen, rec, left, ser, total);
+  } catch (const std::runtime_error &e) {
+    std::cerr << "ERROR: " << e.what() << std::endl;
+    return 3;
+  }
+
+  std::cerr << "[INFO] Matched " << matched << " of " << total
+            << " gen events" << std::endl;
+  return 0;
+}
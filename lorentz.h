@@ -57,6 +57,9 @@ public:
   /// Constructs a 4-vector with the given temporal and spatial components
   /// (given in spherical coordinates)
   inline static vec m_r_phi_theta(double m, double r, double phi, double theta);
+  /// Constructs a 4-vector with the given mass, energy and direction, like
+  /// vec.m_e_phi_eta in lorentz.lua
+  inline static vec m_e_phi_eta(double m, double e, double phi, double eta);
 };
 
 vec vec::operator-() const
@@ -145,6 +148,13 @@ vec vec::m_r_phi_theta(double m, double r, double phi, double theta)
               r * std::sin(theta));
 }
 
+vec vec::m_e_phi_eta(double m, double e, double phi, double eta)
+{
+  double p = std::sqrt(e * e - m * m);
+  double pt = p / std::cosh(eta);
+  return txyz(e, pt * std::cos(phi), pt * std::sin(phi), p * std::tanh(eta));
+}
+
 
 inline double eta(const vec &v)
 {
@@ -0,0 +1,55 @@
+-- Lua versions of the functions that expressions given to process with --expr
+-- can use. The body is passed as a function of the element, as done by
+-- predicate::lua_expression(): count(e.tracks, it.q > 0) is written
+-- count(e.tracks, function(it) return it.q > 0 end).
+
+local function check_array(name, array)
+  if type(array) ~= "table" then
+    error("bad argument #1 to '" .. name .. "' (table expected, got " ..
+          type(array) .. ")", 3)
+  end
+end
+
+-- Sum of the values of f over the elements of the array
+function sum(array, f)
+  check_array("sum", array)
+  local total = 0
+  for _, it in ipairs(array) do
+    total = total + f(it)
+  end
+  return total
+end
+
+-- Number of elements of the array for which f is true
+function count(array, f)
+  check_array("count", array)
+  local total = 0
+  for _, it in ipairs(array) do
+    if f(it) then
+      total = total + 1
+    end
+  end
+  return total
+end
+
+-- Whether f is true for all the elements of the array
+function all(array, f)
+  check_array("all", array)
+  for _, it in ipairs(array) do
+    if not f(it) then
+      return false
+    end
+  end
+  return true
+end
+
+-- Whether f is true for at least one element of the array
+function any(array, f)
+  check_array("any", array)
+  for _, it in ipairs(array) do
+    if f(it) then
+      return true
+    end
+  end
+  return false
+end
@@ -23,10 +23,60 @@ function histogram_list.new()
   return setmetatable({}, histogram_list)
 end
 
+-- Histograms are stored in the list itself, so they can't take the name of a
+-- method: it would hide the method.
+function histogram_list.__newindex(self, name, value)
+  if histogram_list[name] ~= nil then
+    error("'" .. tostring(name) .. "' is reserved and can't name a histogram",
+          2)
+  end
+  rawset(self, name, value)
+end
+
 function histogram_list.__index(self, name)
+  if histogram_list[name] then
+    return histogram_list[name]
+  end
   self[name] = histogram.new()
   return self[name]
 end
 
+-- Creates a binned histogram (only available if the host program registered
+-- binned_histogram). Booking an existing histogram returns it unchanged, so
+-- this can be called for every event.
+function histogram_list:book(name, min, max, bins)
+  local h = rawget(self, name)
+  if not h then
+    h = binned_histogram.new(min, max, bins)
+    self[name] = h
+  end
+  return h
+end
+
+-- Creates an auto-ranging histogram that records values with the given relative
+-- error (only available if the host program registered sketch_histogram).
+function histogram_list:sketch(name, relative_error)
+  local h = rawget(self, name)
+  if not h then
+    h = sketch_histogram.new(relative_error or 0.01)
+    self[name] = h
+  end
+  return h
+end
+
+-- Returns a copy of the list where native histograms are replaced by tables
+-- suitable for serialization.
+function histogram_list:pack()
+  local packed = {}
+  for name, h in pairs(self) do
+    if type(h) == "userdata" then
+      packed[name] = h:pack()
+    else
+      packed[name] = h
+    end
+  end
+  return packed
+end
+
 setmetatable(histogram_list,
              { __call = function(...) return histogram_list.new(...) end })
@@ -90,6 +90,13 @@ function vec.m_x_y_z(m, x, y, z)
   return vec.new(t, x, y, z)
 end
 
+function vec.m_r_phi_theta(m, r, phi, theta)
+  return vec.m_x_y_z(m,
+                     r * math.cos(theta) * math.cos(phi),
+                     r * math.cos(theta) * math.sin(phi),
+                     r * math.sin(theta))
+end
+
 function vec:clone()
   return vec.new(self.t, self.x, self.y, self.z)
 end
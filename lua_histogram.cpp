@@ -0,0 +1,146 @@
+#include "lua_histogram.h"
+
+#include <cmath>
+#include <stdexcept>
+
+namespace // anonymous
+{
+  /*
+   * Returns the axis of a binned histogram, checking the parameters before
+   * the bins are allocated.
+   */
+  hist::linear_axis<double> checked_axis(double min, double max, int bins)
+  {
+    // Avoid bad parameters
+    if (!std::isfinite(min) || !std::isfinite(max)) {
+      throw std::logic_error("Cannot make histogram with non-finite bounds!");
+    }
+    if (min >= max) {
+      throw std::logic_error("Cannot make histogram with min >= max!");
+    }
+    if (bins <= 0) {
+      throw std::logic_error("Cannot make histogram with less than 1 bin!");
+    }
+    return hist::linear_axis<double>(min, max, bins);
+  }
+} // anonymous namespace
+
+binned_histogram::binned_histogram(double min, double max, int bins) :
+  _histogram(checked_axis(min, max, bins))
+{}
+
+sol::table binned_histogram::pack(sol::this_state s) const
+{
+  sol::state_view lua(s);
+  const auto axis = _histogram.axis();
+
+  sol::table packed = lua.create_table();
+  packed["kind"] = "binned";
+  packed["min"] = axis.min();
+  packed["max"] = axis.max();
+  packed["bins"] = axis.bin_count();
+  packed["underflow"] = _histogram.out_of_range().underflow();
+  packed["overflow"] = _histogram.out_of_range().overflow();
+
+  // Empty bins are left out to keep the serialized form small
+  sol::table content = lua.create_table();
+  int i = 1;
+  for (auto it = _histogram.begin(); it != _histogram.end(); ++it, ++i) {
+    if (*it != 0) {
+      content[i] = *it;
+    }
+  }
+  packed["content"] = content;
+
+  return packed;
+}
+
+namespace // anonymous
+{
+  /*
+   * Packs the non-empty buckets of a store. Bucket i is saved at position
+   * i - offset + 1.
+   */
+  sol::table pack_store(sol::state_view &lua, const hist::bucket_store &store)
+  {
+    sol::table packed = lua.create_table();
+    if (!store.empty()) {
+      packed["offset"] = store.min_index();
+      for (int i = store.min_index(); i <= store.max_index(); ++i) {
+        if (store.count(i) != 0) {
+          packed[i - store.min_index() + 1] = store.count(i);
+        }
+      }
+    }
+    return packed;
+  }
+
+  /*
+   * Adds the buckets of a packed store to a store.
+   */
+  void unpack_store(const sol::table &packed, hist::bucket_store &store,
+                    std::size_t max_buckets)
+  {
+    sol::object offset = packed["offset"];
+    if (offset.get_type() != sol::type::number) {
+      return; // Empty
+    }
+    int first = offset.as<int>() - 1;
+    packed.for_each([&](const sol::object &key, const sol::object &value) {
+      if (key.get_type() == sol::type::number &&
+          value.get_type() == sol::type::number) {
+        store.add(first + key.as<int>(), value.as<double>(), max_buckets);
+      }
+    });
+  }
+} // anonymous namespace
+
+sketch_histogram::sketch_histogram(double relative_error) :
+  _sketch(relative_error)
+{}
+
+sol::table sketch_histogram::pack(sol::this_state s) const
+{
+  sol::state_view lua(s);
+
+  sol::table packed = lua.create_table();
+  packed["kind"] = "sketch";
+  packed["relative_error"] = _sketch.relative_error();
+  packed["zero"] = _sketch.zero();
+  packed["positive"] = pack_store(lua, _sketch.positive());
+  packed["negative"] = pack_store(lua, _sketch.negative());
+
+  return packed;
+}
+
+sketch_histogram sketch_histogram::unpack(const sol::table &packed)
+{
+  double relative_error = packed["relative_error"];
+  sketch_histogram h(relative_error);
+  std::size_t max_buckets = h._sketch.max_buckets();
+  unpack_store(packed["positive"], h._sketch.positive(), max_buckets);
+  unpack_store(packed["negative"], h._sketch.negative(), max_buckets);
+  h._sketch.zero() = packed["zero"];
+  return h;
+}
+
+void register_histograms(sol::state &lua)
+{
+  lua.new_usertype<binned_histogram>("binned_histogram",
+    sol::constructors<sol::types<double, double, int>>(),
+    "fill", sol::overload(
+      static_cast<void (binned_histogram::*)(double)>(&binned_histogram::fill),
+      static_cast<void (binned_histogram::*)(double, double)>(
+        &binned_histogram::fill)),
+    "pack", &binned_histogram::pack);
+
+  lua.new_usertype<sketch_histogram>("sketch_histogram",
+    sol::constructors<sol::types<double>>(),
+    "fill", sol::overload(
+      static_cast<void (sketch_histogram::*)(double)>(&sketch_histogram::fill),
+      static_cast<void (sketch_histogram::*)(double, double)>(
+        &sketch_histogram::fill)),
+    "merge", &sketch_histogram::merge,
+    "pack", &sketch_histogram::pack,
+    "unpack", &sketch_histogram::unpack);
+}
@@ -0,0 +1,56 @@
+#ifndef LUA_HISTOGRAM_H
+#define LUA_HISTOGRAM_H
+
+#include "sol.hpp"
+
+#include "histogram.h"
+#include "sketch.h"
+
+/**
+ * \brief Fixed-axis histogram usable from Lua
+ *
+ * Unlike the tables created by histogram.lua, which record every distinct value
+ * filled, this histogram has a fixed number of bins. Filling it never allocates
+ * Lua memory. Use pack() to get a table that can be serialized; the
+ * histogram_reader understands it.
+ */
+class binned_histogram
+{
+  hist::histogram _histogram;
+
+public:
+  explicit binned_histogram(double min, double max, int bins);
+
+  void fill(double value) { _histogram.bin(value); }
+  void fill(double value, double weight) { _histogram.bin(value, weight); }
+
+  sol::table pack(sol::this_state s) const;
+};
+
+/**
+ * \brief Auto-ranging histogram usable from Lua
+ *
+ * Wraps a hist::sketch: values are recorded with a bounded relative error and
+ * the range doesn't need to be known in advance. Like binned_histogram, it is
+ * serialized using pack(). unpack() reads a packed sketch back, for instance to
+ * merge the results of several files.
+ */
+class sketch_histogram
+{
+  hist::sketch _sketch;
+
+public:
+  explicit sketch_histogram(double relative_error);
+
+  void fill(double value) { _sketch.bin(value); }
+  void fill(double value, double weight) { _sketch.bin(value, weight); }
+  void merge(const sketch_histogram &other) { _sketch.merge(other._sketch); }
+
+  sol::table pack(sol::this_state s) const;
+  static sketch_histogram unpack(const sol::table &packed);
+};
+
+/// Makes the native histogram types available to Lua code
+void register_histograms(sol::state &lua);
+
+#endif // LUA_HISTOGRAM_H
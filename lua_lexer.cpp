@@ -0,0 +1,139 @@
+#include "lua_lexer.h"
+
+#include <algorithm>
+#include <cctype>
+#include <set>
+
+namespace // anonymous
+{
+  const std::set<std::string> keywords = {
+    "and", "break", "do", "else", "elseif", "end", "false", "for", "function",
+    "goto", "if", "in", "local", "nil", "not", "or", "repeat", "return", "then",
+    "true", "until", "while"
+  };
+
+  /*
+   * Returns the length of the opening or closing bracket of a long string or
+   * comment starting at pos ([[, [==[, ]], ]==]...), or 0 if there is none.
+   */
+  std::size_t long_bracket(const std::string &code, std::size_t pos, char c)
+  {
+    if (pos >= code.size() || code[pos] != c) {
+      return 0;
+    }
+    std::size_t i = pos + 1;
+    while (i < code.size() && code[i] == '=') {
+      ++i;
+    }
+    return (i < code.size() && code[i] == c) ? i - pos + 1 : 0;
+  }
+
+  /*
+   * Skips a long string or comment whose opening bracket has length len.
+   */
+  std::size_t skip_long(const std::string &code, std::size_t pos,
+                        std::size_t len)
+  {
+    std::string close = "]" + std::string(len - 2, '=') + "]";
+    std::size_t end = code.find(close, pos + len);
+    return end == std::string::npos ? code.size() : end + close.size();
+  }
+} // anonymous namespace
+
+bool lua_token::is_keyword() const
+{
+  return kind == name && keywords.count(text) > 0;
+}
+
+std::vector<lua_token> lua_tokenize(const std::string &code,
+                                    std::vector<std::string> *comments)
+{
+  typedef lua_token token;
+  std::vector<token> tokens;
+  std::size_t i = 0;
+  int line = 1;
+  while (i < code.size()) {
+    std::size_t start = i, count = tokens.size();
+    char c = code[i];
+    if (std::isspace((unsigned char) c)) {
+      ++i;
+    } else if (code.compare(i, 2, "--") == 0) {
+      std::size_t len = long_bracket(code, i + 2, '[');
+      std::size_t end;
+      std::string comment;
+      if (len > 0) {
+        end = skip_long(code, i + 2, len);
+        comment = code.substr(i + 2 + len, end - i - 2 - 2 * len);
+      } else {
+        end = code.find('\n', i);
+        end = (end == std::string::npos ? code.size() : end);
+        comment = code.substr(i + 2, end - i - 2);
+      }
+      if (comments != nullptr) {
+        comments->push_back(comment);
+      }
+      i = end;
+    } else if (std::isalpha((unsigned char) c) || c == '_') {
+      std::size_t begin = i;
+      while (i < code.size() &&
+             (std::isalnum((unsigned char) code[i]) || code[i] == '_')) {
+        ++i;
+      }
+      tokens.push_back(token{ token::name, code.substr(begin, i - begin) });
+    } else if (std::isdigit((unsigned char) c) ||
+               (c == '.' && i + 1 < code.size() &&
+                std::isdigit((unsigned char) code[i + 1]))) {
+      std::size_t begin = i;
+      while (i < code.size() &&
+             (std::isalnum((unsigned char) code[i]) || code[i] == '.' ||
+              ((code[i] == '+' || code[i] == '-') &&
+               std::string("eEpP").find(code[i - 1]) != std::string::npos))) {
+        ++i;
+      }
+      tokens.push_back(token{ token::number, code.substr(begin, i - begin) });
+    } else if (c == '"' || c == '\'') {
+      std::string text;
+      for (++i; i < code.size() && code[i] != c; ++i) {
+        if (code[i] == '\\') {
+          ++i;
+        }
+        if (i < code.size()) {
+          text += code[i];
+        }
+      }
+      ++i;
+      tokens.push_back(token{ token::string, text });
+    } else if (std::size_t len = long_bracket(code, i, '[')) {
+      std::size_t end = skip_long(code, i, len);
+      tokens.push_back(token{ token::string,
+                              code.substr(i + len, end - i - 2 * len) });
+      i = end;
+    } else {
+      static const char *const long_ops[] = {
+        "...", "..", "==", "~=", "<=", ">=", "::"
+      };
+      std::string text(1, c);
+      for (const char *op : long_ops) {
+        if (code.compare(i, std::string(op).size(), op) == 0) {
+          text = op;
+          break;
+        }
+      }
+      i += text.size();
+      tokens.push_back(token{ token::op, text });
+    }
+
+    // Keep track of line numbers and positions
+    i = std::min(i, code.size());
+    if (tokens.size() > count) {
+      tokens.back().line = line;
+      tokens.back().begin = start;
+      tokens.back().end = i;
+    }
+    line += std::count(code.begin() + start, code.begin() + i, '\n');
+  }
+  tokens.push_back(token{ token::eof, "" });
+  tokens.back().line = line;
+  tokens.back().begin = tokens.back().end = code.size();
+  return tokens;
+}
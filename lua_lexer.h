@@ -0,0 +1,35 @@
+#ifndef LUA_LEXER_H
+#define LUA_LEXER_H
+
+#include <cstddef>
+#include <string>
+#include <vector>
+
+/**
+ * \brief Token of Lua source code
+ */
+struct lua_token
+{
+  enum kind_type { name, number, string, op, eof };
+  kind_type kind;
+  std::string text; ///< Contents of strings are unescaped
+  int line = 0;
+  std::size_t begin = 0, end = 0; ///< Position in the code
+
+  bool is_op(const char *op) const
+  { return kind == lua_token::op && text == op; }
+  bool is_name(const char *name) const
+  { return kind == lua_token::name && text == name; }
+  bool is_keyword() const;
+};
+
+/**
+ * \brief Splits Lua code into tokens
+ *
+ * The last token is always of kind eof. The text of comments is appended to
+ * \c comments if it isn't null.
+ */
+std::vector<lua_token> lua_tokenize(
+  const std::string &code, std::vector<std::string> *comments = nullptr);
+
+#endif // LUA_LEXER_H
@@ -2,16 +2,19 @@
 #include <fstream>
 #include <iostream>
 #include <numeric>
+#include <stdexcept>
+#include <thread>
 
 #include <QApplication>
 
-#include "cached_event_source.h"
+#include "columnar_event_source.h"
 #include "histogram.h"
 #include "histogram-qt.h"
 #include "main_window.h"
 #include "parsers.h"
 #include "run.h"
 #include "run_config.h"
+#include "stream_event_source.h"
 
 int main(int argc, char **argv) {
   QApplication app(argc, argv);
@@ -21,6 +24,7 @@ int main(int argc, char **argv) {
 
   // Histograms
   run r;
+  r.set_threads(std::thread::hardware_concurrency());
   hist::linear_axis<double> mass_axis = hist::linear_axis<double>(0, 4, 200);
   r.add_fill("mass", mass_axis, [](const event &e) {
     return e.p.norm();
@@ -240,14 +244,26 @@ int main(int argc, char **argv) {
     });
   });
 
-  hlt_parser hparser("/home/louis/Documents/ULB/MA1/Mémoire/data/out.root");
-  root_parser rparser("/home/louis/Documents/ULB/MA1/Mémoire/starlight/data/pipiv_GR_pipi_m_pt_y.root");
-  starlight_parser parser("/home/louis/Documents/ULB/MA1/Mémoire/starlight/data/slight.rho.out");
-
   // Loop over events
-  main_window *win = new main_window(r, rc,
-                                     new cached_event_source(&hparser, 300000));
-  win->showMaximized();
+  event_source *cache;
+  if (argc > 1) {
+    // An event stream, such as a skim made by the analysis. It caches the
+    // events itself.
+    try {
+      cache = new stream_event_source(argv[1]);
+    } catch (const std::runtime_error &e) {
+      std::cerr << "ERROR: " << e.what() << std::endl;
+      return 3;
+    }
+  } else {
+    hlt_parser *hparser =
+        new hlt_parser("/home/louis/Documents/ULB/MA1/Mémoire/data/out.root");
+    // Events that don't fit in 2 GB are written to disk
+    cache = new columnar_event_source(hparser, 300000, std::size_t(2) << 30);
+  }
+  // On the stack, so that the background run is stopped before exiting
+  main_window win(r, rc, cache);
+  win.showMaximized();
 
   return app.exec();
 }
@@ -1,22 +1,38 @@
 #include "main_window.h"
 
+#include <algorithm>
+#include <chrono>
 #include <fstream>
+#include <iostream>
+#include <stdexcept>
 
 #include <QAction>
 #include <QFileDialog>
+#include <QHeaderView>
 #include <QSplitter>
+#include <QStringList>
 #include <QToolBar>
 #include <QToolButton>
 
 #include "histogram-qt.h"
 
+namespace // anonymous
+{
+  /// The plots are updated every this many events...
+  const std::size_t progress_events = 100000;
+  /// ...or after this time, whichever comes first
+  const std::chrono::milliseconds progress_interval(250);
+} // anonymous namespace
+
 main_window::main_window(run basic_run, run_config *rc, event_source *in) :
   _basic_run(basic_run),
   _config(rc),
   _event_source(in),
   _plot(new QCustomPlot),
   _plots(new QListWidget),
-  _log_scale(false)
+  _cutflow(new QTableWidget(0, 4)),
+  _log_scale(false),
+  _cancel(false)
 {
   setWindowTitle("Li He");
 
@@ -32,12 +48,29 @@ main_window::main_window(run basic_run, run_config *rc, event_source *in) :
   _plot->yAxis2->setVisible(true);
   resize(600, 400);
 
+  std::vector<std::string> names = _basic_run.fill_names();
+  std::sort(names.begin(), names.end());
+  for (const std::string &name : names) {
+    _plots->addItem(name.c_str());
+  }
+  _plots->setCurrentRow(0);
+
+  _cutflow->setHorizontalHeaderLabels(
+      QStringList() << "Cut" << "Events" << "Rejects"
+                    << QString::fromUtf8("Time (µs)"));
+  _cutflow->verticalHeader()->setVisible(false);
+  _cutflow->setEditTriggers(QAbstractItemView::NoEditTriggers);
+
   refresh_results();
   connect(_config, SIGNAL(config_changed()), this, SLOT(refresh_results()));
   connect(_plots, SIGNAL(currentRowChanged(int)), this, SLOT(show_plot(int)));
 
+  QSplitter *cuts = new QSplitter(Qt::Vertical);
+  cuts->addWidget(_config);
+  cuts->addWidget(_cutflow);
+
   QSplitter *splitter = new QSplitter(Qt::Horizontal);
-  splitter->addWidget(_config);
+  splitter->addWidget(cuts);
   splitter->addWidget(_plots);
   splitter->addWidget(_plot);
   splitter->setStretchFactor(2, 100);
@@ -56,43 +89,187 @@ main_window::main_window(run basic_run, run_config *rc, event_source *in) :
   action = tools->addAction("Log scale");
   action->setCheckable(true);
   connect(action, SIGNAL(toggled(bool)), this, SLOT(set_log_scale(bool)));
+
+  action = tools->addAction("Order cuts by cost");
+  action->setCheckable(true);
+  connect(action, SIGNAL(toggled(bool)),
+          this, SLOT(set_adaptive_order(bool)));
 }
 
 std::string main_window::current_plot_name() const
 {
-  QStringList plot_names;
-  for (const auto &element : _result.histos) {
-    plot_names << element.first.c_str();
+  QListWidgetItem *item = _plots->currentItem();
+  if (item == nullptr) {
+    item = _plots->item(0);
   }
-  int selected = _plots->currentRow();
-  selected = selected < 0 ? 0 : selected;
-  return plot_names[selected < 0 ? 0 : selected].toLatin1().data();
+  return item == nullptr ? std::string() : item->text().toLatin1().data();
+}
+
+main_window::~main_window()
+{
+  stop_worker();
 }
 
+/*
+ * Cancels the background run and waits for it to stop.
+ */
+void main_window::stop_worker()
+{
+  if (_worker.joinable()) {
+    _cancel = true;
+    _worker.join();
+    _cancel = false;
+  }
+}
+
+/*
+ * Hands results over to the GUI thread. Called from the background run.
+ * Only complete results have a cut flow.
+ */
+void main_window::publish(const run::result *result, bool complete,
+                          bool finished)
+{
+  {
+    std::lock_guard<std::mutex> lock(_mutex);
+    if (result != nullptr) {
+      for (const auto &element : result->histos) {
+        _pending.histos.erase(element.first);
+        _pending.histos.insert(element);
+      }
+      if (complete) {
+        _pending.events = result->events;
+        _pending.cutflow = result->cutflow;
+        _new_cutflow = true;
+      }
+    }
+    _finished = finished;
+  }
+  QMetaObject::invokeMethod(this, "show_results", Qt::QueuedConnection);
+}
+
+/*
+ * Starts a run with the current configuration in the background, cancelling
+ * the previous one. The plot on screen is computed first, then the others.
+ * The plots are updated as the histograms are filled.
+ */
 void main_window::refresh_results()
 {
-  setCursor(Qt::WaitCursor);
+  stop_worker();
+  {
+    // Drop the results of the cancelled run
+    std::lock_guard<std::mutex> lock(_mutex);
+    _pending.histos.clear();
+    _new_cutflow = false;
+    _finished = false;
+  }
+  // The plot on screen stays until it is replaced
+  _result.histos.clear();
+
+  setCursor(Qt::BusyCursor);
 
   run r = _basic_run;
   _config->fill_run(r);
-  _event_source->reset();
-  _result = r(_event_source);
+  r.set_progress([this](const run::result &partial) {
+    publish(&partial, false, false);
+  }, progress_events, progress_interval);
+  r.set_cancel(&_cancel);
+  r.set_adaptive_order(_adaptive_order);
+
+  std::vector<std::string> shown, others;
+  for (const std::string &name : r.fill_names()) {
+    (name == current_plot_name() ? shown : others).push_back(name);
+  }
+
+  _worker = std::thread([this, r, shown, others]() mutable {
+    try {
+      if (!shown.empty()) {
+        _event_source->reset();
+        run::result result = r(_event_source, shown);
+        publish(&result, true, others.empty());
+      }
+      if (!others.empty()) {
+        _event_source->reset();
+        run::result result = r(_event_source, others);
+        publish(&result, true, true);
+      }
+    } catch (const run::cancelled &) {
+      // A newer run was started
+    } catch (const std::exception &e) {
+      std::cerr << "ERROR: " << e.what() << std::endl;
+      publish(nullptr, false, true);
+    }
+  });
+}
 
-  QStringList plot_names;
-  for (const auto &element : _result.histos) {
-    plot_names << element.first.c_str();
+/*
+ * Shows the latest results of the background run.
+ */
+void main_window::show_results()
+{
+  bool updated = false;
+  std::string name = current_plot_name();
+  run::result cutflow;
+  bool new_cutflow;
+  {
+    std::lock_guard<std::mutex> lock(_mutex);
+    for (const auto &element : _pending.histos) {
+      _result.histos.erase(element.first);
+      _result.histos.insert(element);
+      updated = updated || element.first == name;
+    }
+    _pending.histos.clear();
+    new_cutflow = _new_cutflow;
+    if (_new_cutflow) {
+      cutflow.events = _pending.events;
+      cutflow.cutflow.swap(_pending.cutflow);
+      _new_cutflow = false;
+    }
+    if (_finished) {
+      setCursor(Qt::ArrowCursor);
+    }
   }
-  int selected = _plots->currentRow();
-  selected = selected < 0 ? 0 : selected;
-  _plots->clear();
-  _plots->addItems(plot_names);
-  _plots->blockSignals(true);
-  _plots->setCurrentRow(selected);
-  _plots->blockSignals(false);
+  if (updated) {
+    show_plot(_plots->currentRow());
+  }
+  if (new_cutflow) {
+    show_cutflow(cutflow);
+  }
+}
 
-  show_plot(selected);
+/*
+ * Fills the table with the number of events left after each cut, and how
+ * much the cuts reject for the time they take. Disabled cuts are greyed out.
+ */
+void main_window::show_cutflow(const run::result &result)
+{
+  auto set = [this](int row, int column, const QString &text, bool enabled) {
+    QTableWidgetItem *item = new QTableWidgetItem(text);
+    item->setFlags(enabled ? Qt::ItemIsEnabled : Qt::NoItemFlags);
+    _cutflow->setItem(row, column, item);
+  };
 
-  setCursor(Qt::ArrowCursor);
+  _cutflow->setRowCount(result.cutflow.size() + 1);
+  set(0, 0, "All events", true);
+  set(0, 1, QString::number(result.events), true);
+  set(0, 2, "", true);
+  set(0, 3, "", true);
+  for (std::size_t i = 0; i < result.cutflow.size(); ++i) {
+    const run::cutflow_step &step = result.cutflow[i];
+    const run::cut_stats &stats = step.stats;
+    int row = i + 1;
+    set(row, 0, step.name.c_str(), step.enabled);
+    set(row, 1, QString::number(step.passed), step.enabled);
+    if (stats.evaluated > 0) {
+      set(row, 2, QString::number(100. * stats.rejected / stats.evaluated,
+                                  'f', 1) + "%", step.enabled);
+      set(row, 3, QString::number(1e6 * stats.seconds / stats.evaluated,
+                                  'g', 3), step.enabled);
+    } else {
+      set(row, 2, "", step.enabled);
+      set(row, 3, "", step.enabled);
+    }
+  }
+  _cutflow->resizeColumnsToContents();
 }
 
 void main_window::show_plot(int index)
@@ -100,6 +277,11 @@ void main_window::show_plot(int index)
   std::string name = current_plot_name();
 
   _plot->clearPlottables();
+  if (_result.histos.count(name) == 0) {
+    // Not computed yet
+    _plot->replot();
+    return;
+  }
 
   hist::qt::histogram2d_plottable *migration =
       new hist::qt::histogram2d_plottable(
@@ -138,6 +320,9 @@ void main_window::show_plot(int index)
 
 void main_window::save()
 {
+  if (_plots->currentItem() == nullptr) {
+    return;
+  }
   QString filename = QFileDialog::getSaveFileName(
     this, tr("Save plot"), _plots->currentItem()->text() + ".png", "*.png");
   if (!filename.isEmpty()) {
@@ -147,10 +332,16 @@ void main_window::save()
 
 void main_window::save_data()
 {
+  if (_plots->currentItem() == nullptr) {
+    return;
+  }
   QString filename = QFileDialog::getSaveFileName(
     this, tr("Save plot"), _plots->currentItem()->text() + ".dat", "*.*");
   if (!filename.isEmpty()) {
     std::string name = current_plot_name();
+    if (_result.histos.count(name) == 0) {
+      return;
+    }
     std::ofstream out(filename.toUtf8().data());
     hist::histogram histogram = _result.histos.at(name).after_cuts;
 
@@ -165,6 +356,12 @@ void main_window::save_data()
   }
 }
 
+void main_window::set_adaptive_order(bool adaptive)
+{
+  _adaptive_order = adaptive;
+  refresh_results();
+}
+
 void main_window::set_log_scale(bool log)
 {
   _log_scale = log;
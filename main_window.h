@@ -1,7 +1,12 @@
 #ifndef MAIN_WINDOW_H
 #define MAIN_WINDOW_H
 
+#include <atomic>
+#include <mutex>
+#include <thread>
+
 #include <QMainWindow>
+#include <QTableWidget>
 
 #include <qcustomplot.h>
 
@@ -18,19 +23,37 @@ class main_window : public QMainWindow
   event_source *_event_source;
   QCustomPlot *_plot;
   QListWidget *_plots;
+  QTableWidget *_cutflow;
   bool _log_scale;
+  bool _adaptive_order = false;
+
+  // Background run
+  std::thread _worker;
+  std::atomic<bool> _cancel;
+  std::mutex _mutex; ///< Protects the members below
+  run::result _pending; ///< Results not shown yet
+  bool _new_cutflow = false; ///< The cut flow of _pending wasn't shown
+  bool _finished = false; ///< The run is over
 
 public:
   explicit main_window(run basic_run, run_config *rc, event_source *in);
+  ~main_window();
+
+private:
+  void stop_worker();
+  void publish(const run::result *result, bool complete, bool finished);
+  void show_cutflow(const run::result &result);
 
 private slots:
   std::string current_plot_name() const;
 
   void refresh_results();
+  void show_results();
   void show_plot(int index);
   void save();
   void save_data();
   void set_log_scale(bool log);
+  void set_adaptive_order(bool adaptive);
 };
 
 #endif // MAIN_WINDOW_H
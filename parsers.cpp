@@ -1,7 +1,16 @@
 #include "parsers.h"
 
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
 #include <cstdlib>
+#include <iostream>
+#include <mutex>
+#include <set>
+#include <sstream>
+#include <stdexcept>
 #include <string>
+#include <thread>
 
 #include <TFile.h>
 #include <TTree.h>
@@ -27,9 +36,12 @@ bool starlight_parser::end()
 }
 
 namespace {
-  double read_double(std::istream &in)
+  /*
+   * Reads a number using token as a buffer, which is reused to avoid
+   * allocating memory every time.
+   */
+  double read_double(std::istream &in, std::string &token)
   {
-    std::string token;
     in >> token;
     return std::strtod(&token[0], 0);
   }
@@ -44,7 +56,7 @@ void starlight_parser::read()
   // Unused data
   int itrash;
 
-  _current = event();
+  _current.clear();
 
   _in >> prefix;
   if (prefix != "EVENT:") {
@@ -52,16 +64,17 @@ void starlight_parser::read()
   }
   _in >> _current.id;
   _in >> ntracks;
+  _current.tracks.reserve(std::max(ntracks, 0));
   _in >> itrash; // vertex count
 
   _in >> prefix;
   if (prefix != "VERTEX:") {
     throw 2;
   }
-  read_double(_in); // x
-  read_double(_in); // y
-  read_double(_in); // z
-  read_double(_in); // t
+  read_double(_in, _token); // x
+  read_double(_in, _token); // y
+  read_double(_in, _token); // z
+  read_double(_in, _token); // t
   _in >> itrash /* vertex number */ >> itrash /* physical process */
        >> itrash /* parent track */ >> itrash /* daughter track count */;
 
@@ -72,9 +85,9 @@ void starlight_parser::read()
     }
     track trk;
     _in >> trk.gpid;
-    double px = read_double(_in);
-    double py = read_double(_in);
-    double pz = read_double(_in);
+    double px = read_double(_in, _token);
+    double py = read_double(_in, _token);
+    double pz = read_double(_in, _token);
     trk.p = lorentz::vec::mxyz(MASS, px, py, pz);
     _in >> itrash /* event number */ >> itrash /* starting vertex */
          >> itrash /* ending vertex */;
@@ -168,7 +181,7 @@ bool root_parser::end()
 void root_parser::read()
 {
   _d->gen_tree->GetEntry(_d->current_gen++);
-  _d->gen = event();
+  _d->gen.clear();
 
   track trk;
   trk.p = lorentz::vec::mxyz(MASS, _d->gen_pxp, _d->gen_pyp, _d->gen_pzp);
@@ -180,7 +193,7 @@ void root_parser::read()
     _d->rec_tree->GetEntry(_d->current_rec++);
   }
   if (_d->rec_i == _d->gen_i) {
-    _d->rec = event();
+    _d->rec.clear();
 
     trk.p = lorentz::vec::mxyz(MASS, _d->rec_pxp, _d->rec_pyp, _d->rec_pzp);
     trk.match(_d->gen.tracks);
@@ -191,6 +204,34 @@ void root_parser::read()
   }
 }
 
+/**
+ * \brief Reads up to \c count events into \c slots.
+ *
+ * Same as event_source::read_batch(), without the virtual calls.
+ */
+std::size_t root_parser::read_batch(event_slot *slots, std::size_t count,
+                                    sol::state *lua)
+{
+  for (std::size_t i = 0; i < count; ++i) {
+    root_parser::read();
+    if (root_parser::end()) {
+      return i;
+    }
+    event_slot &slot = slots[i];
+    slot.gen_copy = _d->gen;
+    slot.gen = &slot.gen_copy;
+    slot.rec = nullptr;
+    if (root_parser::has_rec()) {
+      slot.rec_copy = _d->rec;
+      slot.rec = &slot.rec_copy;
+    }
+    if (lua != nullptr) {
+      slot.reset_fill(*lua);
+    }
+  }
+  return count;
+}
+
 const event &root_parser::gen()
 {
   return _d->gen;
@@ -214,36 +255,312 @@ void root_parser::reset()
   _d->rec_i = -1;
 }
 
+const int hlt_parser::BIG_TRACK_COUNT;
+const int hlt_parser::BIG_HIT_COUNT;
+
 struct hlt_parser::data
 {
   TFile *file;
   TTree *tracks_tree, *castor_tree, *hbhe_tree, *hf_tree, *eb_tree, *ee_tree,
         *zdc_tree;
   long count, current;
-  event rec;
+  long first = 0, last = -1; ///< Range of entries to read
 
-  const static int BIG_TRACK_COUNT = 1000;
-  const static int BIG_HIT_COUNT = 224;
+  // Field selection
+  field_set fields = field_set::everything();
+  std::vector<TTree *> all_trees, trees;
+  bool track_p = true, track_q = true, track_chi2 = true, track_ndof = true,
+       track_x = true, track_y = true, track_z = true;
 
-  int ntracks;
-  double chi2[BIG_TRACK_COUNT];
-  double lambda[BIG_TRACK_COUNT];
-  int    ndof[BIG_TRACK_COUNT];
-  double p[BIG_TRACK_COUNT];
-  double trkx[BIG_TRACK_COUNT];
-  double trky[BIG_TRACK_COUNT];
-  double trkz[BIG_TRACK_COUNT];
-  double phi[BIG_TRACK_COUNT];
-  double qoverp[BIG_TRACK_COUNT];
-
-  unsigned ncastorhits;
-  int   castorhitmodule[BIG_HIT_COUNT];
-  int   castorhitsector[BIG_HIT_COUNT];
-  float castorhitdata[BIG_HIT_COUNT];
-
-  float zdc_plus[10], zdc_minus[10];
+  /// Data of one entry
+  struct entry
+  {
+    int ntracks = 0;
+    double chi2[BIG_TRACK_COUNT];
+    double lambda[BIG_TRACK_COUNT];
+    int    ndof[BIG_TRACK_COUNT];
+    double p[BIG_TRACK_COUNT];
+    double trkx[BIG_TRACK_COUNT];
+    double trky[BIG_TRACK_COUNT];
+    double trkz[BIG_TRACK_COUNT];
+    double phi[BIG_TRACK_COUNT];
+    double qoverp[BIG_TRACK_COUNT];
+
+    unsigned ncastorhits = 0;
+    int   castorhitmodule[BIG_HIT_COUNT];
+    int   castorhitsector[BIG_HIT_COUNT];
+    float castorhitdata[BIG_HIT_COUNT];
+
+    float zdc_plus[10] = {}, zdc_minus[10] = {};
+
+    event rec;
+    /// Holds the tracks and hits of rec that don't fit in place
+    arena storage{ BIG_TRACK_COUNT * sizeof(track) +
+                   BIG_HIT_COUNT * sizeof(castor::hit) + 2 * alignof(track) };
+
+    entry() { rec.set_arena(&storage); }
+
+    /// Clears rec and the memory it uses
+    void clear_rec()
+    {
+      rec.clear();
+      storage.clear();
+    }
+
+    /// Copies the elements of the arrays that are in use
+    void assign(const entry &other)
+    {
+      ntracks = other.ntracks;
+      int n = std::min(std::max(ntracks, 0), int(BIG_TRACK_COUNT));
+      std::copy_n(other.chi2, n, chi2);
+      std::copy_n(other.lambda, n, lambda);
+      std::copy_n(other.ndof, n, ndof);
+      std::copy_n(other.p, n, p);
+      std::copy_n(other.trkx, n, trkx);
+      std::copy_n(other.trky, n, trky);
+      std::copy_n(other.trkz, n, trkz);
+      std::copy_n(other.phi, n, phi);
+      std::copy_n(other.qoverp, n, qoverp);
+
+      ncastorhits = other.ncastorhits;
+      n = std::min<unsigned>(ncastorhits, BIG_HIT_COUNT);
+      std::copy_n(other.castorhitmodule, n, castorhitmodule);
+      std::copy_n(other.castorhitsector, n, castorhitsector);
+      std::copy_n(other.castorhitdata, n, castorhitdata);
+
+      std::copy_n(other.zdc_plus, 10, zdc_plus);
+      std::copy_n(other.zdc_minus, 10, zdc_minus);
+      clear_rec();
+      rec = other.rec;
+    }
+  };
+  const std::unique_ptr<entry> loaded = std::make_unique<entry>(); ///< ROOT
+  const entry *cur = loaded.get(); ///< Used by rec() and fill_rec()
+
+  // Caching
+  Long64_t cache_size = -1;
+
+  // Read-ahead
+  std::size_t read_ahead = 0;
+  std::thread reader;
+  std::mutex mutex;
+  std::condition_variable changed;
+  std::vector<std::unique_ptr<entry>> ring;
+  std::size_t ring_head = 0, ring_filled = 0;
+  bool stop = false;
+  std::unique_ptr<entry> taken = std::make_unique<entry>();
+
+  // Sizes of the hash part of the tables created by fill_rec()
+  bool have_hints = false;
+  int ecal_hint, hcal_hint, zdc_hint, track_hint;
+
+  ~data() { stop_reader(); }
+
+  struct branch_field
+  {
+    TTree *tree;
+    const char *branch;
+    const char *field;
+  };
+  std::vector<branch_field> branches() const;
+
+  void setup_cache();
+  void load(long index);
+  void start_reader();
+  void stop_reader();
+  void take();
+  void compute_hints(lua_State *L);
 };
 
+/*
+ * Returns the branches of the trees and the fields they are used for.
+ */
+std::vector<hlt_parser::data::branch_field> hlt_parser::data::branches() const
+{
+  return {
+    { tracks_tree, "nTracks", "tracks" },
+    { tracks_tree, "chi2", "tracks.[].chi2" },
+    { tracks_tree, "lambda", "tracks.[].p" },
+    { tracks_tree, "ndof", "tracks.[].ndof" },
+    { tracks_tree, "p", "tracks.[].p" },
+    { tracks_tree, "x", "tracks.[].x" },
+    { tracks_tree, "y", "tracks.[].y" },
+    { tracks_tree, "z", "tracks.[].z" },
+    { tracks_tree, "qoverp", "tracks.[].q" },
+    { tracks_tree, "phi", "tracks.[].p" },
+    { castor_tree, "nCastorRecHits", "castor_energy" },
+    { castor_tree, "CastorRecHitModule", "castor_energy" },
+    { castor_tree, "CastorRecHitSector", "castor_energy" },
+    { castor_tree, "CastorRecHitData", "castor_energy" },
+    { hbhe_tree, "HEEnergyMaxPlus", "hcal.ep" },
+    { hbhe_tree, "HEEtaMaxPlus", "hcal.ep" },
+    { hbhe_tree, "HEPhiMaxPlus", "hcal.ep" },
+    { hbhe_tree, "HEEnergyMaxMinus", "hcal.em" },
+    { hbhe_tree, "HEEtaMaxMinus", "hcal.em" },
+    { hbhe_tree, "HEPhiMaxMinus", "hcal.em" },
+    { hbhe_tree, "HBEnergyMaxPlus", "hcal.bp" },
+    { hbhe_tree, "HBEtaMaxPlus", "hcal.bp" },
+    { hbhe_tree, "HBPhiMaxPlus", "hcal.bp" },
+    { hbhe_tree, "HBEnergyMaxMinus", "hcal.bm" },
+    { hbhe_tree, "HBEtaMaxMinus", "hcal.bm" },
+    { hbhe_tree, "HBPhiMaxMinus", "hcal.bm" },
+    { hf_tree, "HFEnergyMaxPlus", "hcal.fp" },
+    { hf_tree, "HFEtaMaxPlus", "hcal.fp" },
+    { hf_tree, "HFPhiMaxPlus", "hcal.fp" },
+    { hf_tree, "HFEnergyMaxMinus", "hcal.fm" },
+    { hf_tree, "HFEtaMaxMinus", "hcal.fm" },
+    { hf_tree, "HFPhiMaxMinus", "hcal.fm" },
+    { ee_tree, "EEEnergyMaxPlus", "ecal.ep" },
+    { ee_tree, "EEEtaMaxPlus", "ecal.ep" },
+    { ee_tree, "EEPhiMaxPlus", "ecal.ep" },
+    { ee_tree, "EEEnergyMaxMinus", "ecal.em" },
+    { ee_tree, "EEEtaMaxMinus", "ecal.em" },
+    { ee_tree, "EEPhiMaxMinus", "ecal.em" },
+    { eb_tree, "EBEnergyMaxPlus", "ecal.bp" },
+    { eb_tree, "EBEtaMaxPlus", "ecal.bp" },
+    { eb_tree, "EBPhiMaxPlus", "ecal.bp" },
+    { eb_tree, "EBEnergyMaxMinus", "ecal.bm" },
+    { eb_tree, "EBEtaMaxMinus", "ecal.bm" },
+    { eb_tree, "EBPhiMaxMinus", "ecal.bm" },
+    { zdc_tree, "posHD1fC", "zdc.plus" },
+    { zdc_tree, "negHD1fC", "zdc.minus" },
+  };
+}
+
+/*
+ * Enables the TTreeCache of the trees that are read, for the needed branches.
+ * Reading all baskets of an entry at once avoids seeking between the trees.
+ */
+void hlt_parser::data::setup_cache()
+{
+  const std::vector<branch_field> all_branches = branches();
+  for (TTree *tree : all_trees) {
+    bool used = std::find(trees.begin(), trees.end(), tree) != trees.end();
+    if (!used || cache_size == 0) {
+      tree->SetCacheSize(0);
+      continue;
+    }
+    tree->SetCacheSize(cache_size);
+    for (const branch_field &b : all_branches) {
+      if (b.tree == tree && fields.needs(b.field)) {
+        tree->AddBranchToCache(b.branch, true);
+      }
+    }
+    tree->StopCacheLearningPhase();
+  }
+}
+
+/*
+ * Reads an entry into loaded and decodes it.
+ */
+void hlt_parser::data::load(long index)
+{
+  loaded->clear_rec();
+  for (TTree *tree : trees) {
+    tree->GetEntry(index);
+  }
+
+  // Only fill tracks if we have read their data
+  entry &e = *loaded;
+  int ntracks = fields.needs("tracks.[]") ? e.ntracks : 0;
+  e.rec.tracks.reserve(std::max(ntracks, 0));
+  e.rec.castor_status.reserve(e.ncastorhits);
+  for (int i = 0; i < ntracks; ++i) {
+    track trk;
+    trk.p = lorentz::vec::m_r_phi_theta(MASS, e.p[i], e.phi[i], e.lambda[i]);
+    trk.charge = e.qoverp[i] > 0 ? 1 : -1;
+    trk.chi2 = e.chi2[i];
+    trk.ndof = e.ndof[i];
+    trk.x = lorentz::vec::txyz(0, e.trkx[i], e.trky[i], e.trkz[i]);
+    e.rec.add_track(trk);
+  }
+  // Castor
+  for (unsigned i = 0; i < e.ncastorhits; ++i) {
+    e.rec.castor_status.add_hit(e.castorhitmodule[i],
+                                e.castorhitsector[i],
+                                e.castorhitdata[i]);
+  }
+}
+
+/*
+ * Starts a thread that reads entries ahead of current and stores them in the
+ * ring. Nothing happens if read-ahead is disabled.
+ */
+void hlt_parser::data::start_reader()
+{
+  if (read_ahead == 0) {
+    cur = loaded.get();
+    return;
+  }
+  ring.resize(read_ahead);
+  for (std::unique_ptr<entry> &slot : ring) {
+    if (!slot) {
+      slot = std::make_unique<entry>();
+    }
+  }
+  ring_head = 0;
+  ring_filled = 0;
+  stop = false;
+  cur = taken.get();
+
+  long next = current;
+  reader = std::thread([this, next]() {
+    for (long index = next; index < last; ++index) {
+      std::size_t slot;
+      {
+        std::unique_lock<std::mutex> lock(mutex);
+        changed.wait(lock, [this]() {
+          return stop || ring_filled < ring.size();
+        });
+        if (stop) {
+          return;
+        }
+        slot = (ring_head + ring_filled) % ring.size();
+      }
+      // Only this thread touches the free slots of the ring. ROOT writes
+      // to loaded, so it can't be swapped.
+      load(index);
+      ring[slot]->assign(*loaded);
+      {
+        std::lock_guard<std::mutex> lock(mutex);
+        ++ring_filled;
+      }
+      changed.notify_all();
+    }
+  });
+}
+
+/*
+ * Stops the read-ahead thread, dropping the entries it has read.
+ */
+void hlt_parser::data::stop_reader()
+{
+  if (!reader.joinable()) {
+    return;
+  }
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    stop = true;
+  }
+  changed.notify_all();
+  reader.join();
+}
+
+/*
+ * Takes the next entry from the ring.
+ */
+void hlt_parser::data::take()
+{
+  std::unique_lock<std::mutex> lock(mutex);
+  changed.wait(lock, [this]() { return ring_filled > 0; });
+  std::swap(taken, ring[ring_head]);
+  ring_head = (ring_head + 1) % ring.size();
+  --ring_filled;
+  cur = taken.get();
+  lock.unlock();
+  changed.notify_all();
+}
+
 hlt_parser::hlt_parser(const std::string &filename) :
   _filename(filename),
   _d(new data)
@@ -252,187 +569,1236 @@ hlt_parser::hlt_parser(const std::string &filename) :
   _d->file = new TFile(filename.c_str());
   _d->file->GetObject("generalTracksTree", _d->tracks_tree);
   _d->count = _d->tracks_tree->GetEntries();
+  _d->last = _d->count;
   reset();
 
-  _d->tracks_tree->SetBranchAddress("nTracks", &_d->ntracks);
-  _d->tracks_tree->SetBranchAddress("chi2", &_d->chi2);
-  _d->tracks_tree->SetBranchAddress("lambda", &_d->lambda);
-  _d->tracks_tree->SetBranchAddress("ndof", &_d->ndof);
-  _d->tracks_tree->SetBranchAddress("p", &_d->p);
-  _d->tracks_tree->SetBranchAddress("x", &_d->trkx);
-  _d->tracks_tree->SetBranchAddress("y", &_d->trky);
-  _d->tracks_tree->SetBranchAddress("z", &_d->trkz);
-  _d->tracks_tree->SetBranchAddress("qoverp", &_d->qoverp);
-  _d->tracks_tree->SetBranchAddress("phi", &_d->phi);
+  // Branches are read into loaded
+  data::entry &e = *_d->loaded;
+  _d->tracks_tree->SetBranchAddress("nTracks", &e.ntracks);
+  _d->tracks_tree->SetBranchAddress("chi2", &e.chi2);
+  _d->tracks_tree->SetBranchAddress("lambda", &e.lambda);
+  _d->tracks_tree->SetBranchAddress("ndof", &e.ndof);
+  _d->tracks_tree->SetBranchAddress("p", &e.p);
+  _d->tracks_tree->SetBranchAddress("x", &e.trkx);
+  _d->tracks_tree->SetBranchAddress("y", &e.trky);
+  _d->tracks_tree->SetBranchAddress("z", &e.trkz);
+  _d->tracks_tree->SetBranchAddress("qoverp", &e.qoverp);
+  _d->tracks_tree->SetBranchAddress("phi", &e.phi);
 
   _d->file->GetObject("CastorRecTree", _d->castor_tree);
-  _d->castor_tree->SetBranchAddress("nCastorRecHits", &_d->ncastorhits);
-  _d->castor_tree->SetBranchAddress("CastorRecHitModule", &_d->castorhitmodule);
-  _d->castor_tree->SetBranchAddress("CastorRecHitSector", &_d->castorhitsector);
-  _d->castor_tree->SetBranchAddress("CastorRecHitData", &_d->castorhitdata);
+  _d->castor_tree->SetBranchAddress("nCastorRecHits", &e.ncastorhits);
+  _d->castor_tree->SetBranchAddress("CastorRecHitModule", &e.castorhitmodule);
+  _d->castor_tree->SetBranchAddress("CastorRecHitSector", &e.castorhitsector);
+  _d->castor_tree->SetBranchAddress("CastorRecHitData", &e.castorhitdata);
 
   _d->file->GetObject("HBHERecHitTree", _d->hbhe_tree);
-  _d->hbhe_tree->SetBranchAddress("HEEnergyMaxPlus", &_d->rec.hcal.endcap.plus);
-  _d->hbhe_tree->SetBranchAddress("HEEtaMaxPlus", &_d->rec.hcal.endcap.eta_plus);
-  _d->hbhe_tree->SetBranchAddress("HEPhiMaxPlus", &_d->rec.hcal.endcap.phi_plus);
-  _d->hbhe_tree->SetBranchAddress("HEEnergyMaxMinus", &_d->rec.hcal.endcap.minus);
-  _d->hbhe_tree->SetBranchAddress("HEEtaMaxMinus", &_d->rec.hcal.endcap.eta_minus);
-  _d->hbhe_tree->SetBranchAddress("HEPhiMaxMinus", &_d->rec.hcal.endcap.phi_minus);
-  _d->hbhe_tree->SetBranchAddress("HBEnergyMaxPlus", &_d->rec.hcal.barrel.plus);
-  _d->hbhe_tree->SetBranchAddress("HBEtaMaxPlus", &_d->rec.hcal.barrel.eta_plus);
-  _d->hbhe_tree->SetBranchAddress("HBPhiMaxPlus", &_d->rec.hcal.barrel.phi_plus);
-  _d->hbhe_tree->SetBranchAddress("HBEnergyMaxMinus", &_d->rec.hcal.barrel.minus);
-  _d->hbhe_tree->SetBranchAddress("HBEtaMaxMinus", &_d->rec.hcal.barrel.eta_minus);
-  _d->hbhe_tree->SetBranchAddress("HBPhiMaxMinus", &_d->rec.hcal.barrel.phi_minus);
+  _d->hbhe_tree->SetBranchAddress("HEEnergyMaxPlus", &e.rec.hcal.endcap.plus);
+  _d->hbhe_tree->SetBranchAddress("HEEtaMaxPlus", &e.rec.hcal.endcap.eta_plus);
+  _d->hbhe_tree->SetBranchAddress("HEPhiMaxPlus", &e.rec.hcal.endcap.phi_plus);
+  _d->hbhe_tree->SetBranchAddress("HEEnergyMaxMinus", &e.rec.hcal.endcap.minus);
+  _d->hbhe_tree->SetBranchAddress("HEEtaMaxMinus", &e.rec.hcal.endcap.eta_minus);
+  _d->hbhe_tree->SetBranchAddress("HEPhiMaxMinus", &e.rec.hcal.endcap.phi_minus);
+  _d->hbhe_tree->SetBranchAddress("HBEnergyMaxPlus", &e.rec.hcal.barrel.plus);
+  _d->hbhe_tree->SetBranchAddress("HBEtaMaxPlus", &e.rec.hcal.barrel.eta_plus);
+  _d->hbhe_tree->SetBranchAddress("HBPhiMaxPlus", &e.rec.hcal.barrel.phi_plus);
+  _d->hbhe_tree->SetBranchAddress("HBEnergyMaxMinus", &e.rec.hcal.barrel.minus);
+  _d->hbhe_tree->SetBranchAddress("HBEtaMaxMinus", &e.rec.hcal.barrel.eta_minus);
+  _d->hbhe_tree->SetBranchAddress("HBPhiMaxMinus", &e.rec.hcal.barrel.phi_minus);
 
   _d->file->GetObject("HFRecHitTree", _d->hf_tree);
-  _d->hf_tree->SetBranchAddress("HFEnergyMaxPlus", &_d->rec.hcal.forward.plus);
-  _d->hf_tree->SetBranchAddress("HFEtaMaxPlus", &_d->rec.hcal.forward.eta_plus);
-  _d->hf_tree->SetBranchAddress("HFPhiMaxPlus", &_d->rec.hcal.forward.phi_plus);
-  _d->hf_tree->SetBranchAddress("HFEnergyMaxMinus", &_d->rec.hcal.forward.minus);
-  _d->hf_tree->SetBranchAddress("HFEtaMaxMinus", &_d->rec.hcal.forward.eta_minus);
-  _d->hf_tree->SetBranchAddress("HFPhiMaxMinus", &_d->rec.hcal.forward.phi_minus);
+  _d->hf_tree->SetBranchAddress("HFEnergyMaxPlus", &e.rec.hcal.forward.plus);
+  _d->hf_tree->SetBranchAddress("HFEtaMaxPlus", &e.rec.hcal.forward.eta_plus);
+  _d->hf_tree->SetBranchAddress("HFPhiMaxPlus", &e.rec.hcal.forward.phi_plus);
+  _d->hf_tree->SetBranchAddress("HFEnergyMaxMinus", &e.rec.hcal.forward.minus);
+  _d->hf_tree->SetBranchAddress("HFEtaMaxMinus", &e.rec.hcal.forward.eta_minus);
+  _d->hf_tree->SetBranchAddress("HFPhiMaxMinus", &e.rec.hcal.forward.phi_minus);
 
   _d->file->GetObject("EERecHitTree", _d->ee_tree);
-  _d->ee_tree->SetBranchAddress("EEEnergyMaxPlus", &_d->rec.ecal.endcap.plus);
-  _d->ee_tree->SetBranchAddress("EEEtaMaxPlus", &_d->rec.ecal.endcap.eta_plus);
-  _d->ee_tree->SetBranchAddress("EEPhiMaxPlus", &_d->rec.ecal.endcap.phi_plus);
-  _d->ee_tree->SetBranchAddress("EEEnergyMaxMinus", &_d->rec.ecal.endcap.minus);
-  _d->ee_tree->SetBranchAddress("EEEtaMaxMinus", &_d->rec.ecal.endcap.eta_minus);
-  _d->ee_tree->SetBranchAddress("EEPhiMaxMinus", &_d->rec.ecal.endcap.phi_minus);
+  _d->ee_tree->SetBranchAddress("EEEnergyMaxPlus", &e.rec.ecal.endcap.plus);
+  _d->ee_tree->SetBranchAddress("EEEtaMaxPlus", &e.rec.ecal.endcap.eta_plus);
+  _d->ee_tree->SetBranchAddress("EEPhiMaxPlus", &e.rec.ecal.endcap.phi_plus);
+  _d->ee_tree->SetBranchAddress("EEEnergyMaxMinus", &e.rec.ecal.endcap.minus);
+  _d->ee_tree->SetBranchAddress("EEEtaMaxMinus", &e.rec.ecal.endcap.eta_minus);
+  _d->ee_tree->SetBranchAddress("EEPhiMaxMinus", &e.rec.ecal.endcap.phi_minus);
 
   _d->file->GetObject("EBRecHitTree", _d->eb_tree);
-  _d->eb_tree->SetBranchAddress("EBEnergyMaxPlus", &_d->rec.ecal.barrel.plus);
-  _d->eb_tree->SetBranchAddress("EBEtaMaxPlus", &_d->rec.ecal.barrel.eta_plus);
-  _d->eb_tree->SetBranchAddress("EBPhiMaxPlus", &_d->rec.ecal.barrel.phi_plus);
-  _d->eb_tree->SetBranchAddress("EBEnergyMaxMinus", &_d->rec.ecal.barrel.minus);
-  _d->eb_tree->SetBranchAddress("EBEtaMaxMinus", &_d->rec.ecal.barrel.eta_minus);
-  _d->eb_tree->SetBranchAddress("EBPhiMaxMinus", &_d->rec.ecal.barrel.phi_minus);
+  _d->eb_tree->SetBranchAddress("EBEnergyMaxPlus", &e.rec.ecal.barrel.plus);
+  _d->eb_tree->SetBranchAddress("EBEtaMaxPlus", &e.rec.ecal.barrel.eta_plus);
+  _d->eb_tree->SetBranchAddress("EBPhiMaxPlus", &e.rec.ecal.barrel.phi_plus);
+  _d->eb_tree->SetBranchAddress("EBEnergyMaxMinus", &e.rec.ecal.barrel.minus);
+  _d->eb_tree->SetBranchAddress("EBEtaMaxMinus", &e.rec.ecal.barrel.eta_minus);
+  _d->eb_tree->SetBranchAddress("EBPhiMaxMinus", &e.rec.ecal.barrel.phi_minus);
 
   _d->file->GetObject("ZDCDigiTree", _d->zdc_tree);
-  _d->zdc_tree->SetBranchAddress("posHD1fC", &_d->zdc_plus);
-  _d->zdc_tree->SetBranchAddress("negHD1fC", &_d->zdc_minus);
+  _d->zdc_tree->SetBranchAddress("posHD1fC", &e.zdc_plus);
+  _d->zdc_tree->SetBranchAddress("negHD1fC", &e.zdc_minus);
+
+  _d->all_trees = { _d->tracks_tree, _d->castor_tree, _d->hbhe_tree,
+                    _d->hf_tree, _d->eb_tree, _d->ee_tree, _d->zdc_tree };
+  _d->trees = _d->all_trees;
+  _d->setup_cache();
+}
+
+/**
+ * \brief Only reads the branches needed to fill the given fields.
+ *
+ * Trees with no needed branch aren't read at all. The fields that aren't
+ * needed are left out of the tables created by fill_rec(), and rec() only
+ * contains the needed data. Statistics about the skipped data are printed to
+ * stderr.
+ */
+void hlt_parser::select(const field_set &fields, bool quiet)
+{
+  _d->stop_reader();
+  const std::vector<data::branch_field> branches = _d->branches();
+
+  _d->fields = fields;
+
+  // Branches without an address would be read too, so start from nothing
+  for (TTree *tree : _d->all_trees) {
+    tree->SetBranchStatus("*", 0);
+  }
+
+  std::set<TTree *> used;
+  int disabled = 0;
+  Long64_t skipped_bytes = 0;
+  for (const data::branch_field &b : branches) {
+    if (fields.needs(b.field)) {
+      b.tree->SetBranchStatus(b.branch, 1);
+      used.insert(b.tree);
+    } else {
+      ++disabled;
+      skipped_bytes += b.tree->GetBranch(b.branch)->GetZipBytes();
+    }
+  }
+
+  std::vector<TTree *> trees;
+  for (TTree *tree : _d->all_trees) {
+    if (used.count(tree) > 0) {
+      trees.push_back(tree);
+    }
+  }
+  _d->trees = trees;
+  _d->setup_cache();
+
+  _d->track_p = fields.needs("tracks.[].p");
+  _d->track_q = fields.needs("tracks.[].q");
+  _d->track_chi2 = fields.needs("tracks.[].chi2");
+  _d->track_ndof = fields.needs("tracks.[].ndof");
+  _d->track_x = fields.needs("tracks.[].x");
+  _d->track_y = fields.needs("tracks.[].y");
+  _d->track_z = fields.needs("tracks.[].z");
+  _d->have_hints = false;
+
+  if (!quiet) {
+    std::cerr << "[INFO] Disabled " << disabled << " of " << branches.size()
+              << " branches (" << 7 - trees.size() << " trees), skipping "
+              << skipped_bytes << " compressed bytes" << std::endl;
+  }
+
+  _d->start_reader();
+}
+
+/**
+ * \brief Sets the size of the TTreeCache of the trees, in bytes.
+ *
+ * The cache reads the baskets of the needed branches in large blocks instead
+ * of one by one. The default is ROOT's default size, and 0 disables the
+ * cache.
+ */
+void hlt_parser::set_cache_size(long long bytes)
+{
+  _d->stop_reader();
+  _d->cache_size = bytes;
+  _d->setup_cache();
+  _d->start_reader();
+}
+
+/**
+ * \brief Reads and decodes entries in a background thread.
+ *
+ * Up to \c entries entries are kept ready ahead of the current one. Reading
+ * then overlaps with the processing of the events. 0 disables read-ahead.
+ */
+void hlt_parser::set_read_ahead(int entries)
+{
+  _d->stop_reader();
+  _d->read_ahead = std::max(entries, 0);
+  _d->start_reader();
+}
+
+long hlt_parser::entries()
+{
+  return _d->count;
+}
+
+void hlt_parser::set_range(long first, long last)
+{
+  _d->stop_reader();
+  _d->first = std::max(first, 0L);
+  _d->last = std::min(last, _d->count);
+  _d->current = _d->first;
+  _d->start_reader();
 }
 
 bool hlt_parser::end()
 {
-  return _d->current >= _d->count;
+  return _d->current >= _d->last;
 }
 
 void hlt_parser::read()
 {
-  _d->rec = event();
-  _d->tracks_tree->GetEntry(_d->current);
-  _d->castor_tree->GetEntry(_d->current);
-  _d->hbhe_tree->GetEntry(_d->current);
-  _d->hf_tree->GetEntry(_d->current);
-  _d->eb_tree->GetEntry(_d->current);
-  _d->ee_tree->GetEntry(_d->current);
-  _d->zdc_tree->GetEntry(_d->current);
-
-  for (int i = 0; i < _d->ntracks; ++i) {
-    track trk;
-    trk.p = lorentz::vec::m_r_phi_theta(MASS, _d->p[i],
-                                        _d->phi[i], _d->lambda[i]);
-    trk.charge = _d->qoverp[i] > 0 ? 1 : -1;
-    trk.chi2 = _d->chi2[i];
-    trk.ndof = _d->ndof[i];
-    trk.x = lorentz::vec::txyz(0, _d->trkx[i], _d->trky[i], _d->trkz[i]);
-    _d->rec.add_track(trk);
+  if (_d->current >= _d->last) {
+    // Nothing left, and the read-ahead thread won't provide anything
+    return;
   }
-  // Castor
-  for (unsigned i = 0; i < _d->ncastorhits; ++i) {
-    _d->rec.castor_status.add_hit(_d->castorhitmodule[i],
-                                  _d->castorhitsector[i],
-                                  _d->castorhitdata[i]);
+  if (_d->read_ahead > 0) {
+    _d->take();
+  } else {
+    _d->load(_d->current);
   }
-
   _d->current++;
 }
 
+/**
+ * \brief Reads up to \c count events into \c slots.
+ *
+ * Same as event_source::read_batch(), without the virtual calls. The events
+ * are copied because the entries are reused.
+ */
+std::size_t hlt_parser::read_batch(event_slot *slots, std::size_t count,
+                                   sol::state *lua)
+{
+  for (std::size_t i = 0; i < count; ++i) {
+    hlt_parser::read();
+    if (hlt_parser::end()) {
+      return i;
+    }
+    event_slot &slot = slots[i];
+    slot.rec_copy = _d->cur->rec;
+    slot.gen = &slot.rec_copy;
+    slot.rec = &slot.rec_copy;
+    if (lua != nullptr) {
+      slot.reset_fill(*lua);
+      hlt_parser::fill_rec(*lua, slot.fill);
+    }
+  }
+  return count;
+}
+
 void hlt_parser::prepare(sol::state &lua)
 {
   lua.script("require(\"lorentz\")");
 }
 
+namespace // anonymous
+{
+  /*
+   * Returns the keys of the table at the given index, in the order of next().
+   */
+  std::vector<std::string> key_order(lua_State *L, int index)
+  {
+    std::vector<std::string> keys;
+    lua_pushnil(L);
+    while (lua_next(L, index) != 0) {
+      lua_pop(L, 1);
+      keys.push_back(lua_tostring(L, -1));
+    }
+    return keys;
+  }
+
+  /*
+   * Lua iterates over the hash part of a table in an order that depends on
+   * how it grew, and the serializer writes the fields in this order. Returns
+   * the size of the hash part to reserve for a table filled with the given
+   * keys: their number if this keeps the order of a table created empty, and
+   * 0 otherwise.
+   */
+  int hash_size_hint(lua_State *L, const std::vector<const char *> &keys)
+  {
+    lua_createtable(L, 0, 0);
+    int grown = lua_gettop(L);
+    lua_createtable(L, 0, keys.size());
+    int sized = lua_gettop(L);
+    for (const char *key : keys) {
+      lua_pushboolean(L, true);
+      lua_setfield(L, grown, key);
+      lua_pushboolean(L, true);
+      lua_setfield(L, sized, key);
+    }
+    bool same = key_order(L, grown) == key_order(L, sized);
+    lua_pop(L, 2);
+    return same ? keys.size() : 0;
+  }
+
+  /*
+   * Returns the names of the children of a field that are needed.
+   */
+  std::vector<const char *> needed(const field_set &fields,
+                                   const std::string &parent,
+                                   const std::vector<const char *> &names)
+  {
+    std::vector<const char *> result;
+    for (const char *name : names) {
+      if (fields.needs(parent + "." + name)) {
+        result.push_back(name);
+      }
+    }
+    return result;
+  }
+
+  /*
+   * Sets a field of the table at the top of the stack to a number.
+   */
+  void set_number(lua_State *L, const char *name, double value)
+  {
+    lua_pushnumber(L, value);
+    lua_setfield(L, -2, name);
+  }
+
+  /*
+   * Sets a field of the table at the top of the stack to a lorentz.vec, like
+   * vec.new() would create it. meta is the index of the vec table.
+   */
+  void set_vec(lua_State *L, int meta, const char *name,
+               const lorentz::vec &v)
+  {
+    lua_createtable(L, 0, 4);
+    set_number(L, "t", v.t());
+    set_number(L, "x", v.x());
+    set_number(L, "y", v.y());
+    set_number(L, "z", v.z());
+    lua_pushvalue(L, meta);
+    lua_setmetatable(L, -2);
+    lua_setfield(L, -2, name);
+  }
+} // anonymous namespace
+
+/*
+ * Computes the sizes of the tables filled by fill_rec() for the selected
+ * fields.
+ */
+void hlt_parser::data::compute_hints(lua_State *L)
+{
+  ecal_hint = hash_size_hint(L, needed(fields, "ecal",
+                                       { "bp", "bm", "ep", "em" }));
+  hcal_hint = hash_size_hint(L, needed(fields, "hcal",
+                                       { "bp", "bm", "ep", "em", "fp", "fm" }));
+  zdc_hint = hash_size_hint(L, needed(fields, "zdc", { "plus", "minus" }));
+
+  std::vector<const char *> track_keys;
+  for (auto key : { std::make_pair(track_p, "p"),
+                    std::make_pair(track_q, "q"),
+                    std::make_pair(track_chi2, "chi2"),
+                    std::make_pair(track_ndof, "ndof"),
+                    std::make_pair(track_x, "x"),
+                    std::make_pair(track_y, "y"),
+                    std::make_pair(track_z, "z") }) {
+    if (key.first) {
+      track_keys.push_back(key.second);
+    }
+  }
+  track_hint = hash_size_hint(L, track_keys);
+  have_hints = true;
+}
+
+/**
+ * \brief Fills the event with the fields of the current entry.
+ *
+ * The tables are built with the Lua C API, and the 4-vectors are computed in
+ * C++ with the same formulas as in lorentz.lua. The tables are the same as
+ * when filled from Lua, down to the order of their fields, so the serialized
+ * events don't change.
+ */
 void hlt_parser::fill_rec(sol::state &lua, sol::table &event)
 {
-  event["castor_energy"] = _d->rec.castor_status.energy();
-
-  auto ecal = event["ecal"];
-  ecal = lua.create_table();
-  auto m_e_phi_eta = lua["vec"]["m_e_phi_eta"];
-  ecal["bp"] = m_e_phi_eta(0, _d->rec.ecal.barrel.plus,
-                              _d->rec.ecal.barrel.phi_plus,
-                              _d->rec.ecal.barrel.eta_plus).get<sol::table>();
-  ecal["bm"] = m_e_phi_eta(0, _d->rec.ecal.barrel.minus,
-                              _d->rec.ecal.barrel.phi_minus,
-                              _d->rec.ecal.barrel.eta_minus).get<sol::table>();
-  ecal["ep"] = m_e_phi_eta(0, _d->rec.ecal.endcap.plus,
-                              _d->rec.ecal.endcap.phi_plus,
-                              _d->rec.ecal.endcap.eta_plus).get<sol::table>();
-  ecal["em"] = m_e_phi_eta(0, _d->rec.ecal.endcap.minus,
-                              _d->rec.ecal.endcap.phi_minus,
-                              _d->rec.ecal.endcap.eta_minus).get<sol::table>();
-
-  auto hcal = event["hcal"];
-  hcal = lua.create_table();
-  hcal["bp"] = m_e_phi_eta(0, _d->rec.hcal.barrel.plus,
-                              _d->rec.hcal.barrel.phi_plus,
-                              _d->rec.hcal.barrel.eta_plus).get<sol::table>();
-  hcal["bm"] = m_e_phi_eta(0, _d->rec.hcal.barrel.minus,
-                              _d->rec.hcal.barrel.phi_minus,
-                              _d->rec.hcal.barrel.eta_minus).get<sol::table>();
-  hcal["ep"] = m_e_phi_eta(0, _d->rec.hcal.endcap.plus,
-                              _d->rec.hcal.endcap.phi_plus,
-                              _d->rec.hcal.endcap.eta_plus).get<sol::table>();
-  hcal["em"] = m_e_phi_eta(0, _d->rec.hcal.endcap.minus,
-                              _d->rec.hcal.endcap.phi_minus,
-                              _d->rec.hcal.endcap.eta_minus).get<sol::table>();
-  hcal["fp"] = m_e_phi_eta(0, _d->rec.hcal.forward.plus,
-                              _d->rec.hcal.forward.phi_plus,
-                              _d->rec.hcal.forward.eta_plus).get<sol::table>();
-  hcal["fm"] = m_e_phi_eta(0, _d->rec.hcal.forward.minus,
-                              _d->rec.hcal.forward.phi_minus,
-                              _d->rec.hcal.forward.eta_minus).get<sol::table>();
-
-  auto zdc = event["zdc"];
-  zdc = lua.create_table();
-  // FIXME Dark magic.
-  zdc["plus"] = _d->zdc_plus[4];
-  zdc["minus"] = _d->zdc_minus[4];
-
-  auto tracks = event["tracks"];
-  tracks = lua.create_table();
-  for (int i = 0; i < _d->ntracks; ++i) {
-    lorentz::vec p = lorentz::vec::m_r_phi_theta(MASS, _d->p[i],
-                                                 _d->phi[i], _d->lambda[i]);
-    tracks[i + 1] = lua.create_table();
-    sol::table lua_p = lua["vec"]["new"](p.t(), p.x(), p.y(), p.z());
-    sol::table track = lua.create_table();
-    track["p"] = lua_p;
-    track["q"] = _d->qoverp[i] > 0 ? 1 : -1;
-    track["chi2"] = _d->chi2[i];
-    track["ndof"] = _d->ndof[i];
-    track["x"] = _d->trkx[i];
-    track["y"] = _d->trky[i];
-    track["z"] = _d->trkz[i];
-    tracks[i + 1] = track;
-  }
-  tracks["n"] = _d->ntracks;
+  const field_set &fields = _d->fields;
+  const data::entry &in = *_d->cur;
+
+  lua_State *L = lua.lua_state();
+  int top = lua_gettop(L);
+  if (!_d->have_hints) {
+    _d->compute_hints(L);
+  }
+  event.push();
+  int e = lua_gettop(L);
+  lua_getglobal(L, "vec");
+  int meta = lua_gettop(L);
+  if (!lua_istable(L, meta)) {
+    lua_settop(L, top);
+    throw std::runtime_error("the lorentz module isn't loaded");
+  }
+
+  if (fields.needs("castor_energy")) {
+    lua_pushnumber(L, in.rec.castor_status.energy());
+    lua_setfield(L, e, "castor_energy");
+  }
+
+  using lorentz::vec;
+
+  if (fields.needs("ecal")) {
+    lua_createtable(L, 0, _d->ecal_hint);
+    if (fields.needs("ecal.bp")) {
+      set_vec(L, meta, "bp", vec::m_e_phi_eta(0, in.rec.ecal.barrel.plus,
+                                                 in.rec.ecal.barrel.phi_plus,
+                                                 in.rec.ecal.barrel.eta_plus));
+    }
+    if (fields.needs("ecal.bm")) {
+      set_vec(L, meta, "bm", vec::m_e_phi_eta(0, in.rec.ecal.barrel.minus,
+                                                 in.rec.ecal.barrel.phi_minus,
+                                                 in.rec.ecal.barrel.eta_minus));
+    }
+    if (fields.needs("ecal.ep")) {
+      set_vec(L, meta, "ep", vec::m_e_phi_eta(0, in.rec.ecal.endcap.plus,
+                                                 in.rec.ecal.endcap.phi_plus,
+                                                 in.rec.ecal.endcap.eta_plus));
+    }
+    if (fields.needs("ecal.em")) {
+      set_vec(L, meta, "em", vec::m_e_phi_eta(0, in.rec.ecal.endcap.minus,
+                                                 in.rec.ecal.endcap.phi_minus,
+                                                 in.rec.ecal.endcap.eta_minus));
+    }
+    lua_setfield(L, e, "ecal");
+  }
+
+  if (fields.needs("hcal")) {
+    lua_createtable(L, 0, _d->hcal_hint);
+    if (fields.needs("hcal.bp")) {
+      set_vec(L, meta, "bp", vec::m_e_phi_eta(0, in.rec.hcal.barrel.plus,
+                                                 in.rec.hcal.barrel.phi_plus,
+                                                 in.rec.hcal.barrel.eta_plus));
+    }
+    if (fields.needs("hcal.bm")) {
+      set_vec(L, meta, "bm", vec::m_e_phi_eta(0, in.rec.hcal.barrel.minus,
+                                                 in.rec.hcal.barrel.phi_minus,
+                                                 in.rec.hcal.barrel.eta_minus));
+    }
+    if (fields.needs("hcal.ep")) {
+      set_vec(L, meta, "ep", vec::m_e_phi_eta(0, in.rec.hcal.endcap.plus,
+                                                 in.rec.hcal.endcap.phi_plus,
+                                                 in.rec.hcal.endcap.eta_plus));
+    }
+    if (fields.needs("hcal.em")) {
+      set_vec(L, meta, "em", vec::m_e_phi_eta(0, in.rec.hcal.endcap.minus,
+                                                 in.rec.hcal.endcap.phi_minus,
+                                                 in.rec.hcal.endcap.eta_minus));
+    }
+    if (fields.needs("hcal.fp")) {
+      set_vec(L, meta, "fp", vec::m_e_phi_eta(0, in.rec.hcal.forward.plus,
+                                                 in.rec.hcal.forward.phi_plus,
+                                                 in.rec.hcal.forward.eta_plus));
+    }
+    if (fields.needs("hcal.fm")) {
+      set_vec(L, meta, "fm", vec::m_e_phi_eta(0, in.rec.hcal.forward.minus,
+                                                 in.rec.hcal.forward.phi_minus,
+                                                 in.rec.hcal.forward.eta_minus));
+    }
+    lua_setfield(L, e, "hcal");
+  }
+
+  if (fields.needs("zdc")) {
+    lua_createtable(L, 0, _d->zdc_hint);
+    // FIXME Dark magic.
+    if (fields.needs("zdc.plus")) {
+      set_number(L, "plus", in.zdc_plus[4]);
+    }
+    if (fields.needs("zdc.minus")) {
+      set_number(L, "minus", in.zdc_minus[4]);
+    }
+    lua_setfield(L, e, "zdc");
+  }
+
+  if (fields.needs("tracks")) {
+    int ntracks = fields.needs("tracks.[]") ? std::max(in.ntracks, 0) : 0;
+    lua_createtable(L, ntracks, 1);
+    for (int i = 0; i < ntracks; ++i) {
+      lua_createtable(L, 0, _d->track_hint);
+      if (_d->track_p) {
+        set_vec(L, meta, "p", vec::m_r_phi_theta(MASS, in.p[i], in.phi[i],
+                                                 in.lambda[i]));
+      }
+      if (_d->track_q) {
+        set_number(L, "q", in.qoverp[i] > 0 ? 1 : -1);
+      }
+      if (_d->track_chi2) {
+        set_number(L, "chi2", in.chi2[i]);
+      }
+      if (_d->track_ndof) {
+        set_number(L, "ndof", in.ndof[i]);
+      }
+      if (_d->track_x) {
+        set_number(L, "x", in.trkx[i]);
+      }
+      if (_d->track_y) {
+        set_number(L, "y", in.trky[i]);
+      }
+      if (_d->track_z) {
+        set_number(L, "z", in.trkz[i]);
+      }
+      lua_rawseti(L, -2, i + 1);
+    }
+    set_number(L, "n", in.ntracks);
+    lua_setfield(L, e, "tracks");
+  }
+
+  lua_settop(L, top);
 }
 
 const event &hlt_parser::gen()
 {
-  return _d->rec;
+  return _d->cur->rec;
 }
 
 const event &hlt_parser::rec()
 {
-  return _d->rec;
+  return _d->cur->rec;
 }
 
 void hlt_parser::reset()
 {
-  _d->current = 0;
+  _d->stop_reader();
+  _d->current = _d->first;
+  _d->start_reader();
+}
+
+namespace // anonymous
+{
+  /// A branch read by mapped_parser
+  struct mapped_branch
+  {
+    enum class leaf_type { int_type, unsigned_type, float_type, double_type };
+
+    std::string name;
+    std::size_t tree;
+    leaf_type type = leaf_type::double_type;
+    std::size_t size = 0; ///< Size of fixed-size arrays, 0 otherwise
+    bool per_entry = false; ///< Array sized by the count of the tree
+    bool used = false;
+    std::vector<char> buffer;
+
+    std::size_t element_size() const
+    {
+      switch (type) {
+      case leaf_type::int_type:
+        return sizeof(int);
+      case leaf_type::unsigned_type:
+        return sizeof(unsigned);
+      case leaf_type::float_type:
+        return sizeof(float);
+      case leaf_type::double_type:
+        return sizeof(double);
+      }
+      return 0;
+    }
+
+    double at(std::size_t i) const
+    {
+      const char *data = buffer.data();
+      switch (type) {
+      case leaf_type::int_type:
+        return reinterpret_cast<const int *>(data)[i];
+      case leaf_type::unsigned_type:
+        return reinterpret_cast<const unsigned *>(data)[i];
+      case leaf_type::float_type:
+        return reinterpret_cast<const float *>(data)[i];
+      case leaf_type::double_type:
+        return reinterpret_cast<const double *>(data)[i];
+      }
+      return 0;
+    }
+  };
+
+  struct mapped_tree
+  {
+    std::string name;
+    TTree *tree = nullptr;
+    int count = -1; ///< Branch with the number of array elements, if any
+    std::size_t capacity = 1;
+    bool used = false;
+  };
+
+  struct mapped_argument
+  {
+    int branch = -1; ///< -1 for numbers
+    double number = 0;
+  };
+
+  struct mapped_field
+  {
+    int line;
+    std::string name;
+    std::vector<std::string> path;
+    std::size_t element; ///< Position of "[]" in the path, or path.size()
+    std::string conversion;
+    std::vector<mapped_argument> arguments;
+    int tree = -1; ///< Tree whose arrays are looped over, if any
+    bool active = true;
+  };
+
+  std::runtime_error mapping_error(int line, const std::string &what)
+  {
+    return std::runtime_error("line " + std::to_string(line) + ": " + what);
+  }
+
+  bool is_builtin(const std::string &conversion)
+  {
+    return conversion == "value" || conversion == "sign" ||
+           conversion == "element" || conversion == "castor_energy";
+  }
+
+  /// Looks up Lua functions like vec.m_e_phi_eta
+  sol::function find_function(sol::state &lua, const mapped_field &field)
+  {
+    // Assigning to a sol::reference doesn't release what it referred to, so
+    // walk the path on the stack
+    lua_State *L = lua.lua_state();
+    lua_pushvalue(L, LUA_GLOBALSINDEX);
+    std::istringstream parts(field.conversion);
+    std::string part;
+    while (std::getline(parts, part, '.') && lua_istable(L, -1)) {
+      lua_getfield(L, -1, part.c_str());
+      lua_remove(L, -2);
+    }
+    if (!lua_isfunction(L, -1)) {
+      lua_pop(L, 1);
+      throw mapping_error(field.line, "unknown function " + field.conversion);
+    }
+    sol::function function(L, -1);
+    lua_pop(L, 1);
+    return function;
+  }
+
+  /// Returns t[key], creating an empty table if it doesn't exist
+  template<class Key>
+  sol::table child(sol::state &lua, sol::table &t, const Key &key)
+  {
+    sol::object existing = t[key];
+    if (existing.get_type() == sol::type::table) {
+      return existing.as<sol::table>();
+    }
+    sol::table created = lua.create_table();
+    t[key] = created;
+    return created;
+  }
+
+  /// Returns the table at path[begin, end) below t, creating it if needed
+  sol::table child(sol::state &lua, sol::table &t,
+                   const std::vector<std::string> &path,
+                   std::size_t begin, std::size_t end)
+  {
+    if (begin == end) {
+      return t;
+    }
+    // One table per level: assigning to t wouldn't release it
+    sol::table next = child(lua, t, path[begin]);
+    return child(lua, next, path, begin + 1, end);
+  }
+} // anonymous namespace
+
+struct mapped_parser::data
+{
+  TFile *file;
+  long count, current;
+  long first = 0, last = -1; ///< Range of entries to read
+  event rec;
+
+  std::vector<std::string> modules;
+  std::vector<mapped_tree> trees;
+  std::vector<mapped_branch> branches;
+  std::vector<mapped_field> fields;
+  std::vector<TTree *> active_trees;
+  field_set selection = field_set::everything();
+  Long64_t cache_size = -1;
+  /// Key of the table of the Lua functions of the fields in the registry
+  std::string functions_key;
+
+  void parse(std::istream &in);
+  int add_branch(const std::string &spec, int line);
+  void check_field(mapped_field &field);
+  void set_addresses();
+  void activate(const field_set &selected);
+
+  std::size_t elements(const mapped_tree &tree) const;
+  double argument(const mapped_field &field, std::size_t a,
+                  std::size_t i) const;
+  sol::object convert(sol::state &lua, const mapped_field &field,
+                      const sol::function &function, std::size_t i) const;
+};
+
+/*
+ * Reads the mapping file.
+ */
+void mapped_parser::data::parse(std::istream &in)
+{
+  std::string text;
+  int line = 0;
+  while (std::getline(in, text)) {
+    ++line;
+    std::istringstream words(text);
+    std::string first;
+    if (!(words >> first) || first[0] == '#') {
+      continue;
+    }
+
+    if (first == "require") {
+      std::string module;
+      if (!(words >> module)) {
+        throw mapping_error(line, "module name expected");
+      }
+      modules.push_back(module);
+    } else if (first == "tree") {
+      mapped_tree tree;
+      if (!(words >> tree.name)) {
+        throw mapping_error(line, "tree name expected");
+      }
+      file->GetObject(tree.name.c_str(), tree.tree);
+      if (tree.tree == nullptr) {
+        throw mapping_error(line, "no tree called " + tree.name);
+      }
+      trees.push_back(tree);
+    } else if (first == "count") {
+      std::string spec;
+      if (trees.empty()) {
+        throw mapping_error(line, "count outside of a tree");
+      } else if (trees.back().count >= 0) {
+        throw mapping_error(line, "tree " + trees.back().name +
+                                  " already has a count");
+      } else if (!(words >> spec >> trees.back().capacity) ||
+                 trees.back().capacity == 0) {
+        throw mapping_error(line, "count branch and capacity expected");
+      }
+      if (spec.find(':') == std::string::npos) {
+        spec += ":int";
+      }
+      trees.back().count = add_branch(spec, line);
+    } else {
+      mapped_field field;
+      field.line = line;
+      field.name = first;
+      std::string equal;
+      if (!(words >> equal >> field.conversion) || equal != "=") {
+        throw mapping_error(line, "expected \"field = conversion ...\"");
+      }
+      std::string word;
+      while (words >> word) {
+        mapped_argument argument;
+        char *end;
+        argument.number = std::strtod(word.c_str(), &end);
+        if (*end != '\0') {
+          if (trees.empty()) {
+            throw mapping_error(line, "branch " + word + " outside of a tree");
+          }
+          argument.branch = add_branch(word, line);
+        }
+        field.arguments.push_back(argument);
+      }
+      fields.push_back(field);
+    }
+  }
+
+  if (trees.empty()) {
+    throw mapping_error(line, "no tree to read");
+  }
+
+  // Arrays are sized once all counts are known
+  for (mapped_branch &b : branches) {
+    const mapped_tree &tree = trees[b.tree];
+    b.per_entry = (b.size == 0 && tree.count >= 0 &&
+                   &b != &branches[tree.count]);
+  }
+  for (mapped_field &field : fields) {
+    check_field(field);
+  }
+}
+
+/*
+ * Finds or adds the branch described by name[:type][[size]] in the current
+ * tree.
+ */
+int mapped_parser::data::add_branch(const std::string &spec, int line)
+{
+  mapped_branch b;
+  b.tree = trees.size() - 1;
+
+  std::string type_name;
+  std::size_t bracket = spec.find('[');
+  std::size_t colon = spec.find(':');
+  b.name = spec.substr(0, std::min(colon, bracket));
+  if (colon != std::string::npos && colon < bracket) {
+    type_name = spec.substr(colon + 1, bracket - colon - 1);
+  }
+  if (bracket != std::string::npos) {
+    char *end;
+    b.size = std::strtoul(spec.c_str() + bracket + 1, &end, 10);
+    if (b.size == 0 || std::string(end) != "]") {
+      throw mapping_error(line, "bad array size in " + spec);
+    }
+  }
+
+  if (type_name == "int") {
+    b.type = mapped_branch::leaf_type::int_type;
+  } else if (type_name == "unsigned") {
+    b.type = mapped_branch::leaf_type::unsigned_type;
+  } else if (type_name == "float") {
+    b.type = mapped_branch::leaf_type::float_type;
+  } else if (type_name != "double" && !type_name.empty()) {
+    throw mapping_error(line, "unknown type " + type_name);
+  }
+
+  // Branches can be mentioned several times, with the type given only once
+  for (std::size_t i = 0; i < branches.size(); ++i) {
+    const mapped_branch &other = branches[i];
+    if (other.tree == b.tree && other.name == b.name) {
+      if ((!type_name.empty() && other.type != b.type) ||
+          (bracket != std::string::npos && other.size != b.size)) {
+        throw mapping_error(line, "branch " + b.name +
+                                  " used with different types");
+      }
+      return i;
+    }
+  }
+
+  TTree *tree = trees.back().tree;
+  if (tree->GetBranch(b.name.c_str()) == nullptr) {
+    throw mapping_error(line, "no branch called " + b.name + " in tree " +
+                              trees.back().name);
+  }
+
+  branches.push_back(b);
+  return branches.size() - 1;
+}
+
+/*
+ * Checks the arguments of a field and finds the tree of its arrays.
+ */
+void mapped_parser::data::check_field(mapped_field &field)
+{
+  // Path
+  std::istringstream parts(field.name);
+  std::string part;
+  field.element = std::string::npos;
+  while (std::getline(parts, part, '.')) {
+    if (part.empty()) {
+      throw mapping_error(field.line, "bad field name " + field.name);
+    } else if (part == "[]") {
+      if (field.element != std::string::npos) {
+        throw mapping_error(field.line, "nested arrays aren't supported");
+      } else if (field.path.empty()) {
+        throw mapping_error(field.line, "the event isn't an array");
+      }
+      field.element = field.path.size();
+    }
+    field.path.push_back(part);
+  }
+  if (field.element == std::string::npos) {
+    field.element = field.path.size();
+  }
+
+  // Arguments
+  const std::string &conversion = field.conversion;
+  std::size_t expected = field.arguments.size();
+  if (conversion == "value" || conversion == "sign") {
+    expected = 1;
+  } else if (conversion == "element") {
+    expected = 2;
+  } else if (conversion == "castor_energy") {
+    expected = 3;
+  }
+  if (field.arguments.size() != expected) {
+    throw mapping_error(field.line, conversion + " takes " +
+                                    std::to_string(expected) + " arguments");
+  }
+  if (conversion == "element") {
+    const mapped_argument &array = field.arguments[0];
+    const mapped_argument &index = field.arguments[1];
+    if (array.branch < 0 || branches[array.branch].size == 0) {
+      throw mapping_error(field.line, "element needs a fixed-size array");
+    } else if (index.branch >= 0 || index.number < 0 ||
+               index.number >= branches[array.branch].size) {
+      throw mapping_error(field.line, "bad element index");
+    }
+  } else if (conversion != "castor_energy") {
+    for (const mapped_argument &a : field.arguments) {
+      if (a.branch >= 0 && branches[a.branch].size > 0) {
+        throw mapping_error(field.line, branches[a.branch].name +
+                                        " is a fixed-size array");
+      }
+    }
+  }
+
+  // Arrays
+  for (const mapped_argument &a : field.arguments) {
+    if (a.branch >= 0 && branches[a.branch].per_entry) {
+      int tree = branches[a.branch].tree;
+      if (field.tree >= 0 && field.tree != tree) {
+        throw mapping_error(field.line, "mixes arrays of different trees");
+      }
+      field.tree = tree;
+    }
+  }
+  bool loops = (field.element < field.path.size() ||
+                conversion == "castor_energy");
+  if (loops && field.tree < 0) {
+    throw mapping_error(field.line, "no array to loop over");
+  } else if (!loops && field.tree >= 0) {
+    throw mapping_error(field.line, "uses an array outside of \"[]\"");
+  }
+}
+
+/*
+ * Allocates the buffers of the branches.
+ */
+void mapped_parser::data::set_addresses()
+{
+  typedef mapped_branch::leaf_type leaf_type;
+  for (mapped_branch &b : branches) {
+    std::size_t size = b.size > 0 ? b.size
+                                  : b.per_entry ? trees[b.tree].capacity : 1;
+    b.buffer.assign(size * b.element_size(), 0);
+
+    // Use typed pointers so ROOT can check the type
+    TTree *tree = trees[b.tree].tree;
+    const char *name = b.name.c_str();
+    void *address = b.buffer.data();
+    int status = 0;
+    switch (b.type) {
+    case leaf_type::int_type:
+      status = tree->SetBranchAddress(name, static_cast<int *>(address));
+      break;
+    case leaf_type::unsigned_type:
+      status = tree->SetBranchAddress(name, static_cast<unsigned *>(address));
+      break;
+    case leaf_type::float_type:
+      status = tree->SetBranchAddress(name, static_cast<float *>(address));
+      break;
+    case leaf_type::double_type:
+      status = tree->SetBranchAddress(name, static_cast<double *>(address));
+      break;
+    }
+    if (status < 0) {
+      throw std::runtime_error("branch " + b.name + " of tree " +
+                               trees[b.tree].name +
+                               " doesn't have the declared type");
+    }
+  }
+}
+
+/*
+ * Enables the branches needed to fill the selected fields.
+ */
+void mapped_parser::data::activate(const field_set &selected)
+{
+  selection = selected;
+  for (mapped_tree &tree : trees) {
+    tree.used = false;
+  }
+  for (mapped_branch &b : branches) {
+    b.used = false;
+  }
+  for (mapped_field &field : fields) {
+    field.active = selected.needs(field.name);
+    if (!field.active) {
+      continue;
+    }
+    for (const mapped_argument &a : field.arguments) {
+      if (a.branch >= 0) {
+        branches[a.branch].used = true;
+      }
+    }
+    if (field.tree >= 0) {
+      branches[trees[field.tree].count].used = true;
+    }
+  }
+
+  // Branches without an address would be read too, so start from nothing
+  for (mapped_tree &tree : trees) {
+    tree.tree->SetBranchStatus("*", 0);
+  }
+  for (const mapped_branch &b : branches) {
+    if (b.used) {
+      trees[b.tree].tree->SetBranchStatus(b.name.c_str(), 1);
+      trees[b.tree].used = true;
+    }
+  }
+  active_trees.clear();
+  for (const mapped_tree &tree : trees) {
+    if (tree.used) {
+      active_trees.push_back(tree.tree);
+    }
+  }
+
+  // Cache the baskets of the used branches
+  for (const mapped_tree &tree : trees) {
+    tree.tree->SetCacheSize(tree.used ? cache_size : 0);
+  }
+  for (const mapped_branch &b : branches) {
+    if (b.used && cache_size != 0) {
+      trees[b.tree].tree->AddBranchToCache(b.name.c_str(), true);
+    }
+  }
+  for (TTree *tree : active_trees) {
+    if (cache_size != 0) {
+      tree->StopCacheLearningPhase();
+    }
+  }
+}
+
+/*
+ * Returns the number of array elements in the current entry of a tree.
+ */
+std::size_t mapped_parser::data::elements(const mapped_tree &tree) const
+{
+  double n = branches[tree.count].at(0);
+  if (n > tree.capacity) {
+    throw std::runtime_error("entry " + std::to_string(current - 1) +
+                             " of tree " + tree.name + " has more than " +
+                             std::to_string(tree.capacity) + " elements");
+  }
+  return n > 0 ? n : 0;
+}
+
+/*
+ * Returns the value of an argument for the i-th array element.
+ */
+double mapped_parser::data::argument(const mapped_field &field, std::size_t a,
+                                     std::size_t i) const
+{
+  const mapped_argument &arg = field.arguments[a];
+  if (arg.branch < 0) {
+    return arg.number;
+  }
+  const mapped_branch &b = branches[arg.branch];
+  return b.at(b.per_entry ? i : 0);
+}
+
+/*
+ * Computes the value of a field for the i-th array element.
+ */
+sol::object mapped_parser::data::convert(sol::state &lua,
+                                         const mapped_field &field,
+                                         const sol::function &function,
+                                         std::size_t i) const
+{
+  const std::string &conversion = field.conversion;
+  if (conversion == "value") {
+    return sol::make_object(lua, argument(field, 0, i));
+  } else if (conversion == "sign") {
+    return sol::make_object(lua, argument(field, 0, i) > 0 ? 1 : -1);
+  } else if (conversion == "element") {
+    const mapped_branch &b = branches[field.arguments[0].branch];
+    return sol::make_object(lua, b.at(field.arguments[1].number));
+  } else if (conversion == "castor_energy") {
+    castor status = castor();
+    std::size_t n = elements(trees[field.tree]);
+    for (std::size_t j = 0; j < n; ++j) {
+      status.add_hit(argument(field, 0, j), argument(field, 1, j),
+                     argument(field, 2, j));
+    }
+    return sol::make_object(lua, status.energy());
+  }
+
+  // Lua function
+  lua_State *L = lua.lua_state();
+  function.push();
+  for (std::size_t a = 0; a < field.arguments.size(); ++a) {
+    lua_pushnumber(L, argument(field, a, i));
+  }
+  if (lua_pcall(L, field.arguments.size(), 1, 0) != 0) {
+    std::string error = lua_tostring(L, -1);
+    lua_pop(L, 1);
+    throw std::runtime_error(conversion + ": " + error);
+  }
+  sol::object result(L, -1);
+  lua_pop(L, 1);
+  return result;
+}
+
+mapped_parser::mapped_parser(const std::string &filename,
+                             std::istream &mapping) :
+  _filename(filename),
+  _d(new data)
+{
+  static std::atomic<unsigned long> parsers(0);
+  _d->functions_key = "mapped_parser " + std::to_string(parsers++);
+
+  _d->file = new TFile(filename.c_str());
+  if (_d->file->IsZombie()) {
+    throw std::runtime_error("could not open " + filename);
+  }
+  _d->parse(mapping);
+  _d->set_addresses();
+  _d->activate(field_set::everything());
+  _d->count = _d->trees.front().tree->GetEntries();
+  _d->last = _d->count;
+  reset();
+}
+
+/**
+ * \brief Only reads the branches needed to fill the given fields.
+ *
+ * Fields of the mapping that aren't needed are left out of the tables created
+ * by fill_rec(). Statistics about the skipped data are printed to stderr.
+ */
+void mapped_parser::select(const field_set &fields, bool quiet)
+{
+  _d->activate(fields);
+  if (quiet) {
+    return;
+  }
+
+  int used = 0;
+  Long64_t read_bytes = 0, total_bytes = 0;
+  for (const mapped_branch &b : _d->branches) {
+    if (b.used) {
+      ++used;
+      TTree *tree = _d->trees[b.tree].tree;
+      read_bytes += tree->GetBranch(b.name.c_str())->GetZipBytes();
+    }
+  }
+  for (const mapped_tree &tree : _d->trees) {
+    total_bytes += tree.tree->GetZipBytes();
+  }
+
+  std::cerr << "[INFO] Reading " << used << " of " << _d->branches.size()
+            << " mapped branches (" << _d->active_trees.size() << " of "
+            << _d->trees.size() << " trees), skipping "
+            << total_bytes - read_bytes << " compressed bytes" << std::endl;
+}
+
+/**
+ * \brief Sets the size of the TTreeCache of the trees, in bytes.
+ *
+ * The default is ROOT's default size, and 0 disables the cache.
+ */
+void mapped_parser::set_cache_size(long long bytes)
+{
+  _d->cache_size = bytes;
+  _d->activate(field_set(_d->selection));
+}
+
+long mapped_parser::entries()
+{
+  return _d->count;
+}
+
+void mapped_parser::set_range(long first, long last)
+{
+  _d->first = std::max(first, 0L);
+  _d->last = std::min(last, _d->count);
+  _d->current = _d->first;
+}
+
+bool mapped_parser::end()
+{
+  return _d->current >= _d->last;
+}
+
+void mapped_parser::read()
+{
+  for (TTree *tree : _d->active_trees) {
+    tree->GetEntry(_d->current);
+  }
+  _d->current++;
+}
+
+/**
+ * \brief Reads up to \c count events into \c slots.
+ *
+ * Same as event_source::read_batch(), without the virtual calls. The slots
+ * point to the same empty event.
+ */
+std::size_t mapped_parser::read_batch(event_slot *slots, std::size_t count,
+                                      sol::state *lua)
+{
+  for (std::size_t i = 0; i < count; ++i) {
+    mapped_parser::read();
+    if (mapped_parser::end()) {
+      return i;
+    }
+    event_slot &slot = slots[i];
+    slot.gen = &_d->rec;
+    slot.rec = &_d->rec;
+    if (lua != nullptr) {
+      slot.reset_fill(*lua);
+      mapped_parser::fill_rec(*lua, slot.fill);
+    }
+  }
+  return count;
+}
+
+/**
+ * \brief Loads the modules of the mapping and looks up the Lua functions
+ *        used by the fields.
+ *
+ * The functions are kept in the registry of the state, so fill_rec() doesn't
+ * have to look them up for every event. The parser itself isn't changed.
+ */
+void mapped_parser::prepare(sol::state &lua)
+{
+  for (const std::string &module : _d->modules) {
+    lua.script("require(\"" + module + "\")");
+  }
+  sol::table functions = lua.create_table();
+  for (std::size_t f = 0; f < _d->fields.size(); ++f) {
+    if (!is_builtin(_d->fields[f].conversion)) {
+      functions[f + 1] = find_function(lua, _d->fields[f]);
+    }
+  }
+  lua.registry()[_d->functions_key] = functions;
+}
+
+void mapped_parser::fill_rec(sol::state &lua, sol::table &event)
+{
+  sol::object registered = lua.registry()[_d->functions_key];
+  if (registered.get_type() != sol::type::table) {
+    prepare(lua);
+  }
+  sol::table functions = lua.registry()[_d->functions_key];
+
+  for (std::size_t f = 0; f < _d->fields.size(); ++f) {
+    const mapped_field &field = _d->fields[f];
+    if (!field.active) {
+      continue;
+    }
+
+    sol::function function = is_builtin(field.conversion)
+                             ? sol::function()
+                             : functions.get<sol::function>(f + 1);
+
+    const std::vector<std::string> &path = field.path;
+    if (field.element == path.size()) {
+      sol::table parent = child(lua, event, path, 0, path.size() - 1);
+      parent[path.back()] = _d->convert(lua, field, function, 0);
+      continue;
+    }
+
+    sol::table array = child(lua, event, path, 0, field.element);
+    std::size_t n = _d->elements(_d->trees[field.tree]);
+    for (std::size_t i = 0; i < n; ++i) {
+      sol::object value = _d->convert(lua, field, function, i);
+      if (field.element == path.size() - 1) {
+        array[i + 1] = value;
+      } else {
+        sol::table element = child(lua, array, i + 1);
+        sol::table parent = child(lua, element, path, field.element + 1,
+                                  path.size() - 1);
+        parent[path.back()] = value;
+      }
+    }
+  }
+}
+
+const event &mapped_parser::gen()
+{
+  return _d->rec;
+}
+
+const event &mapped_parser::rec()
+{
+  return _d->rec;
+}
+
+void mapped_parser::reset()
+{
+  _d->current = _d->first;
 }
@@ -2,17 +2,20 @@
 #define PARSER_H
 
 #include <fstream>
+#include <iostream>
 #include <memory>
 #include <string>
 
 #include "event.h"
 #include "event_source.h"
+#include "field_usage.h"
 
 class starlight_parser : public event_source
 {
   std::ifstream _in;
   std::string _filename;
   event _current;
+  std::string _token; ///< Buffer for numbers
 
   starlight_parser(const starlight_parser &) {}
 
@@ -41,12 +44,35 @@ public:
   bool end();
   bool has_rec();
   void read();
+  std::size_t read_batch(event_slot *slots, std::size_t count,
+                         sol::state *lua);
   const event &rec();
   const event &gen();
   void reset();
 };
 
-class hlt_parser : public event_source
+/**
+ * \brief Event source reading the entries of ROOT trees
+ *
+ * The entries read can be limited to a range with set_range(), so that several
+ * sources can read parts of the same file in parallel. Every source opens its
+ * own TFile.
+ */
+class tree_source : public event_source
+{
+public:
+  /// Only reads the branches needed by the fields, printing statistics unless
+  /// quiet is set
+  virtual void select(const field_set &fields, bool quiet = false) = 0;
+  /// Sets the size of the TTreeCache in bytes, 0 disables it
+  virtual void set_cache_size(long long bytes) = 0;
+  /// Returns the number of entries in the file
+  virtual long entries() = 0;
+  /// Only reads entries from first to last (excluded), and rewinds to first
+  virtual void set_range(long first, long last) = 0;
+};
+
+class hlt_parser : public tree_source
 {
   std::string _filename;
   struct data;
@@ -56,10 +82,83 @@ private:
   hlt_parser(const hlt_parser &) {}
 
 public:
+  /// Capacity of the track and CASTOR hit arrays of the ntuples
+  static const int BIG_TRACK_COUNT = 1000;
+  static const int BIG_HIT_COUNT = 224;
+
   explicit hlt_parser(const std::string &filename);
 
+  void select(const field_set &fields, bool quiet = false);
+  void set_cache_size(long long bytes);
+  long entries();
+  void set_range(long first, long last);
+  void set_read_ahead(int entries);
+
+  bool end();
+  void read();
+  std::size_t read_batch(event_slot *slots, std::size_t count,
+                         sol::state *lua);
+  void prepare(sol::state &lua);
+  void fill_rec(sol::state &lua, sol::table &event);
+  const event &rec();
+  const event &gen();
+  void reset();
+};
+
+/**
+ * \brief Reads ROOT ntuples whose layout is described in a mapping file
+ *
+ * The mapping file says which branches are read and how they make up the
+ * fields of the events written by fill_rec(). Branches that aren't mentioned
+ * are never read. Lines starting with "#" are ignored, and the others are
+ * one of:
+ *
+ *  - <tt>require module</tt>: loads a Lua module in prepare();
+ *  - <tt>tree name</tt>: the next branches are read from this tree;
+ *  - <tt>count branch[:type] capacity</tt>: the other branches of the tree are
+ *    arrays of at most \c capacity elements, of which \c branch are used;
+ *  - <tt>field = conversion argument...</tt>: fills \c field.
+ *
+ * Arguments are numbers or branches of the current tree, written
+ * <tt>name[:type][[size]]</tt>. The type is one of \c int, \c unsigned,
+ * \c float and \c double (the default); a size makes a fixed-size array.
+ * The conversions are:
+ *
+ *  - \c value: the value of the branch;
+ *  - \c sign: 1 if the branch is positive and -1 otherwise;
+ *  - \c element: the element of a fixed-size array at the given index;
+ *  - \c castor_energy: the CASTOR energy computed from the module, sector and
+ *    data arrays of the hits;
+ *  - anything else is the name of a Lua function, like
+ *    <tt>vec.m_e_phi_eta</tt>, called with the arguments.
+ *
+ * Fields containing "[]" are filled for every element of the array of the
+ * tree of their arguments, as in <tt>tracks.[].q = sign qoverp</tt>.
+ *
+ * Errors in the mapping file or in the ROOT file are reported by throwing a
+ * std::runtime_error. rec() and gen() return empty events.
+ */
+class mapped_parser : public tree_source
+{
+  std::string _filename;
+  struct data;
+  std::shared_ptr<data> _d;
+
+private:
+  mapped_parser(const mapped_parser &) {}
+
+public:
+  mapped_parser(const std::string &filename, std::istream &mapping);
+
+  void select(const field_set &fields, bool quiet = false);
+  void set_cache_size(long long bytes);
+  long entries();
+  void set_range(long first, long last);
+
   bool end();
   void read();
+  std::size_t read_batch(event_slot *slots, std::size_t count,
+                         sol::state *lua);
   void prepare(sol::state &lua);
   void fill_rec(sol::state &lua, sol::table &event);
   const event &rec();
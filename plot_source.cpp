@@ -16,7 +16,7 @@ file_plot_source::file_plot_source(const QString &file_path,
   _name(name)
 {
   histogram_reader reader(_file_path);
-  _data = reader.data(name);
+  _data = reader.ranges(name);
 }
 
 void file_plot_source::minmax(double &min, double &max) const
@@ -25,12 +25,12 @@ void file_plot_source::minmax(double &min, double &max) const
   double absmax = max;
   min = std::numeric_limits<double>::max();
   max = std::numeric_limits<double>::lowest();
-  for (auto &point : _data) {
-    if (point.first >= absmin && point.first < min) {
-      min = point.first;
+  for (auto &range : _data) {
+    if (range.low >= absmin && range.low < min) {
+      min = range.low;
     }
-    if (point.first < absmax && point.first > max) {
-      max = point.first;
+    if (range.high < absmax && range.high > max) {
+      max = range.high;
     }
   }
 }
@@ -39,9 +39,7 @@ QCPAbstractPlottable *file_plot_source::plot(QCPAxis *x, QCPAxis *y,
                                              const config &config)
 {
   hist::histogram hist = hist::histogram(config.axis);
-  for (auto &point : _data) {
-    hist.bin(point.first, point.second);
-  }
+  histogram_reader::rebin(_data, hist);
 
   QCPGraph *graph = new QCPGraph(x, y);
   hist::qt::set_graph_data(graph, hist);
@@ -52,9 +50,7 @@ QCPAbstractPlottable *file_plot_source::plot(QCPAxis *x, QCPAxis *y,
 double file_plot_source::value_at(double x, const config &config)
 {
   hist::histogram hist = hist::histogram(config.axis);
-  for (auto &point : _data) {
-    hist.bin(point.first, point.second);
-  }
+  histogram_reader::rebin(_data, hist);
 
   int bin = config.axis(x);
   return hist.data().at(bin);
@@ -9,6 +9,7 @@
 #include "qcustomplot.h"
 
 #include "histogram.h"
+#include "histogram_reader.h"
 
 class plot_source : public QObject
 {
@@ -33,7 +34,7 @@ class file_plot_source : public plot_source
 
   std::string _file_path;
   std::string _name;
-  std::vector<std::pair<double, double>> _data;
+  std::vector<histogram_reader::range> _data;
 
 public:
   explicit file_plot_source(const QString &file_path, const std::string &name,
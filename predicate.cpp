@@ -0,0 +1,1170 @@
+#include "predicate.h"
+
+#include <cmath>
+#include <cstdlib>
+#include <limits>
+#include <map>
+#include <stdexcept>
+#include <utility>
+#include <vector>
+
+#include "lua_lexer.h"
+
+namespace // anonymous
+{
+  typedef lua_token token;
+
+  /// Returns true for the names of sum(), count(), all() and any()
+  bool is_aggregate(const std::string &name)
+  {
+    return name == "sum" || name == "count" || name == "all" || name == "any";
+  }
+
+  /// Value of an expression. Tables and strings point to data of the event.
+  struct value
+  {
+    record::kind kind = record::kind::nil;
+    double number = 0; ///< Numbers and booleans
+    const record *table = nullptr;
+    const std::string *string = nullptr;
+
+    static value of(const record *r)
+    {
+      value v;
+      if (r != nullptr) {
+        v.kind = r->type();
+        v.number = r->as_number();
+        v.table = r;
+        v.string = &r->as_string();
+      }
+      return v;
+    }
+
+    static value of(double number)
+    {
+      value v;
+      v.kind = record::kind::number;
+      v.number = number;
+      return v;
+    }
+
+    static value of(bool boolean)
+    {
+      value v;
+      v.kind = record::kind::boolean;
+      v.number = boolean;
+      return v;
+    }
+
+    /// Returns the truth value of the value, as in Lua
+    bool truth() const
+    {
+      return kind != record::kind::nil &&
+             (kind != record::kind::boolean || number != 0);
+    }
+  };
+
+  std::string type_name(const value &v)
+  {
+    switch (v.kind) {
+    case record::kind::nil:
+      return "nil";
+    case record::kind::boolean:
+      return "boolean";
+    case record::kind::number:
+      return "number";
+    case record::kind::string:
+      return "string";
+    case record::kind::table:
+      return "table";
+    }
+    return "?";
+  }
+
+  /// State of an evaluation
+  struct context
+  {
+    const record *event = nullptr;
+    std::vector<value> locals;
+    value result;
+    bool returned = false;
+    bool broken = false;
+  };
+
+  ////////////////////////////////////////////////////////////////////////////
+  // Expressions
+
+  struct expression
+  {
+    virtual ~expression() {}
+    virtual value eval(context &c) const = 0;
+  };
+  typedef std::unique_ptr<expression> expression_ptr;
+
+  struct constant : expression
+  {
+    value v;
+    std::string str;
+
+    explicit constant(const value &v) : v(v) {}
+    explicit constant(const std::string &s) : str(s)
+    {
+      v.kind = record::kind::string;
+      v.string = &str;
+    }
+    value eval(context &) const { return v; }
+  };
+
+  struct event_ref : expression
+  {
+    value eval(context &c) const { return value::of(c.event); }
+  };
+
+  struct local_ref : expression
+  {
+    std::size_t slot;
+
+    explicit local_ref(std::size_t slot) : slot(slot) {}
+    value eval(context &c) const { return c.locals[slot]; }
+  };
+
+  const record &check_table(const value &v)
+  {
+    if (v.kind != record::kind::table) {
+      throw std::runtime_error("attempt to index a " + type_name(v) +
+                               " value");
+    }
+    return *v.table;
+  }
+
+  /// t.name
+  struct field : expression
+  {
+    expression_ptr base;
+    std::string name;
+
+    field(expression_ptr &&base, const std::string &name) :
+      base(std::move(base)), name(name) {}
+    value eval(context &c) const
+    {
+      return value::of(check_table(base->eval(c)).get(name));
+    }
+  };
+
+  /// t[key]
+  struct index : expression
+  {
+    expression_ptr base, key;
+
+    index(expression_ptr &&base, expression_ptr &&key) :
+      base(std::move(base)), key(std::move(key)) {}
+    value eval(context &c) const
+    {
+      const record &t = check_table(base->eval(c));
+      value k = key->eval(c);
+      if (k.kind == record::kind::number) {
+        return value::of(t.get(k.number));
+      } else if (k.kind == record::kind::string) {
+        return value::of(t.get(*k.string));
+      }
+      return value();
+    }
+  };
+
+  /// #t
+  struct length : expression
+  {
+    expression_ptr operand;
+
+    explicit length(expression_ptr &&operand) : operand(std::move(operand)) {}
+    value eval(context &c) const
+    {
+      value v = operand->eval(c);
+      if (v.kind == record::kind::string) {
+        return value::of(double(v.string->size()));
+      } else if (v.kind == record::kind::table) {
+        double n = 0;
+        while (v.table->get(n + 1) != nullptr) {
+          ++n;
+        }
+        return value::of(n);
+      }
+      throw std::runtime_error("attempt to get length of a " + type_name(v) +
+                               " value");
+    }
+  };
+
+  double check_number(const value &v, const char *what)
+  {
+    if (v.kind != record::kind::number) {
+      throw std::runtime_error(std::string("attempt to ") + what + " a " +
+                               type_name(v) + " value");
+    }
+    return v.number;
+  }
+
+  /// -x
+  struct negate : expression
+  {
+    expression_ptr operand;
+
+    explicit negate(expression_ptr &&operand) : operand(std::move(operand)) {}
+    value eval(context &c) const
+    {
+      return value::of(-check_number(operand->eval(c),
+                                     "perform arithmetic on"));
+    }
+  };
+
+  /// not x
+  struct logical_not : expression
+  {
+    expression_ptr operand;
+
+    explicit logical_not(expression_ptr &&operand) :
+      operand(std::move(operand)) {}
+    value eval(context &c) const { return value::of(!operand->eval(c).truth()); }
+  };
+
+  /// a + b, a - b...
+  struct arithmetic : expression
+  {
+    char op;
+    expression_ptr lhs, rhs;
+
+    arithmetic(char op, expression_ptr &&lhs, expression_ptr &&rhs) :
+      op(op), lhs(std::move(lhs)), rhs(std::move(rhs)) {}
+    value eval(context &c) const
+    {
+      double a = check_number(lhs->eval(c), "perform arithmetic on");
+      double b = check_number(rhs->eval(c), "perform arithmetic on");
+      switch (op) {
+      case '+':
+        return value::of(a + b);
+      case '-':
+        return value::of(a - b);
+      case '*':
+        return value::of(a * b);
+      case '/':
+        return value::of(a / b);
+      case '%':
+        return value::of(a - std::floor(a / b) * b);
+      default: // '^'
+        return value::of(std::pow(a, b));
+      }
+    }
+  };
+
+  /// a == b, a < b...
+  struct comparison : expression
+  {
+    std::string op;
+    expression_ptr lhs, rhs;
+
+    comparison(const std::string &op, expression_ptr &&lhs,
+               expression_ptr &&rhs) :
+      op(op), lhs(std::move(lhs)), rhs(std::move(rhs)) {}
+
+    static bool equal(const value &a, const value &b)
+    {
+      if (a.kind != b.kind) {
+        return false;
+      }
+      switch (a.kind) {
+      case record::kind::nil:
+        return true;
+      case record::kind::boolean:
+      case record::kind::number:
+        return a.number == b.number;
+      case record::kind::string:
+        return *a.string == *b.string;
+      case record::kind::table:
+        return a.table == b.table;
+      }
+      return false;
+    }
+
+    static bool less(const value &a, const value &b, bool or_equal)
+    {
+      if (a.kind == record::kind::number && b.kind == record::kind::number) {
+        return or_equal ? a.number <= b.number : a.number < b.number;
+      } else if (a.kind == record::kind::string &&
+                 b.kind == record::kind::string) {
+        return or_equal ? *a.string <= *b.string : *a.string < *b.string;
+      }
+      throw std::runtime_error("attempt to compare " + type_name(a) +
+                               " with " + type_name(b));
+    }
+
+    value eval(context &c) const
+    {
+      value a = lhs->eval(c);
+      value b = rhs->eval(c);
+      if (op == "==") {
+        return value::of(equal(a, b));
+      } else if (op == "~=") {
+        return value::of(!equal(a, b));
+      } else if (op == "<") {
+        return value::of(less(a, b, false));
+      } else if (op == "<=") {
+        return value::of(less(a, b, true));
+      } else if (op == ">") {
+        return value::of(less(b, a, false));
+      } else { // >=
+        return value::of(less(b, a, true));
+      }
+    }
+  };
+
+  /// a and b, a or b
+  struct logical : expression
+  {
+    bool is_and;
+    expression_ptr lhs, rhs;
+
+    logical(bool is_and, expression_ptr &&lhs, expression_ptr &&rhs) :
+      is_and(is_and), lhs(std::move(lhs)), rhs(std::move(rhs)) {}
+    value eval(context &c) const
+    {
+      value a = lhs->eval(c);
+      if (a.truth() != is_and) {
+        return a;
+      }
+      return rhs->eval(c);
+    }
+  };
+
+  /// math.xxx(...)
+  struct math_call : expression
+  {
+    std::string name;
+    std::vector<expression_ptr> args;
+
+    value eval(context &c) const
+    {
+      std::vector<double> x;
+      for (const expression_ptr &arg : args) {
+        value v = arg->eval(c);
+        if (v.kind != record::kind::number) {
+          throw std::runtime_error("bad argument #" +
+                                   std::to_string(x.size() + 1) +
+                                   " to '" + name + "' (number expected, got "
+                                   + type_name(v) + ")");
+        }
+        x.push_back(v.number);
+      }
+      if (name == "abs") {
+        return value::of(std::abs(x[0]));
+      } else if (name == "ceil") {
+        return value::of(std::ceil(x[0]));
+      } else if (name == "cos") {
+        return value::of(std::cos(x[0]));
+      } else if (name == "exp") {
+        return value::of(std::exp(x[0]));
+      } else if (name == "floor") {
+        return value::of(std::floor(x[0]));
+      } else if (name == "log") {
+        return value::of(std::log(x[0]));
+      } else if (name == "sin") {
+        return value::of(std::sin(x[0]));
+      } else if (name == "sqrt") {
+        return value::of(std::sqrt(x[0]));
+      } else if (name == "tan") {
+        return value::of(std::tan(x[0]));
+      } else if (name == "atan2") {
+        return value::of(std::atan2(x[0], x[1]));
+      } else if (name == "fmod") {
+        return value::of(std::fmod(x[0], x[1]));
+      } else if (name == "pow") {
+        return value::of(std::pow(x[0], x[1]));
+      } else if (name == "max") {
+        double m = x[0];
+        for (double y : x) {
+          m = std::max(m, y);
+        }
+        return value::of(m);
+      } else { // min
+        double m = x[0];
+        for (double y : x) {
+          m = std::min(m, y);
+        }
+        return value::of(m);
+      }
+    }
+  };
+
+  /// Number of arguments of math functions (-1 means one or more)
+  const std::map<std::string, int> math_functions = {
+    { "abs", 1 }, { "ceil", 1 }, { "cos", 1 }, { "exp", 1 }, { "floor", 1 },
+    { "log", 1 }, { "sin", 1 }, { "sqrt", 1 }, { "tan", 1 }, { "atan2", 2 },
+    { "fmod", 2 }, { "pow", 2 }, { "max", -1 }, { "min", -1 },
+  };
+
+  /// sum(array, x), count(array, x), all(array, x), any(array, x)
+  struct aggregate : expression
+  {
+    std::string name;
+    expression_ptr array;
+    std::size_t slot;
+    expression_ptr body;
+
+    value eval(context &c) const
+    {
+      value a = array->eval(c);
+      if (a.kind != record::kind::table) {
+        throw std::runtime_error("bad argument #1 to '" + name +
+                                 "' (table expected, got " + type_name(a) +
+                                 ")");
+      }
+      double sum = 0;
+      for (double i = 1; ; ++i) {
+        const record *element = a.table->get(i);
+        if (element == nullptr) {
+          break;
+        }
+        c.locals[slot] = value::of(element);
+        value v = body->eval(c);
+        if (name == "sum") {
+          sum += check_number(v, "sum");
+        } else if (name == "count") {
+          sum += v.truth();
+        } else if (name == "all" && !v.truth()) {
+          return value::of(false);
+        } else if (name == "any" && v.truth()) {
+          return value::of(true);
+        }
+      }
+      if (name == "all") {
+        return value::of(true);
+      } else if (name == "any") {
+        return value::of(false);
+      }
+      return value::of(sum);
+    }
+  };
+
+  ////////////////////////////////////////////////////////////////////////////
+  // Statements
+
+  struct statement
+  {
+    virtual ~statement() {}
+    /// Sets c.returned or c.broken to stop the enclosing block
+    virtual void exec(context &c) const = 0;
+  };
+  typedef std::unique_ptr<statement> statement_ptr;
+  typedef std::vector<statement_ptr> block;
+
+  void run(const block &b, context &c)
+  {
+    for (const statement_ptr &s : b) {
+      s->exec(c);
+      if (c.returned || c.broken) {
+        return;
+      }
+    }
+  }
+
+  struct assignment : statement
+  {
+    std::size_t slot;
+    expression_ptr rhs; ///< nullptr for nil
+
+    assignment(std::size_t slot, expression_ptr &&rhs) :
+      slot(slot), rhs(std::move(rhs)) {}
+    void exec(context &c) const
+    {
+      c.locals[slot] = rhs ? rhs->eval(c) : value();
+    }
+  };
+
+  struct if_statement : statement
+  {
+    std::vector<std::pair<expression_ptr, block>> branches;
+    block otherwise;
+
+    void exec(context &c) const
+    {
+      for (const auto &branch : branches) {
+        if (branch.first->eval(c).truth()) {
+          run(branch.second, c);
+          return;
+        }
+      }
+      run(otherwise, c);
+    }
+  };
+
+  struct do_statement : statement
+  {
+    block body;
+
+    void exec(context &c) const { run(body, c); }
+  };
+
+  struct numeric_for : statement
+  {
+    std::size_t slot;
+    expression_ptr start, stop, step;
+    block body;
+
+    void exec(context &c) const
+    {
+      value first = start->eval(c), last = stop->eval(c);
+      value increment = step ? step->eval(c) : value::of(1.);
+      if (first.kind != record::kind::number) {
+        throw std::runtime_error("'for' initial value must be a number");
+      } else if (last.kind != record::kind::number) {
+        throw std::runtime_error("'for' limit must be a number");
+      } else if (increment.kind != record::kind::number) {
+        throw std::runtime_error("'for' step must be a number");
+      }
+      double inc = increment.number;
+      for (double i = first.number;
+           inc > 0 ? i <= last.number : i >= last.number; i += inc) {
+        c.locals[slot] = value::of(i);
+        run(body, c);
+        if (c.returned) {
+          return;
+        } else if (c.broken) {
+          c.broken = false;
+          return;
+        }
+      }
+    }
+  };
+
+  /// for i, x in ipairs(array)
+  struct ipairs_for : statement
+  {
+    std::size_t index_slot, value_slot;
+    expression_ptr array;
+    block body;
+
+    void exec(context &c) const
+    {
+      value a = array->eval(c);
+      if (a.kind != record::kind::table) {
+        throw std::runtime_error("bad argument #1 to 'ipairs' (table expected,"
+                                 " got " + type_name(a) + ")");
+      }
+      for (double i = 1; ; ++i) {
+        const record *element = a.table->get(i);
+        if (element == nullptr) {
+          return;
+        }
+        c.locals[index_slot] = value::of(i);
+        c.locals[value_slot] = value::of(element);
+        run(body, c);
+        if (c.returned) {
+          return;
+        } else if (c.broken) {
+          c.broken = false;
+          return;
+        }
+      }
+    }
+  };
+
+  struct return_statement : statement
+  {
+    expression_ptr result; ///< nullptr for no value
+
+    explicit return_statement(expression_ptr &&result) :
+      result(std::move(result)) {}
+    void exec(context &c) const
+    {
+      c.result = result ? result->eval(c) : value();
+      c.returned = true;
+    }
+  };
+
+  struct break_statement : statement
+  {
+    void exec(context &c) const { c.broken = true; }
+  };
+
+  ////////////////////////////////////////////////////////////////////////////
+  // Parser
+
+  /// Thrown when the code is outside of the supported subset
+  struct compile_error : std::runtime_error
+  {
+    compile_error(const token &t, const std::string &what) :
+      std::runtime_error("line " + std::to_string(t.line) + ": " + what) {}
+  };
+
+  /*
+   * Recursive descent parser for the supported subset of Lua. It follows the
+   * structure of the Lua 5.1 parser.
+   */
+  class parser
+  {
+    struct binding
+    {
+      enum kind_type { local, event, math } kind;
+      std::size_t slot;
+    };
+
+    const std::vector<token> &_tokens;
+    std::size_t _pos = 0;
+    bool _builtins;
+    std::vector<std::map<std::string, binding>> _scopes;
+    std::size_t _slot_count = 0;
+    int _loop_depth = 0;
+
+  public:
+    parser(const std::vector<token> &tokens, bool builtins) :
+      _tokens(tokens), _builtins(builtins)
+    {
+      // Globals
+      _scopes.emplace_back();
+      _scopes.back()["e"] = binding{ binding::event, 0 };
+      _scopes.back()["math"] = binding{ binding::math, 0 };
+    }
+
+    std::size_t slot_count() const { return _slot_count; }
+
+    block parse_chunk()
+    {
+      block b = parse_block();
+      if (peek().kind != token::eof) {
+        throw compile_error(peek(), "unexpected \"" + peek().text + "\"");
+      }
+      return b;
+    }
+
+    expression_ptr parse_single_expression()
+    {
+      expression_ptr e = parse_expression();
+      if (peek().kind != token::eof) {
+        throw compile_error(peek(), "unexpected \"" + peek().text + "\"");
+      }
+      return e;
+    }
+
+  private:
+    const token &peek(std::size_t ahead = 0) const
+    {
+      return _tokens[std::min(_pos + ahead, _tokens.size() - 1)];
+    }
+
+    const token &next()
+    {
+      const token &t = peek();
+      if (_pos < _tokens.size() - 1) {
+        ++_pos;
+      }
+      return t;
+    }
+
+    bool accept(const char *text)
+    {
+      if (peek().is_op(text) || peek().is_name(text)) {
+        next();
+        return true;
+      }
+      return false;
+    }
+
+    void expect(const char *text)
+    {
+      if (!accept(text)) {
+        throw compile_error(peek(), std::string("\"") + text +
+                                    "\" expected near \"" + peek().text +
+                                    "\"");
+      }
+    }
+
+    std::string expect_name()
+    {
+      if (peek().kind != token::name || peek().is_keyword()) {
+        throw compile_error(peek(), "name expected near \"" + peek().text +
+                                    "\"");
+      }
+      return next().text;
+    }
+
+    const binding *lookup(const std::string &name) const
+    {
+      for (auto it = _scopes.rbegin(); it != _scopes.rend(); ++it) {
+        auto found = it->find(name);
+        if (found != it->end()) {
+          return &found->second;
+        }
+      }
+      return nullptr;
+    }
+
+    std::size_t declare(const std::string &name)
+    {
+      std::size_t slot = _slot_count++;
+      _scopes.back()[name] = binding{ binding::local, slot };
+      return slot;
+    }
+
+    bool block_follows() const
+    {
+      const token &t = peek();
+      return t.kind == token::eof || t.is_name("end") || t.is_name("else") ||
+             t.is_name("elseif") || t.is_name("until");
+    }
+
+    block parse_block()
+    {
+      _scopes.emplace_back();
+      block b;
+      while (!block_follows()) {
+        if (accept(";")) {
+          continue;
+        }
+        bool last = peek().is_name("return") || peek().is_name("break");
+        b.push_back(parse_statement());
+        accept(";");
+        if (last) {
+          break; // Must be the last statement
+        }
+      }
+      _scopes.pop_back();
+      return b;
+    }
+
+    statement_ptr parse_statement()
+    {
+      const token &t = peek();
+      if (accept("if")) {
+        auto s = std::make_unique<if_statement>();
+        do {
+          expression_ptr condition = parse_expression();
+          expect("then");
+          s->branches.emplace_back(std::move(condition), parse_block());
+        } while (accept("elseif"));
+        if (accept("else")) {
+          s->otherwise = parse_block();
+        }
+        expect("end");
+        return s;
+      } else if (accept("for")) {
+        return parse_for();
+      } else if (accept("do")) {
+        auto s = std::make_unique<do_statement>();
+        s->body = parse_block();
+        expect("end");
+        return s;
+      } else if (accept("return")) {
+        expression_ptr result;
+        if (!block_follows() && !peek().is_op(";")) {
+          result = parse_expression();
+          if (peek().is_op(",")) {
+            throw compile_error(peek(), "returns several values");
+          }
+        }
+        return std::make_unique<return_statement>(std::move(result));
+      } else if (accept("break")) {
+        if (_loop_depth == 0) {
+          throw compile_error(t, "no loop to break");
+        }
+        return std::make_unique<break_statement>();
+      } else if (accept("local")) {
+        return parse_local();
+      } else if (t.is_name("function")) {
+        throw compile_error(t, "defines a function");
+      } else if (t.is_name("while") || t.is_name("repeat")) {
+        throw compile_error(t, "uses a " + t.text + " loop");
+      }
+      return parse_assignment();
+    }
+
+    statement_ptr parse_for()
+    {
+      std::string name = expect_name();
+      _scopes.emplace_back();
+      ++_loop_depth;
+      statement_ptr result;
+      if (accept("=")) {
+        auto s = std::make_unique<numeric_for>();
+        s->start = parse_expression();
+        expect(",");
+        s->stop = parse_expression();
+        if (accept(",")) {
+          s->step = parse_expression();
+        }
+        expect("do");
+        s->slot = declare(name);
+        s->body = parse_block();
+        result = std::move(s);
+      } else {
+        std::string value_name = "_";
+        if (accept(",")) {
+          value_name = expect_name();
+        }
+        expect("in");
+        if (!peek().is_name("ipairs") || lookup("ipairs") != nullptr) {
+          throw compile_error(peek(), "only ipairs() loops are supported");
+        }
+        next();
+        expect("(");
+        auto s = std::make_unique<ipairs_for>();
+        s->array = parse_expression();
+        expect(")");
+        expect("do");
+        s->index_slot = declare(name);
+        s->value_slot = declare(value_name);
+        s->body = parse_block();
+        result = std::move(s);
+      }
+      expect("end");
+      --_loop_depth;
+      _scopes.pop_back();
+      return result;
+    }
+
+    statement_ptr parse_local()
+    {
+      const token &t = peek();
+      if (t.is_name("function")) {
+        throw compile_error(t, "defines a function");
+      }
+      std::string name = expect_name();
+      if (peek().is_op(",")) {
+        throw compile_error(peek(), "declares several variables at once");
+      }
+      if (!accept("=")) {
+        return std::make_unique<assignment>(declare(name), nullptr);
+      }
+
+      // Aliases of e and math
+      const token &rhs = peek();
+      const binding *b = lookup(rhs.text);
+      if (rhs.kind == token::name && b != nullptr &&
+          b->kind != binding::local && !peek(1).is_op(".") &&
+          !peek(1).is_op("[") && !peek(1).is_op(":") && !peek(1).is_op("(")) {
+        next();
+        _scopes.back()[name] = *b;
+        return std::make_unique<do_statement>(); // Nothing to do
+      }
+
+      expression_ptr value = parse_expression();
+      // The new variable is only visible after the statement
+      return std::make_unique<assignment>(declare(name), std::move(value));
+    }
+
+    statement_ptr parse_assignment()
+    {
+      const token &t = peek();
+      if (t.kind == token::name && !t.is_keyword() && peek(1).is_op("=")) {
+        const binding *b = lookup(t.text);
+        if (b == nullptr || b->kind != binding::local) {
+          throw compile_error(t, "assigns to global \"" + t.text + "\"");
+        }
+        next();
+        next();
+        return std::make_unique<assignment>(b->slot, parse_expression());
+      }
+      // Anything else is either a field assignment or a function call
+      parse_expression();
+      if (peek().is_op("=") || peek().is_op(",")) {
+        throw compile_error(t, "modifies a table");
+      }
+      throw compile_error(t, "syntax error near \"" + t.text + "\"");
+    }
+
+    /// Priorities of binary operators (left, right), as in Lua
+    static bool binary_priority(const token &t, int &left, int &right)
+    {
+      static const std::map<std::string, std::pair<int, int>> priorities = {
+        { "+", { 6, 6 } }, { "-", { 6, 6 } },
+        { "*", { 7, 7 } }, { "/", { 7, 7 } }, { "%", { 7, 7 } },
+        { "^", { 10, 9 } }, { "..", { 5, 4 } },
+        { "==", { 3, 3 } }, { "~=", { 3, 3 } },
+        { "<", { 3, 3 } }, { "<=", { 3, 3 } },
+        { ">", { 3, 3 } }, { ">=", { 3, 3 } },
+        { "and", { 2, 2 } }, { "or", { 1, 1 } },
+      };
+      if (t.kind != token::op && !t.is_name("and") && !t.is_name("or")) {
+        return false;
+      }
+      auto it = priorities.find(t.text);
+      if (it == priorities.end()) {
+        return false;
+      }
+      left = it->second.first;
+      right = it->second.second;
+      return true;
+    }
+
+    expression_ptr parse_expression(int limit = 0)
+    {
+      static const int UNARY_PRIORITY = 8;
+
+      expression_ptr lhs;
+      if (accept("not")) {
+        lhs = std::make_unique<logical_not>(parse_expression(UNARY_PRIORITY));
+      } else if (accept("-")) {
+        lhs = std::make_unique<negate>(parse_expression(UNARY_PRIORITY));
+      } else if (accept("#")) {
+        lhs = std::make_unique<length>(parse_expression(UNARY_PRIORITY));
+      } else {
+        lhs = parse_primary();
+      }
+
+      int left, right;
+      while (binary_priority(peek(), left, right) && left > limit) {
+        const token &op = next();
+        if (op.text == "..") {
+          throw compile_error(op, "concatenates strings");
+        }
+        expression_ptr rhs = parse_expression(right);
+        if (op.text == "and" || op.text == "or") {
+          lhs = std::make_unique<logical>(op.text == "and", std::move(lhs),
+                                          std::move(rhs));
+        } else if (op.text.size() == 1 && op.text != "<" && op.text != ">") {
+          lhs = std::make_unique<arithmetic>(op.text[0], std::move(lhs),
+                                             std::move(rhs));
+        } else {
+          lhs = std::make_unique<comparison>(op.text, std::move(lhs),
+                                             std::move(rhs));
+        }
+      }
+      return lhs;
+    }
+
+    expression_ptr parse_primary()
+    {
+      const token &t = next();
+      expression_ptr e;
+      if (t.kind == token::number) {
+        char *end;
+        double number = std::strtod(t.text.c_str(), &end);
+        if (*end != '\0') {
+          throw compile_error(t, "malformed number \"" + t.text + "\"");
+        }
+        e = std::make_unique<constant>(value::of(number));
+      } else if (t.kind == token::string) {
+        e = std::make_unique<constant>(t.text);
+      } else if (t.is_name("true") || t.is_name("false")) {
+        e = std::make_unique<constant>(value::of(t.text == "true"));
+      } else if (t.is_name("nil")) {
+        e = std::make_unique<constant>(value());
+      } else if (t.is_op("(")) {
+        e = parse_expression();
+        expect(")");
+      } else if (t.is_name("function")) {
+        throw compile_error(t, "defines a function");
+      } else if (t.is_op("{")) {
+        throw compile_error(t, "creates a table");
+      } else if (t.kind == token::name && !t.is_keyword()) {
+        e = parse_name(t);
+      } else {
+        throw compile_error(t, "unexpected \"" + t.text + "\"");
+      }
+      return parse_suffixes(std::move(e));
+    }
+
+    expression_ptr parse_name(const token &t)
+    {
+      const binding *b = lookup(t.text);
+      if (b == nullptr && _builtins && peek().is_op("(") &&
+          is_aggregate(t.text)) {
+        return parse_aggregate(t.text);
+      } else if (b == nullptr) {
+        if (peek().is_op("(") || peek().kind == token::string) {
+          throw compile_error(t, "calls \"" + t.text + "\"");
+        }
+        throw compile_error(t, "uses global \"" + t.text + "\"");
+      } else if (b->kind == binding::event) {
+        return std::make_unique<event_ref>();
+      } else if (b->kind == binding::local) {
+        return std::make_unique<local_ref>(b->slot);
+      }
+
+      // math library
+      expect(".");
+      std::string name = expect_name();
+      if (name == "pi") {
+        return std::make_unique<constant>(value::of(M_PI));
+      } else if (name == "huge") {
+        return std::make_unique<constant>(
+          value::of(std::numeric_limits<double>::infinity()));
+      }
+      auto it = math_functions.find(name);
+      if (it == math_functions.end()) {
+        throw compile_error(t, "uses \"math." + name + "\"");
+      }
+      auto call = std::make_unique<math_call>();
+      call->name = name;
+      expect("(");
+      if (!peek().is_op(")")) {
+        do {
+          call->args.push_back(parse_expression());
+        } while (accept(","));
+      }
+      expect(")");
+      int count = it->second;
+      if ((count > 0 && int(call->args.size()) != count) ||
+          call->args.empty()) {
+        throw compile_error(t, "wrong number of arguments to math." + name);
+      }
+      return call;
+    }
+
+    expression_ptr parse_aggregate(const std::string &name)
+    {
+      auto a = std::make_unique<aggregate>();
+      a->name = name;
+      expect("(");
+      a->array = parse_expression();
+      expect(",");
+      _scopes.emplace_back();
+      a->slot = declare("it");
+      a->body = parse_expression();
+      _scopes.pop_back();
+      expect(")");
+      return a;
+    }
+
+    expression_ptr parse_suffixes(expression_ptr &&e)
+    {
+      while (true) {
+        const token &t = peek();
+        if (accept(".")) {
+          e = std::make_unique<field>(std::move(e), expect_name());
+        } else if (accept("[")) {
+          expression_ptr key = parse_expression();
+          expect("]");
+          e = std::make_unique<index>(std::move(e), std::move(key));
+        } else if (t.is_op(":")) {
+          throw compile_error(t, "calls a method");
+        } else if (t.is_op("(") || t.is_op("{") || t.kind == token::string) {
+          throw compile_error(t, "calls a function");
+        } else {
+          return std::move(e);
+        }
+      }
+    }
+  };
+} // anonymous namespace
+
+struct predicate::program
+{
+  block body;
+  mutable context c;
+};
+
+predicate::predicate(std::unique_ptr<program> &&p) :
+  _program(std::move(p))
+{}
+
+predicate::~predicate()
+{}
+
+/**
+ * \brief Compiles a cut program.
+ *
+ * Returns nullptr and explains why in \c diagnostic if the program uses
+ * features that aren't supported.
+ */
+std::unique_ptr<predicate> predicate::compile(const std::string &code,
+                                              std::string &diagnostic)
+{
+  diagnostic.clear();
+  try {
+    std::vector<token> tokens = lua_tokenize(code);
+    parser p(tokens, false);
+    auto prog = std::make_unique<program>();
+    prog->body = p.parse_chunk();
+    prog->c.locals.resize(p.slot_count());
+    return std::unique_ptr<predicate>(new predicate(std::move(prog)));
+  } catch (const compile_error &e) {
+    diagnostic = e.what();
+    return nullptr;
+  }
+}
+
+/**
+ * \brief Compiles an expression.
+ *
+ * The predicate returns the value of the expression. Returns nullptr and
+ * explains why in \c diagnostic if the expression can't be compiled.
+ */
+std::unique_ptr<predicate> predicate::compile_expression(
+  const std::string &expression, std::string &diagnostic)
+{
+  diagnostic.clear();
+  try {
+    std::vector<token> tokens = lua_tokenize(expression);
+    parser p(tokens, true);
+    auto prog = std::make_unique<program>();
+    prog->body.push_back(
+      std::make_unique<return_statement>(p.parse_single_expression()));
+    prog->c.locals.resize(p.slot_count());
+    return std::unique_ptr<predicate>(new predicate(std::move(prog)));
+  } catch (const compile_error &e) {
+    diagnostic = e.what();
+    return nullptr;
+  }
+}
+
+/**
+ * \brief Translates an expression to a Lua chunk returning its value.
+ *
+ * The body of sum(), count(), all() and any() becomes a function of \c it:
+ * <tt>count(e.tracks, it.q > 0)</tt> is turned into
+ * <tt>count(e.tracks, function(it) return it.q > 0 end)</tt>. The Lua
+ * versions of the functions are defined by the \c aggregate module, which
+ * must be loaded before running the chunk.
+ */
+std::string predicate::lua_expression(const std::string &expression)
+{
+  std::vector<token> tokens = lua_tokenize(expression);
+
+  // Text to insert, by position in the expression
+  std::vector<std::pair<std::size_t, std::string>> insertions;
+  // Aggregate calls being read: depth of their parenthesis, and whether the
+  // body was reached
+  std::vector<std::pair<int, bool>> calls;
+  int depth = 0;
+  for (std::size_t i = 0; i + 1 < tokens.size(); ++i) {
+    const token &t = tokens[i];
+    bool in_call = !calls.empty() && calls.back().first == depth;
+    if (t.kind == token::name && is_aggregate(t.text) &&
+        tokens[i + 1].is_op("(") &&
+        (i == 0 || (!tokens[i - 1].is_op(".") && !tokens[i - 1].is_op(":")))) {
+      calls.emplace_back(depth + 1, false);
+    } else if (t.is_op("(") || t.is_op("[") || t.is_op("{")) {
+      ++depth;
+    } else if (t.is_op(")") || t.is_op("]") || t.is_op("}")) {
+      if (in_call && t.is_op(")")) {
+        if (calls.back().second) {
+          insertions.emplace_back(t.begin, " end");
+        }
+        calls.pop_back();
+      }
+      --depth;
+    } else if (in_call && t.is_op(",") && !calls.back().second) {
+      insertions.emplace_back(t.end, " function(it) return");
+      calls.back().second = true;
+    }
+  }
+
+  std::string code = "return ";
+  std::size_t pos = 0;
+  for (const auto &insertion : insertions) {
+    code.append(expression, pos, insertion.first - pos);
+    code += insertion.second;
+    pos = insertion.first;
+  }
+  code.append(expression, pos, std::string::npos);
+  return code;
+}
+
+bool predicate::operator()(const record &event) const
+{
+  context &c = _program->c;
+  c.event = &event;
+  c.result = value();
+  c.returned = false;
+  c.broken = false;
+  run(_program->body, c);
+  return c.result.kind != record::kind::boolean || c.result.number != 0;
+}
@@ -0,0 +1,54 @@
+#ifndef PREDICATE_H
+#define PREDICATE_H
+
+#include <memory>
+#include <string>
+
+#include "record.h"
+
+/**
+ * \brief Cut program evaluated without Lua
+ *
+ * Many cut programs only compare a few fields of the event. compile() turns
+ * programs written in a small subset of Lua into a tree of C++ nodes that is
+ * evaluated directly on records. The subset contains:
+ *
+ *  - numbers, booleans, strings and \c nil;
+ *  - the event \c e, its fields and elements (<tt>e.tracks[i].q</tt>);
+ *  - local variables, including aliases like <tt>local e = e</tt>;
+ *  - arithmetic, comparisons, \c and, \c or, \c not and the # operator;
+ *  - the functions of the \c math library that return one number;
+ *  - \c if statements, numeric \c for loops, <tt>for i, x in ipairs(...)</tt>
+ *    loops, \c break and \c return.
+ *
+ * Programs can't modify the event, define functions or call other functions.
+ * Expressions compiled with compile_expression() can also use the
+ * <tt>sum(array, x)</tt>, <tt>count(array, x)</tt>, <tt>all(array, x)</tt>
+ * and <tt>any(array, x)</tt> functions, where \c x is evaluated for every
+ * element of the array, available as \c it. lua_expression() translates
+ * them for Lua.
+ *
+ * Errors that Lua would raise at run time (like indexing \c nil) are reported
+ * by throwing std::runtime_error. A predicate isn't thread safe.
+ */
+class predicate
+{
+  struct program;
+  std::unique_ptr<program> _program;
+
+  explicit predicate(std::unique_ptr<program> &&p);
+
+public:
+  ~predicate();
+
+  static std::unique_ptr<predicate> compile(const std::string &code,
+                                            std::string &diagnostic);
+  static std::unique_ptr<predicate> compile_expression(
+    const std::string &expression, std::string &diagnostic);
+  static std::string lua_expression(const std::string &expression);
+
+  /// Returns false if the program returns false, and true otherwise
+  bool operator()(const record &event) const;
+};
+
+#endif // PREDICATE_H
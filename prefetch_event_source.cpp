@@ -0,0 +1,259 @@
+#include "prefetch_event_source.h"
+
+#include <algorithm>
+#include <stdexcept>
+
+/**
+ * \brief Wraps \c in, reading up to \c depth events ahead.
+ *
+ * If \c fill is false, the tables filled by the wrapped source are dropped
+ * and fill_rec() does nothing. Nothing is read until the source is used.
+ */
+prefetch_event_source::prefetch_event_source(event_source *in,
+                                             std::size_t depth,
+                                             bool fill) :
+  _in(in),
+  _ring(std::max<std::size_t>(depth, 1)),
+  _fill(fill)
+{}
+
+prefetch_event_source::~prefetch_event_source()
+{
+  stop();
+}
+
+bool prefetch_event_source::end()
+{
+  start();
+  if (_holding) {
+    return _ring[_head].end;
+  }
+  std::unique_lock<std::mutex> lock(_mutex);
+  _changed.wait(lock, [this]() { return _started; });
+  if (_done && _filled == 0) {
+    throw_error();
+  }
+  // Before the first read, or after reading past the end. Events may still
+  // be waiting in the ring after the background thread is done.
+  return _initial_end || (_done && _filled == 0);
+}
+
+bool prefetch_event_source::has_gen()
+{
+  return _holding ? _ring[_head].has_gen : true;
+}
+
+bool prefetch_event_source::has_rec()
+{
+  return _holding ? _ring[_head].has_rec : true;
+}
+
+/**
+ * \brief Prepares a Lua state for fill_rec().
+ *
+ * This is forwarded to the wrapped source, which must not change its own
+ * state.
+ */
+void prefetch_event_source::prepare(sol::state &lua)
+{
+  _in->prepare(lua);
+}
+
+void prefetch_event_source::read()
+{
+  start();
+  std::unique_lock<std::mutex> lock(_mutex);
+  if (_holding) {
+    // Give the slot back
+    _head = (_head + 1) % _ring.size();
+    --_filled;
+    _holding = false;
+    _changed.notify_all();
+  }
+  _changed.wait(lock, [this]() { return _filled > 0 || _done; });
+  if (_filled == 0) {
+    throw_error();
+    return;
+  }
+  _holding = true;
+  lock.unlock();
+
+  // Names and types are only defined in the first event using them: the
+  // definitions are registered for every event, even if fill_rec() isn't
+  // called.
+  if (_fill) {
+    _fill_in.clear();
+    _fill_in.str(_ring[_head].fill);
+    bool eof;
+    _fill_reader->read_raw(_fill_bytes, eof);
+  }
+}
+
+/**
+ * \brief Fills \c event with the contents of the table filled by the wrapped
+ *        source.
+ */
+void prefetch_event_source::fill_rec(sol::state &lua, sol::table &event)
+{
+  if (!_holding || !_fill) {
+    return;
+  }
+  sol::table filled = lua.create_table();
+  _fill_reader->decode(lua, filled, _fill_bytes.data(),
+                       _fill_bytes.data() + _fill_bytes.size());
+  filled.for_each([&event](const sol::object &key, const sol::object &value) {
+    event[key] = value;
+  });
+  sol::object metatable = filled[sol::metatable_key];
+  if (metatable.valid()) {
+    event[sol::metatable_key] = metatable;
+  }
+}
+
+const event &prefetch_event_source::rec()
+{
+  return _ring[_head].rec;
+}
+
+const event &prefetch_event_source::gen()
+{
+  const slot &s = _ring[_head];
+  return s.same ? s.rec : s.gen;
+}
+
+void prefetch_event_source::reset()
+{
+  stop();
+  _in->reset();
+}
+
+/*
+ * Throws the error that stopped the background thread, if any. Must be called
+ * with the mutex locked.
+ */
+void prefetch_event_source::throw_error()
+{
+  if (!_error.empty()) {
+    std::string error = _error;
+    _error.clear();
+    throw std::runtime_error(error);
+  }
+}
+
+/*
+ * Starts the background thread if it isn't running.
+ */
+void prefetch_event_source::start()
+{
+  if (_running) {
+    return;
+  }
+  _stop = false;
+  _started = false;
+  _done = false;
+  _head = 0;
+  _filled = 0;
+  _error.clear();
+  _holding = false;
+  // The serializer of the background thread starts from scratch
+  _fill_reader.reset(new unserializer(_fill_in));
+  _running = true;
+  _reader = std::thread([this]() { produce(); });
+}
+
+/*
+ * Stops the background thread. It finishes reading the current event first.
+ */
+void prefetch_event_source::stop()
+{
+  if (!_running) {
+    return;
+  }
+  {
+    std::lock_guard<std::mutex> lock(_mutex);
+    _stop = true;
+  }
+  _changed.notify_all();
+  _reader.join();
+  _running = false;
+}
+
+/*
+ * Body of the background thread. Reads events until the end of the wrapped
+ * source, an error, or stop() is called.
+ */
+void prefetch_event_source::produce()
+{
+  try {
+    sol::state lua;
+    lua.open_libraries(sol::lib::base,
+                       sol::lib::math,
+                       sol::lib::package,
+                       sol::lib::table);
+    std::string oldpath = lua["package"]["path"];
+    lua["package"]["path"] = oldpath + ";./lua/?.lua;../lua/?.lua";
+    _in->prepare(lua);
+
+    std::ostringstream out;
+    serializer ser(out);
+
+    bool end = _in->end();
+    {
+      std::lock_guard<std::mutex> lock(_mutex);
+      _initial_end = end;
+      _started = true;
+    }
+    _changed.notify_all();
+
+    while (!end) {
+      std::size_t index;
+      {
+        std::unique_lock<std::mutex> lock(_mutex);
+        _changed.wait(lock, [this]() {
+          return _stop || _filled < _ring.size();
+        });
+        if (_stop) {
+          return;
+        }
+        index = (_head + _filled) % _ring.size();
+      }
+
+      // The slot isn't used by the consumer
+      slot &s = _ring[index];
+      _in->read();
+      s.has_gen = _in->has_gen();
+      s.has_rec = _in->has_rec();
+      s.same = s.has_gen && s.has_rec && &_in->gen() == &_in->rec();
+      if (s.has_rec) {
+        s.rec = _in->rec();
+      }
+      if (s.has_gen && !s.same) {
+        s.gen = _in->gen();
+      }
+      if (_fill) {
+        sol::table t = lua.create_table();
+        _in->fill_rec(lua, t);
+        ser.write(t);
+        s.fill = out.str();
+        out.str("");
+      }
+      end = s.end = _in->end();
+
+      {
+        std::lock_guard<std::mutex> lock(_mutex);
+        ++_filled;
+      }
+      _changed.notify_all();
+    }
+  } catch (const std::exception &e) {
+    std::lock_guard<std::mutex> lock(_mutex);
+    _error = e.what();
+  }
+
+  {
+    std::lock_guard<std::mutex> lock(_mutex);
+    _started = true;
+    _done = true;
+  }
+  _changed.notify_all();
+}
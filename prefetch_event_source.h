@@ -0,0 +1,93 @@
+#ifndef PREFETCH_EVENT_SOURCE_H
+#define PREFETCH_EVENT_SOURCE_H
+
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "event.h"
+#include "event_source.h"
+#include "serializer.h"
+
+/**
+ * \brief Reads the events of another source in a background thread
+ *
+ * The wrapped source is only used by the background thread, which reads up
+ * to a given number of events ahead and copies them to a ring of slots. The
+ * events are then handed out in order with the usual interface, so parsing
+ * overlaps with whatever is done with the events.
+ *
+ * The table filled by fill_rec() is built in the background thread with its
+ * own Lua state, and serialized to be decoded in the state given to
+ * fill_rec(). This costs more than filling the table directly, so it can be
+ * turned off when the tables aren't used: fill_rec() then leaves them empty.
+ * Apart from prepare(), the wrapped source must not be used directly while it
+ * is wrapped.
+ *
+ * Errors thrown by the wrapped source are thrown again by read(), once the
+ * events read before are used.
+ */
+class prefetch_event_source : public event_source
+{
+  /// An event read by the background thread
+  struct slot
+  {
+    bool has_gen, has_rec;
+    bool same; ///< gen() and rec() were the same event
+    bool end; ///< Value of end() after reading the event
+    event gen, rec;
+    std::string fill; ///< Serialized table filled by fill_rec()
+  };
+
+  event_source *_in;
+  std::vector<slot> _ring;
+  bool _fill;
+
+  // Shared with the background thread
+  std::thread _reader;
+  std::mutex _mutex;
+  std::condition_variable _changed;
+  bool _running = false;
+  bool _stop = false;
+  bool _started = false; ///< _initial_end is set
+  bool _done = false; ///< No more events will be read
+  bool _initial_end = false;
+  std::size_t _head = 0, _filled = 0;
+  std::string _error;
+
+  // Used by the consumer
+  bool _holding = false; ///< The slot at _head is in use
+  std::istringstream _fill_in;
+  std::unique_ptr<unserializer> _fill_reader;
+  std::string _fill_bytes; ///< Table of the held slot, without definitions
+
+  prefetch_event_source(const prefetch_event_source &) = delete;
+  prefetch_event_source &operator=(const prefetch_event_source &) = delete;
+
+public:
+  explicit prefetch_event_source(event_source *in, std::size_t depth = 64,
+                                 bool fill = true);
+  ~prefetch_event_source();
+
+  bool end();
+  bool has_gen();
+  bool has_rec();
+  void prepare(sol::state &lua);
+  void read();
+  void fill_rec(sol::state &lua, sol::table &event);
+  const event &rec();
+  const event &gen();
+  void reset();
+
+private:
+  void start();
+  void stop();
+  void produce();
+  void throw_error();
+};
+
+#endif // PREFETCH_EVENT_SOURCE_H
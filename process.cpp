@@ -1,28 +1,132 @@
 
+#include <fstream>
 #include <iostream>
+#include <iterator>
+#include <memory>
+#include <stdexcept>
 
+#include "predicate.h"
 #include "serializer.h"
 
+namespace // anonymous
+{
+  /*
+   * Runs a compiled predicate on every event, without Lua.
+   */
+  int run_native(const predicate &cut, const field_set &fields, bool negate)
+  {
+    unserializer uns(std::cin);
+    uns.select(fields);
+    serializer ser(std::cout);
+    bool eof = false;
+    while (std::cin && std::cout) {
+      record e;
+      uns.read(e, eof);
+      if (eof) {
+        break;
+      }
+      try {
+        if (cut(e) == !negate) {
+          ser.write(e);
+        }
+      } catch (const std::runtime_error &error) {
+        std::cerr << "ERROR: " << error.what() << std::endl;
+        return 3;
+      }
+    }
+
+    if (uns.skipped_bytes() > 0) {
+      std::cerr << "[INFO] Skipped " << uns.skipped_bytes() << " bytes"
+                << std::endl;
+    }
+
+    return 0;
+  }
+} // anonymous namespace
+
 /*
  * Reads events from standard input, runs the program specified on the command
  * line and prints them to standard output.
+ *
+ * When a list of fields is given with -f, the other fields are skipped when
+ * reading events. They are then missing from the output, so the list must
+ * include the fields used by later steps.
+ *
+ * Instead of a file, the program can be given as an expression with --expr.
+ * Programs and expressions that only use a simple subset of Lua (see
+ * predicate) are evaluated without Lua. --lua disables this.
  */
 int main(int argc, char **argv)
 {
-  // Read the program file name from the command line.
-  if (argc != 2 && argc != 3) {
-    std::cout << "Usage: " << argv[0] << " [not] program.lua" << std::endl;
+  // Read options
+  field_set fields = field_set::everything();
+  bool force_lua = false;
+  while (argc > 2 && argv[1][0] == '-') {
+    std::string option = argv[1];
+    int used = 1;
+    if (option == "-f") {
+      // List of fields to decode
+      std::ifstream in(argv[2]);
+      if (!in) {
+        std::cerr << "ERROR: Could not open " << argv[2] << std::endl;
+        return 1;
+      }
+      fields = field_set::read(in);
+      used = 2;
+    } else if (option == "--lua") {
+      // Always use Lua
+      force_lua = true;
+    } else {
+      break;
+    }
+    // Remove the option
+    argv[used] = argv[0];
+    argv += used;
+    argc -= used;
+  }
+
+  // Read the program from the command line.
+  bool expression = (argc > 2 && std::string(argv[argc - 2]) == "--expr");
+  int expected = expression ? 3 : 2;
+  if (argc != expected && argc != expected + 1) {
+    std::cout << "Usage: " << argv[0]
+              << " [-f fields.txt] [--lua] [not]"
+              << " (program.lua | --expr expression)" << std::endl;
     return 1;
   }
   bool negate = false;
-  if (argc == 3 && std::string(argv[1]) == "not") {
+  if (argc == expected + 1 && std::string(argv[1]) == "not") {
     negate = true;
-  } else if (argc == 3) {
+  } else if (argc == expected + 1) {
     // Argument 1 isn't "not"
-    std::cout << "Usage: " << argv[0] << " [not] program.lua" << std::endl;
+    std::cout << "Usage: " << argv[0]
+              << " [-f fields.txt] [--lua] [not]"
+              << " (program.lua | --expr expression)" << std::endl;
     return 1;
   }
-  std::string filename = argv[argc - 1];
+  std::string code = argv[argc - 1];
+  if (!expression) {
+    std::ifstream in(code);
+    if (!in) {
+      std::cerr << "ERROR: Could not open " << code << std::endl;
+      return 2;
+    }
+    code.assign(std::istreambuf_iterator<char>(in),
+                std::istreambuf_iterator<char>());
+  }
+
+  // Try to do without Lua
+  if (!force_lua) {
+    std::string diagnostic;
+    std::unique_ptr<predicate> cut =
+      expression ? predicate::compile_expression(code, diagnostic)
+                 : predicate::compile(code, diagnostic);
+    if (cut) {
+      std::cerr << "[INFO] Running the program without Lua" << std::endl;
+      return run_native(*cut, fields, negate);
+    }
+    std::cerr << "[INFO] Using Lua: " << diagnostic << std::endl;
+  }
 
   // Setup lua
   sol::state lua;
@@ -35,8 +139,13 @@ int main(int argc, char **argv)
   std::string oldpath = lua["package"]["path"];
   lua["package"]["path"] = oldpath + ";./lua/?.lua;../lua/?.lua";
 
-  // Load the program
-  sol::load_result lr = lua.load_file(filename);
+  // Load the program. Expressions can use the aggregates.
+  if (expression) {
+    lua.script("require \"aggregate\"");
+  }
+  sol::load_result lr =
+    expression ? lua.load(predicate::lua_expression(code))
+               : lua.load_file(argv[argc - 1]);
   if (!lr.valid()) {
     std::cerr << "ERROR: Could not load script: "
               << lr.get<std::string>() << std::endl;
@@ -46,6 +155,7 @@ int main(int argc, char **argv)
 
   // Read one event at a time and print them all
   unserializer uns(std::cin);
+  uns.select(fields);
   serializer ser(std::cout);
   auto lua_e = lua["e"];
   bool eof = false;
@@ -61,7 +171,8 @@ int main(int argc, char **argv)
       sol::object val = result.get<sol::object>();
       bool passed = (val.get_type() != sol::type::boolean || val.as<bool>());
       if (passed == !negate) {
-        ser.write(lua_e);
+        sol::table out = lua_e;
+        ser.write(out);
       }
     } else {
       std::cerr << "ERROR: " << result.get<sol::error>().what() << std::endl;
@@ -69,5 +180,10 @@ int main(int argc, char **argv)
     }
   }
 
+  if (uns.skipped_bytes() > 0) {
+    std::cerr << "[INFO] Skipped " << uns.skipped_bytes() << " bytes"
+              << std::endl;
+  }
+
   return 0;
 }
@@ -1,46 +1,357 @@
 
+#include <algorithm>
+#include <condition_variable>
+#include <cstdlib>
+#include <fstream>
 #include <iostream>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+
+#include <TROOT.h>
 
 #include "parsers.h"
+#include "record.h"
 #include "serializer.h"
 
+namespace // anonymous
+{
+  /// Largest number of entries in a range read by a worker
+  const long MAX_RANGE_ENTRIES = 10000;
+
+  /// How the files are read
+  struct options
+  {
+    field_set fields = field_set::everything();
+    std::string mapping; ///< Name of the mapping file
+    std::string mapping_text; ///< Contents of the mapping file
+    long long cache_size = -1;
+    int read_ahead = 0;
+  };
+
+  /// Entries of a file read by a worker
+  struct range
+  {
+    std::size_t file;
+    long first, last;
+  };
+
+  /// Events read from a range
+  struct chunk
+  {
+    bool done = false;
+    std::vector<record> events;
+    std::string error;
+  };
+
+  /*
+   * Opens a ROOT file with the parser selected by the options. Statistics
+   * about the selected branches are only printed if quiet is false.
+   */
+  std::unique_ptr<tree_source> open(const std::string &filename,
+                                    const options &opt, bool quiet)
+  {
+    std::unique_ptr<tree_source> source;
+    if (opt.mapping.empty()) {
+      std::unique_ptr<hlt_parser> parser(new hlt_parser(filename));
+      parser->set_read_ahead(opt.read_ahead);
+      source = std::move(parser);
+    } else {
+      std::istringstream in(opt.mapping_text);
+      source.reset(new mapped_parser(filename, in));
+    }
+    if (!opt.fields.all()) {
+      source->select(opt.fields, quiet);
+    }
+    if (opt.cache_size >= 0) {
+      source->set_cache_size(opt.cache_size);
+    }
+    return source;
+  }
+
+  /*
+   * Names the input in error messages: the file, followed by the mapping
+   * file if the built-in HLT parser isn't used.
+   */
+  std::string describe(const std::string &filename, const options &opt)
+  {
+    return opt.mapping.empty() ? filename
+                               : filename + " (" + opt.mapping + ")";
+  }
+
+  /*
+   * Loads the libraries that parsers can use to fill events.
+   */
+  void setup_lua(sol::state &lua)
+  {
+    // We'll maybe need these libraries
+    lua.open_libraries(sol::lib::base,
+                       sol::lib::math,
+                       sol::lib::package,
+                       sol::lib::table);
+    // Change the lua path to include ./lua and ../lua
+    std::string oldpath = lua["package"]["path"];
+    lua["package"]["path"] = oldpath + ";./lua/?.lua;../lua/?.lua";
+  }
+
+  /*
+   * Reads the files one after the other in the current thread.
+   */
+  int read_sequential(const std::vector<std::string> &filenames,
+                      const options &opt)
+  {
+    sol::state lua;
+    setup_lua(lua);
+    serializer ser(std::cout);
+
+    for (const std::string &filename : filenames) {
+      std::unique_ptr<tree_source> source;
+      try {
+        source = open(filename, opt, false);
+        // The parser might want to load additionnal libraries
+        source->prepare(lua);
+      } catch (const std::runtime_error &e) {
+        std::cerr << "ERROR: " << describe(filename, opt) << ": "
+                  << e.what() << std::endl;
+        return 2;
+      }
+      event_source &in = *source;
+
+      // Read one event at a time and print them all
+      try {
+        while (std::cout && !in.end()) {
+          sol::table e = lua.create_table();
+          in.read();
+          if (in.has_rec()) {
+            in.fill_rec(lua, e);
+            ser.write(e);
+          }
+        }
+      } catch (const std::runtime_error &e) {
+        std::cerr << "ERROR: " << filename << ": " << e.what() << std::endl;
+        return 3;
+      }
+    }
+    return 0;
+  }
+
+  /*
+   * Reads ranges of entries in worker threads and writes their events in the
+   * order of the ranges.
+   *
+   * Every worker has its own parsers and Lua state. Workers only fill the
+   * events and copy them to records; they are all written by this thread,
+   * with a single serializer, so that names and types get the same ids as if
+   * the files were read sequentially. Workers don't start a range more than
+   * 2 * workers ranges ahead of the one being written, which bounds the
+   * memory used by pending events.
+   */
+  int read_parallel(const std::vector<std::string> &filenames,
+                    const options &opt, int workers)
+  {
+    // Split the files in ranges
+    std::vector<range> ranges;
+    for (std::size_t f = 0; f < filenames.size(); ++f) {
+      long entries;
+      try {
+        // Prints the selection statistics once per file
+        entries = open(filenames[f], opt, false)->entries();
+      } catch (const std::runtime_error &e) {
+        std::cerr << "ERROR: " << describe(filenames[f], opt) << ": "
+                  << e.what() << std::endl;
+        return 2;
+      }
+      long size = (entries + 4 * workers - 1) / (4 * workers);
+      size = std::max(1L, std::min(size, MAX_RANGE_ENTRIES));
+      for (long first = 0; first < entries; first += size) {
+        ranges.push_back({ f, first, std::min(first + size, entries) });
+      }
+    }
+
+    std::vector<chunk> chunks(ranges.size());
+    std::mutex mutex;
+    std::condition_variable changed;
+    std::size_t next = 0, written = 0;
+    bool stop = false;
+    const std::size_t max_pending = 2 * workers;
+
+    auto work = [&]() {
+      sol::state lua;
+      setup_lua(lua);
+      std::unique_ptr<tree_source> source;
+      std::size_t file = filenames.size();
+
+      while (true) {
+        std::size_t index;
+        {
+          std::unique_lock<std::mutex> lock(mutex);
+          changed.wait(lock, [&]() {
+            return stop || next >= ranges.size() ||
+                   next < written + max_pending;
+          });
+          if (stop || next >= ranges.size()) {
+            return;
+          }
+          index = next++;
+        }
+
+        const range &r = ranges[index];
+        std::vector<record> events;
+        std::string error;
+        try {
+          if (file != r.file) {
+            source = open(filenames[r.file], opt, true);
+            source->prepare(lua);
+            file = r.file;
+          }
+          source->set_range(r.first, r.last);
+          while (!source->end()) {
+            sol::table e = lua.create_table();
+            source->read();
+            if (source->has_rec()) {
+              source->fill_rec(lua, e);
+              events.push_back(to_record(e));
+            }
+          }
+        } catch (const std::runtime_error &e) {
+          error = describe(filenames[r.file], opt) + ": " + e.what();
+        }
+
+        {
+          std::lock_guard<std::mutex> lock(mutex);
+          chunks[index].events = std::move(events);
+          chunks[index].error = error;
+          chunks[index].done = true;
+        }
+        changed.notify_all();
+      }
+    };
+
+    std::vector<std::thread> threads;
+    for (int i = 0; i < workers; ++i) {
+      threads.emplace_back(work);
+    }
+
+    int status = 0;
+    serializer ser(std::cout);
+    for (std::size_t index = 0; index < chunks.size(); ++index) {
+      std::vector<record> events;
+      {
+        std::unique_lock<std::mutex> lock(mutex);
+        changed.wait(lock, [&]() { return chunks[index].done; });
+        if (!chunks[index].error.empty()) {
+          std::cerr << "ERROR: " << chunks[index].error << std::endl;
+          status = 3;
+          break;
+        }
+        events = std::move(chunks[index].events);
+      }
+      for (const record &e : events) {
+        ser.write(e);
+      }
+      if (!std::cout) {
+        break;
+      }
+      {
+        std::lock_guard<std::mutex> lock(mutex);
+        ++written;
+      }
+      changed.notify_all();
+    }
+
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      stop = true;
+    }
+    changed.notify_all();
+    for (std::thread &t : threads) {
+      t.join();
+    }
+    return status;
+  }
+} // anonymous namespace
+
 /*
- * Reads events from a ROOT file and prints them in serialized form to standard
- * output.
+ * Reads events from ROOT files and prints them in serialized form to standard
+ * output. When a list of fields is given with -f, only the corresponding
+ * branches are read.
+ *
+ * The layout of the files is given by a mapping file passed with -m (see
+ * mapped_parser). Without it, the layout of the HLT ntuples is used.
+ *
+ * -c sets the size of the ROOT tree cache in megabytes (0 disables it), and
+ * -a reads the given number of entries ahead in a background thread.
+ *
+ * -j reads the files with several worker threads, each of them handling
+ * ranges of entries. The events are written in the same order as without it.
  */
 int main(int argc, char **argv)
 {
-  // Read the file name from the command line.
-  if (argc != 2) {
-    std::cout << "Usage: " << argv[0] << " file.root" << std::endl;
+  // Read options
+  options opt;
+  int workers = 1;
+  while (argc > 3 && argv[1][0] == '-') {
+    std::string option = argv[1];
+    if (option == "-f") {
+      // List of fields to read
+      std::ifstream in(argv[2]);
+      if (!in) {
+        std::cerr << "ERROR: Could not open " << argv[2] << std::endl;
+        return 1;
+      }
+      opt.fields = field_set::read(in);
+    } else if (option == "-m") {
+      // Mapping file
+      opt.mapping = argv[2];
+    } else if (option == "-c") {
+      // Cache size in megabytes
+      opt.cache_size = std::atof(argv[2]) * 1024 * 1024;
+    } else if (option == "-a") {
+      // Entries to read ahead
+      opt.read_ahead = std::atoi(argv[2]);
+    } else if (option == "-j") {
+      // Worker threads
+      workers = std::max(std::atoi(argv[2]), 1);
+    } else {
+      break;
+    }
+    // Remove the option
+    argv[2] = argv[0];
+    argv += 2;
+    argc -= 2;
+  }
+
+  // Read the file names from the command line.
+  if (argc < 2) {
+    std::cout << "Usage: " << argv[0]
+              << " [-f fields.txt] [-m mapping.txt] [-c megabytes]"
+              << " [-a entries] [-j workers] file.root..." << std::endl;
     return 1;
   }
-  std::string filename = argv[1];
-  hlt_parser in(filename);
-
-  // Setup lua
-  sol::state lua;
-  // We'll maybe need these libraries
-  lua.open_libraries(sol::lib::base,
-                     sol::lib::math,
-                     sol::lib::package,
-                     sol::lib::table);
-  // Change the lua path to include ./lua and ../lua
-  std::string oldpath = lua["package"]["path"];
-  lua["package"]["path"] = oldpath + ";./lua/?.lua;../lua/?.lua";
-  // The parser might want to load additionnal libraries
-  in.prepare(lua);
-
-  // Read one event at a time and print them all
-  serializer ser(std::cout);
-  while (std::cout && !in.end()) {
-    sol::table e = lua.create_table();
-    in.read();
-    if (in.has_rec()) {
-      in.fill_rec(lua, e);
-      ser.write(e);
-    }
-  }
-
-  return 0;
+  std::vector<std::string> filenames(argv + 1, argv + argc);
+
+  if (!opt.mapping.empty()) {
+    std::ifstream in(opt.mapping);
+    if (!in) {
+      std::cerr << "ERROR: Could not open " << opt.mapping << std::endl;
+      return 1;
+    }
+    std::ostringstream text;
+    text << in.rdbuf();
+    opt.mapping_text = text.str();
+    if (opt.read_ahead > 0) {
+      std::cerr << "[WARN] -a is ignored with -m" << std::endl;
+    }
+  }
+
+  if (workers == 1) {
+    return read_sequential(filenames, opt);
+  } else {
+    // Every worker opens its own files
+    ROOT::EnableThreadSafety();
+    return read_parallel(filenames, opt, workers);
+  }
 }
@@ -0,0 +1,423 @@
+
+#include <algorithm>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <mutex>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "lorentz.h"
+#include "record.h"
+#include "serializer.h"
+
+#define MASS 0.13957018 // pion
+
+namespace // anonymous
+{
+  /// Approximate size of the blocks of text parsed by the workers
+  const std::size_t BLOCK_SIZE = 4 << 20;
+
+  /*
+   * Reads the whitespace-separated tokens of a block of text. Errors are
+   * reported by throwing std::runtime_error with the offset in the file.
+   */
+  class scanner
+  {
+    const char *_file, *_p, *_end;
+
+  public:
+    scanner(const char *file, const char *begin, const char *end) :
+      _file(file), _p(begin), _end(end) {}
+
+    /// Returns true when only whitespace is left
+    bool at_end()
+    {
+      skip_space();
+      return _p == _end;
+    }
+
+    /// Reads a token and checks that it is the given word
+    void expect(const char *word)
+    {
+      skip_space();
+      std::size_t length = std::strlen(word);
+      if (std::size_t(_end - _p) < length ||
+          std::memcmp(_p, word, length) != 0) {
+        fail(std::string(word) + " expected");
+      }
+      _p += length;
+    }
+
+    long read_integer();
+    double read_double();
+
+    /// Skips the rest of the line
+    void skip_line()
+    {
+      const char *eol = (const char *) std::memchr(_p, '\n', _end - _p);
+      _p = eol == nullptr ? _end : eol + 1;
+    }
+
+  private:
+    void skip_space()
+    {
+      while (_p != _end && (*_p == ' ' || *_p == '\t' || *_p == '\n' ||
+                            *_p == '\r')) {
+        ++_p;
+      }
+    }
+
+    [[noreturn]] void fail(const std::string &what) const
+    {
+      throw std::runtime_error("byte " + std::to_string(_p - _file) + ": " +
+                               what);
+    }
+  };
+
+  long scanner::read_integer()
+  {
+    skip_space();
+    bool negative = false;
+    if (_p != _end && (*_p == '-' || *_p == '+')) {
+      negative = *_p == '-';
+      ++_p;
+    }
+    if (_p == _end || *_p < '0' || *_p > '9') {
+      fail("integer expected");
+    }
+    long value = 0;
+    while (_p != _end && *_p >= '0' && *_p <= '9') {
+      value = 10 * value + (*_p - '0');
+      ++_p;
+    }
+    return negative ? -value : value;
+  }
+
+  /*
+   * Parses a decimal number. When the digits fit in a double and the power of
+   * ten is small, both are exact and the result is rounded only once, which
+   * gives the same value as strtod. Other numbers are passed to strtod.
+   */
+  double scanner::read_double()
+  {
+    static const double powers[] = {
+      1e0,  1e1,  1e2,  1e3,  1e4,  1e5,  1e6,  1e7,  1e8,  1e9,  1e10, 1e11,
+      1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+    };
+
+    skip_space();
+    const char *start = _p;
+    bool negative = false;
+    if (_p != _end && (*_p == '-' || *_p == '+')) {
+      negative = *_p == '-';
+      ++_p;
+    }
+
+    std::uint64_t mantissa = 0;
+    int digits = 0, significant = 0, exponent = 0;
+    bool exact = true;
+    auto add_digit = [&](int d) {
+      ++digits;
+      if (significant == 0 && d == 0) {
+        return; // Leading zero
+      } else if (significant < 19) {
+        mantissa = 10 * mantissa + d;
+        ++significant;
+      } else {
+        exact = false;
+      }
+    };
+    while (_p != _end && *_p >= '0' && *_p <= '9') {
+      add_digit(*_p++ - '0');
+    }
+    if (_p != _end && *_p == '.') {
+      ++_p;
+      while (_p != _end && *_p >= '0' && *_p <= '9') {
+        add_digit(*_p++ - '0');
+        --exponent;
+      }
+    }
+    if (digits == 0) {
+      _p = start;
+      fail("number expected");
+    }
+    if (_p != _end && (*_p == 'e' || *_p == 'E')) {
+      ++_p;
+      exponent += read_integer();
+    }
+
+    if (exact && mantissa <= (std::uint64_t(1) << 53) &&
+        exponent >= -22 && exponent <= 22) {
+      double value = mantissa;
+      value = exponent < 0 ? value / powers[-exponent]
+                           : value * powers[exponent];
+      return negative ? -value : value;
+    }
+    // The file isn't null-terminated
+    return std::strtod(std::string(start, _p).c_str(), nullptr);
+  }
+
+  /*
+   * Creates the record of a 4-vector, like vec.new() in lorentz.lua.
+   */
+  record make_vec(const lorentz::vec &v)
+  {
+    record r = record::table();
+    r.set_type("vec", "lorentz");
+    r.add("t", record(v.t()));
+    r.add("x", record(v.x()));
+    r.add("y", record(v.y()));
+    r.add("z", record(v.z()));
+    return r;
+  }
+
+  /*
+   * Creates the record of a track.
+   */
+  record make_track(const lorentz::vec &p, long pdgid, long gpid)
+  {
+    record r = record::table();
+    r.add("p", make_vec(p));
+    r.add("pdgid", record(double(pdgid)));
+    r.add("gpid", record(double(gpid)));
+    return r;
+  }
+
+  /*
+   * Returns an event using all names and types written by this tool.
+   */
+  record prototype()
+  {
+    record tracks = record::table();
+    tracks.add(1, make_track(lorentz::vec(), 0, 0));
+    tracks.add("n", record(1.));
+    record event = record::table();
+    event.add("id", record(0.));
+    event.add("tracks", tracks);
+    return event;
+  }
+
+  /*
+   * Parses the events of a block and serializes them.
+   */
+  void parse_block(scanner &in, serializer &ser)
+  {
+    while (!in.at_end()) {
+      in.expect("EVENT:");
+      long id = in.read_integer();
+      long ntracks = in.read_integer();
+      in.read_integer(); // vertex count
+
+      in.expect("VERTEX:");
+      in.read_double(); // x
+      in.read_double(); // y
+      in.read_double(); // z
+      in.read_double(); // t
+      in.read_integer(); // vertex number
+      in.read_integer(); // physical process
+      in.read_integer(); // parent track
+      in.read_integer(); // daughter track count
+
+      record tracks = record::table();
+      for (long i = 0; i < ntracks; ++i) {
+        in.expect("TRACK:");
+        long gpid = in.read_integer();
+        double px = in.read_double();
+        double py = in.read_double();
+        double pz = in.read_double();
+        in.read_integer(); // event number
+        in.read_integer(); // starting vertex
+        in.read_integer(); // ending vertex
+        long pdgid = in.read_integer();
+        // PYTHIA fields
+        in.skip_line();
+
+        tracks.add(i + 1, make_track(lorentz::vec::mxyz(MASS, px, py, pz),
+                                     pdgid, gpid));
+      }
+      tracks.add("n", record(double(ntracks)));
+
+      record event = record::table();
+      event.add("id", record(double(id)));
+      event.add("tracks", tracks);
+      ser.write(event);
+    }
+  }
+
+  /*
+   * Splits the text in blocks starting with "EVENT:", of about BLOCK_SIZE
+   * bytes. Returns the offsets of the blocks followed by the size.
+   */
+  std::vector<std::size_t> split(const char *text, std::size_t size)
+  {
+    const char marker[] = "\nEVENT:";
+    std::vector<std::size_t> bounds = { 0 };
+    std::size_t pos = BLOCK_SIZE;
+    while (pos < size) {
+      const char *found = (const char *) memmem(text + pos, size - pos,
+                                                marker, sizeof(marker) - 1);
+      if (found == nullptr) {
+        break;
+      }
+      bounds.push_back(found + 1 - text);
+      pos = bounds.back() + BLOCK_SIZE;
+    }
+    bounds.push_back(size);
+    return bounds;
+  }
+} // anonymous namespace
+
+/*
+ * Reads a Starlight output file and prints its events in serialized form to
+ * standard output. Events have an id and an array of tracks with their
+ * 4-momentum p (assuming the pion mass), pdgid and gpid, and the number of
+ * tracks n.
+ *
+ * The file is mapped in memory and parsed in blocks by several threads (one
+ * per core, or the number given with -j). Every block is serialized by a
+ * worker after declaring all names and types, so that the blocks can be
+ * written one after the other.
+ */
+int main(int argc, char **argv)
+{
+  int workers = std::max(1u, std::thread::hardware_concurrency());
+  if (argc == 4 && std::string(argv[1]) == "-j") {
+    workers = std::max(std::atoi(argv[2]), 1);
+    argv[2] = argv[0];
+    argv += 2;
+    argc -= 2;
+  }
+  if (argc != 2) {
+    std::cout << "Usage: " << argv[0] << " [-j workers] file.txt" << std::endl;
+    return 1;
+  }
+
+  // Map the file
+  int fd = open(argv[1], O_RDONLY);
+  struct stat info;
+  if (fd < 0 || fstat(fd, &info) != 0) {
+    std::cerr << "ERROR: Could not open " << argv[1] << std::endl;
+    return 1;
+  }
+  std::size_t size = info.st_size;
+  const char *text = "";
+  if (size > 0) {
+    void *map = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (map == MAP_FAILED) {
+      std::cerr << "ERROR: Could not map " << argv[1] << std::endl;
+      return 2;
+    }
+    madvise(map, size, MADV_SEQUENTIAL);
+    text = (const char *) map;
+  }
+  close(fd);
+
+  const std::vector<std::size_t> bounds = split(text, size);
+  const std::size_t blocks = bounds.size() - 1;
+  const record proto = prototype();
+
+  // Workers parse blocks ahead of the one being written, but not too far
+  struct result
+  {
+    bool done = false;
+    std::string data, error;
+  };
+  std::vector<result> results(blocks);
+  std::mutex mutex;
+  std::condition_variable changed;
+  std::size_t next = 0, written = 0;
+  bool stop = false;
+  const std::size_t max_pending = 2 * workers;
+
+  auto work = [&]() {
+    while (true) {
+      std::size_t index;
+      {
+        std::unique_lock<std::mutex> lock(mutex);
+        changed.wait(lock, [&]() {
+          return stop || next >= blocks || next < written + max_pending;
+        });
+        if (stop || next >= blocks) {
+          return;
+        }
+        index = next++;
+      }
+
+      std::ostringstream out;
+      std::string error;
+      try {
+        serializer ser(out);
+        ser.declare(proto);
+        out.str("");
+        scanner in(text, text + bounds[index], text + bounds[index + 1]);
+        parse_block(in, ser);
+      } catch (const std::runtime_error &e) {
+        error = e.what();
+      }
+
+      {
+        std::lock_guard<std::mutex> lock(mutex);
+        results[index].data = out.str();
+        results[index].error = error;
+        results[index].done = true;
+      }
+      changed.notify_all();
+    }
+  };
+
+  std::vector<std::thread> threads;
+  for (int i = 0; i < workers; ++i) {
+    threads.emplace_back(work);
+  }
+
+  int status = 0;
+  serializer ser(std::cout);
+  ser.declare(proto);
+  for (std::size_t index = 0; index < blocks; ++index) {
+    std::string data;
+    {
+      std::unique_lock<std::mutex> lock(mutex);
+      changed.wait(lock, [&]() { return results[index].done; });
+      if (!results[index].error.empty()) {
+        std::cerr << "ERROR: " << argv[1] << ": " << results[index].error
+                  << std::endl;
+        status = 3;
+        break;
+      }
+      data.swap(results[index].data);
+    }
+    std::cout.write(data.data(), data.size());
+    if (!std::cout) {
+      break;
+    }
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      ++written;
+    }
+    changed.notify_all();
+  }
+
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    stop = true;
+  }
+  changed.notify_all();
+  for (std::thread &t : threads) {
+    t.join();
+  }
+  if (size > 0) {
+    munmap((void *) text, size);
+  }
+  return status;
+}
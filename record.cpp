@@ -0,0 +1,80 @@
+#include "record.h"
+
+record record::table()
+{
+  record r;
+  r._kind = kind::table;
+  return r;
+}
+
+/**
+ * \brief Returns the field called \c name, or nullptr if there is none.
+ */
+const record *record::get(const std::string &name) const
+{
+  for (const named_field &field : _named) {
+    if (field.first == name) {
+      return &field.second;
+    }
+  }
+  return nullptr;
+}
+
+/**
+ * \brief Returns the array element at \c index, or nullptr if there is none.
+ */
+const record *record::get(double index) const
+{
+  // Arrays are usually written in order, starting from 1
+  if (index >= 1 && index - 1 < _array.size()) {
+    std::size_t guess = index - 1;
+    if (_array[guess].first == index) {
+      return &_array[guess].second;
+    }
+  }
+  for (const array_field &field : _array) {
+    if (field.first == index) {
+      return &field.second;
+    }
+  }
+  return nullptr;
+}
+
+/**
+ * \brief Adds a named field, without checking if it exists already.
+ */
+record &record::add(const std::string &name, record value)
+{
+  _named.emplace_back(name, std::move(value));
+  return _named.back().second;
+}
+
+/**
+ * \brief Adds an array element, without checking if it exists already.
+ */
+record &record::add(double index, record value)
+{
+  _array.emplace_back(index, std::move(value));
+  return _array.back().second;
+}
+
+/**
+ * \brief Sets a named field, replacing the existing value if any.
+ */
+record &record::set(const std::string &name, record value)
+{
+  for (named_field &field : _named) {
+    if (field.first == name) {
+      field.second = std::move(value);
+      return field.second;
+    }
+  }
+  return add(name, std::move(value));
+}
+
+void record::set_type(const std::string &class_name,
+                      const std::string &module_name)
+{
+  _class_name = class_name;
+  _module_name = module_name;
+}
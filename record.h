@@ -0,0 +1,66 @@
+#ifndef RECORD_H
+#define RECORD_H
+
+#include <string>
+#include <utility>
+#include <vector>
+
+/**
+ * \brief Native copy of a value of the event stream
+ *
+ * A record holds the same data as the Lua values written by the serializer:
+ * booleans, numbers, strings and tables. Tables keep named and array fields
+ * apart, in the order they were added, and may have a type (the class and
+ * module names of their metatable). Records can be read and written without a
+ * Lua state, which is useful for tools that don't need to run Lua code.
+ */
+class record
+{
+public:
+  enum class kind { nil, boolean, number, string, table };
+
+  typedef std::pair<std::string, record> named_field;
+  typedef std::pair<double, record> array_field;
+
+private:
+  kind _kind = kind::nil;
+  double _number = 0;
+  std::string _string;
+  std::vector<named_field> _named;
+  std::vector<array_field> _array;
+  std::string _class_name, _module_name;
+
+public:
+  record() = default;
+  explicit record(bool value) : _kind(kind::boolean), _number(value) {}
+  explicit record(double value) : _kind(kind::number), _number(value) {}
+  explicit record(const std::string &value) :
+    _kind(kind::string), _string(value) {}
+
+  /// Creates an empty table
+  static record table();
+
+  kind type() const { return _kind; }
+  bool is_nil() const { return _kind == kind::nil; }
+  bool is_table() const { return _kind == kind::table; }
+
+  bool as_boolean() const { return _number != 0; }
+  double as_number() const { return _number; }
+  const std::string &as_string() const { return _string; }
+
+  const record *get(const std::string &name) const;
+  const record *get(double index) const;
+  record &add(const std::string &name, record value);
+  record &add(double index, record value);
+  record &set(const std::string &name, record value);
+
+  const std::vector<named_field> &named() const { return _named; }
+  const std::vector<array_field> &array() const { return _array; }
+
+  bool has_type() const { return !_class_name.empty(); }
+  const std::string &class_name() const { return _class_name; }
+  const std::string &module_name() const { return _module_name; }
+  void set_type(const std::string &class_name, const std::string &module_name);
+};
+
+#endif // RECORD_H
@@ -1,10 +1,21 @@
 #include "run.h"
 
+#include <algorithm>
+#include <bitset>
+#include <chrono>
+#include <condition_variable>
+#include <exception>
 #include <iostream>
+#include <limits>
+#include <mutex>
+#include <stdexcept>
+#include <thread>
 
 run::run() :
+  _stats(std::make_shared<std::map<const void *, cut_stats>>()),
   _lua(std::make_shared<sol::state>()),
-  _out(std::cout)
+  _out(std::cout),
+  _cache(std::make_shared<cache>())
 {
   _lua->open_libraries(sol::lib::base,
                        sol::lib::math,
@@ -14,18 +25,16 @@ run::run() :
   (*_lua)["package"]["path"] = oldpath + ";./lua/?.lua;../lua/?.lua";
 }
 
-void run::add(const std::shared_ptr<cut> &c)
+void run::add(const std::shared_ptr<cut> &c, bool enabled)
 {
-  _cuts.push_back(c);
+  _cut_order.push_back(std::make_pair(false, _cuts.size()));
+  _cuts.push_back(cut_entry{c, enabled});
 }
 
-void run::add(const std::shared_ptr<lua_cut> &c)
+void run::add(const std::shared_ptr<lua_cut> &c, bool enabled)
 {
-  sol::load_result result = c->load_into(*_lua);
-  if (!result.valid()) {
-    throw sol::error(result.get<std::string>());
-  }
-  _lua_cuts.push_back(result);
+  _cut_order.push_back(std::make_pair(true, _lua_cuts.size()));
+  _lua_cuts.push_back(lua_cut_entry{c, enabled});
 }
 
 void run::add_fill(const std::string &name,
@@ -37,69 +46,990 @@ void run::add_fill(const std::string &name,
       fct,
       hist::histogram(axis),
       hist::histogram(axis),
-      hist::histogram2d(axis, axis) });
+      hist::histogram2d(axis, axis),
+      std::vector<hist::histogram>() });
+}
+
+/**
+ * \brief Changes the axis of the fill called \c name.
+ *
+ * The histograms of the fill are emptied. Since the values of the fills are
+ * cached, the next run bins them again without reading any event.
+ */
+void run::set_axis(const std::string &name,
+                   const hist::linear_axis<double> &axis)
+{
+  for (fill &f : _fills) {
+    if (f.name == name) {
+      f.before_cuts = hist::histogram(axis);
+      f.after_cuts = hist::histogram(axis);
+      f.migration = hist::histogram2d(axis, axis);
+      return;
+    }
+  }
+  throw std::invalid_argument("no fill called " + name);
+}
+
+/**
+ * \brief Sets the number of threads used to apply the cuts and fill the
+ *        histograms.
+ *
+ * Every batch of events is split between the threads, which apply the C++
+ * cuts and compute the values of the fills into columns shared by all
+ * threads. The histograms are then filled from the columns, each thread
+ * taking a share of the fills. The Lua cuts don't run in parallel: events are
+ * read, written and checked against them by the calling thread, because the
+ * tables filled by the source belong to its Lua state. The results are the
+ * same as with one thread.
+ */
+void run::set_threads(unsigned threads)
+{
+  _threads = std::max(threads, 1u);
+}
+
+/**
+ * \brief Sets whether the cuts are ordered by their cost per rejected event.
+ *
+ * The time spent in every cut and the number of events it rejects are
+ * recorded whenever it is applied. When the order is adaptive, the cuts that
+ * reject the most events for the time they take come first, and the ones
+ * that never reject anything last; cuts that were never applied are tried
+ * first to learn about them. Otherwise the cuts keep the order they were
+ * added in. The order is the one of the cut flow, and the one in which the
+ * cuts are applied when they can stop at the first failure.
+ */
+void run::set_adaptive_order(bool adaptive)
+{
+  _adaptive_order = adaptive;
+}
+
+/**
+ * \brief Sets whether the N-1 histograms are filled.
+ *
+ * The N-1 histogram of an enabled cut has the events that pass all the
+ * other enabled cuts, to see what the cut removes. They are filled along
+ * with the other histograms, for every enabled cut at once, from the results
+ * of the cuts that are evaluated once per event anyway.
+ */
+void run::set_n_minus_one(bool fill)
+{
+  _n_minus_one = fill;
+}
+
+/**
+ * \brief Sets a function called with the histograms filled so far while
+ *        events are read.
+ *
+ * The function is called from the thread running the run, after the first
+ * \c events events not shown yet or after \c interval, whichever comes
+ * first. When the results come from the cache, only the final histograms
+ * are returned.
+ */
+void run::set_progress(const progress_fct &fct, std::size_t events,
+                       std::chrono::milliseconds interval)
+{
+  _progress = fct;
+  _progress_events = events;
+  _progress_interval = interval;
+}
+
+/**
+ * \brief Sets a flag checked between batches of events.
+ *
+ * When the flag is raised, the run stops reading events and throws
+ * run::cancelled. The cache is then rebuilt by the next run, after the
+ * source is reset. The flag must outlive the run.
+ */
+void run::set_cancel(const std::atomic<bool> *flag)
+{
+  _cancel = flag;
+}
+
+namespace // anonymous
+{
+  typedef std::vector<std::uint64_t> bitset;
+
+  /*
+   * Returns bit i of a bitset.
+   */
+  inline bool test(const bitset &bits, std::size_t i)
+  {
+    return (bits[i / 64] >> (i % 64)) & 1;
+  }
+
+  /*
+   * Appends count bits to a bitset of size bits, taking them from values.
+   */
+  void append(bitset &bits, std::size_t size, const char *values,
+              std::size_t count)
+  {
+    bits.resize((size + count + 63) / 64, 0);
+    for (std::size_t i = 0; i < count; ++i) {
+      if (values[i]) {
+        bits[(size + i) / 64] |= std::uint64_t(1) << ((size + i) % 64);
+      }
+    }
+  }
+} // anonymous namespace
+
+/**
+ * \brief Returns the names of the fills, in the order they were added.
+ */
+std::vector<std::string> run::fill_names() const
+{
+  std::vector<std::string> names;
+  for (const fill &f : _fills) {
+    names.push_back(f.name);
+  }
+  return names;
 }
 
+/**
+ * \brief Runs over the events of \c in and returns the histograms.
+ *
+ * This is the same as passing the names of all fills to the other overload.
+ */
 run::result run::operator() (event_source *in)
 {
-  for (in->read(); !in->end(); in->read()) {
-    process_event(in);
+  return (*this)(in, fill_names());
+}
+
+/**
+ * \brief Runs over the events of \c in and returns the histograms of the
+ *        given fills.
+ *
+ * Every cut is evaluated once per event, even the ones that aren't enabled,
+ * and the results are kept in a cache along with the values of the fills
+ * that were asked for. As long as the cuts and fills don't change, later
+ * calls with the same source only read events to compute fills that weren't
+ * asked for before: enabling or disabling cuts combines their results and
+ * fills the histograms again from the cache. The histograms are also kept
+ * for every combination of enabled cuts, so going back to an earlier one is
+ * immediate. Only the first pass runs the Lua cuts and writes the events to
+ * the standard output.
+ *
+ * Computing the fills on screen first and the others later keeps the time
+ * to the first plot proportional to what is shown. The source must be reset
+ * before every call. The histograms of the fills start empty.
+ *
+ * If the values of the fills take more memory than allowed by
+ * set_cache_limit(), the histograms are filled as the events are read and
+ * the values aren't kept. Since the results of the cuts aren't kept either,
+ * the enabled cuts are then applied in the order given by
+ * set_adaptive_order(), stopping at the first one an event fails unless the
+ * N-1 histograms are filled.
+ *
+ * The result also has the cut flow: the number of events left after each
+ * cut, in the same order, along with the statistics recorded for the cut.
+ *
+ * While events are read, the histograms filled so far are passed to the
+ * function given to set_progress(). The run throws run::cancelled if the
+ * flag given to set_cancel() is raised before it is complete.
+ */
+run::result run::operator() (event_source *in,
+                             const std::vector<std::string> &fills)
+{
+  std::vector<std::size_t> wanted;
+  for (const std::string &name : fills) {
+    std::size_t f = 0;
+    while (f < _fills.size() && _fills[f].name != name) {
+      ++f;
+    }
+    if (f == _fills.size()) {
+      throw std::invalid_argument("no fill called " + name);
+    }
+    wanted.push_back(f);
+
+    fill &out = _fills[f];
+    out.before_cuts = hist::histogram(out.before_cuts.axis());
+    out.after_cuts = hist::histogram(out.after_cuts.axis());
+    out.migration = hist::histogram2d(out.migration.axis());
+    out.n_minus_one.assign(_n_minus_one ? _cuts.size() + _lua_cuts.size() : 0,
+                           hist::histogram(out.after_cuts.axis()));
+  }
+
+  cache &c = *_cache;
+  std::vector<std::size_t> order = cut_order();
+  std::vector<std::size_t> filled;
+  if (!cache_valid(in)) {
+    reset_cache(in);
+    read_events(in, wanted, true, order);
+    filled = wanted;
+  } else {
+    std::vector<std::size_t> missing, cached;
+    for (std::size_t f : wanted) {
+      auto it = c.memo.find(key(f));
+      if (it != c.memo.end()) {
+        _fills[f].before_cuts = it->second.before_cuts;
+        _fills[f].after_cuts = it->second.after_cuts;
+        _fills[f].migration = it->second.migration;
+        for (std::size_t i = 0; i < _fills[f].n_minus_one.size(); ++i) {
+          if (cut_enabled(i)) {
+            _fills[f].n_minus_one[i] = it->second.n_minus_one.at(cut_name(i));
+          }
+        }
+      } else if (c.computed[f]) {
+        cached.push_back(f);
+      } else {
+        missing.push_back(f);
+      }
+    }
+    if (!missing.empty()) {
+      make_room(missing.size(), wanted);
+      read_events(in, missing, false, order);
+    }
+    fill_from_cache(0, c.events, 0, cached);
+    filled = missing;
+    filled.insert(filled.end(), cached.begin(), cached.end());
+  }
+
+  if (c.valid) {
+    for (std::size_t f : filled) {
+      c.memo.erase(key(f));
+      c.memo.insert(std::make_pair(key(f), current_item(f)));
+    }
+    if (cache_size() > _cache_limit) {
+      c.memo.clear();
+    }
+    // Every cut was applied to every event, take the new statistics in
+    order = cut_order();
+  }
+
+  result r = current_result(wanted);
+  count_cutflow(order, r);
+  if (!c.valid) {
+    // Built without keeping the values of the fills
+    c = cache();
+  }
+  return r;
+}
+
+/*
+ * Returns a copy of the histograms of a fill.
+ */
+run::item run::current_item(std::size_t f) const
+{
+  item i = item {
+    _fills[f].after_cuts,
+    _fills[f].before_cuts,
+    _fills[f].migration,
+    std::map<std::string, hist::histogram>()
+  };
+  for (std::size_t j = 0; j < _fills[f].n_minus_one.size(); ++j) {
+    if (cut_enabled(j)) {
+      i.n_minus_one.insert(
+          std::make_pair(cut_name(j), _fills[f].n_minus_one[j]));
+    }
   }
+  return i;
+}
+
+/*
+ * Returns a copy of the histograms of the given fills.
+ */
+run::result run::current_result(const std::vector<std::size_t> &fills) const
+{
   result r;
-  for (std::vector<fill>::const_iterator it = _fills.begin();
-       it != _fills.end(); ++it) {
-    item i = item {
-      it->after_cuts,
-      it->before_cuts,
-      it->migration
-    };
-    r.histos.insert(std::make_pair(it->name, i));
+  for (std::size_t f : fills) {
+    r.histos.insert(std::make_pair(_fills[f].name, current_item(f)));
   }
   return r;
 }
 
-void run::process_event(event_source *in)
+/*
+ * Fills the cut flow of a result, with the cuts in the given order. Only the
+ * first enabled cut in this order that an event fails needs to be known.
+ */
+void run::count_cutflow(const std::vector<std::size_t> &order,
+                        result &r) const
+{
+  const cache &c = *_cache;
+  auto count = [](const bitset &bits) {
+    std::size_t n = 0;
+    for (std::uint64_t word : bits) {
+      n += std::bitset<64>(word).count();
+    }
+    return n;
+  };
+
+  bitset selected = c.has_rec;
+  r.events = count(selected);
+  r.cutflow.clear();
+  std::size_t passed = r.events;
+  for (std::size_t i : order) {
+    if (cut_enabled(i)) {
+      for (std::size_t w = 0; w < selected.size(); ++w) {
+        selected[w] &= c.passes[i][w];
+      }
+      passed = count(selected);
+    }
+    auto stats = _stats->find(cut_id(i));
+    r.cutflow.push_back(cutflow_step {
+      cut_name(i),
+      cut_enabled(i),
+      passed,
+      stats == _stats->end() ? cut_stats() : stats->second
+    });
+  }
+}
+
+/**
+ * \brief Returns the memory used by the cache, in bytes.
+ */
+std::size_t run::cache_size() const
+{
+  const cache &c = *_cache;
+  std::size_t size = (c.has_gen.size() + c.has_rec.size() + c.same.size())
+                     * sizeof(std::uint64_t);
+  for (const cache::bitset &passes : c.passes) {
+    size += passes.size() * sizeof(std::uint64_t);
+  }
+  for (const std::vector<double> &values : c.gen_values) {
+    size += values.size() * sizeof(double);
+  }
+  for (const std::vector<double> &values : c.rec_values) {
+    size += values.size() * sizeof(double);
+  }
+  for (const auto &memo : c.memo) {
+    const item &i = memo.second;
+    size += (i.after_cuts.end() - i.after_cuts.begin()
+             + i.before_cuts.end() - i.before_cuts.begin()
+             + i.migration.end() - i.migration.begin()) * sizeof(double);
+    for (const auto &n_minus_one : i.n_minus_one) {
+      const hist::histogram &h = n_minus_one.second;
+      size += (h.end() - h.begin()) * sizeof(double);
+    }
+  }
+  return size;
+}
+
+/*
+ * Checks whether the cache was built from the same source, with the same cuts
+ * and fills as this run.
+ */
+bool run::cache_valid(const event_source *in) const
+{
+  const cache &c = *_cache;
+  if (!c.valid || c.source != in
+      || c.cuts.size() != _cuts.size() + _lua_cuts.size()
+      || c.fills.size() != _fills.size()) {
+    return false;
+  }
+  for (std::size_t i = 0; i < _cuts.size(); ++i) {
+    if (c.cuts[i] != _cuts[i].c.get()) {
+      return false;
+    }
+  }
+  for (std::size_t i = 0; i < _lua_cuts.size(); ++i) {
+    if (c.cuts[_cuts.size() + i] != _lua_cuts[i].c.get()) {
+      return false;
+    }
+  }
+  for (std::size_t i = 0; i < _fills.size(); ++i) {
+    if (c.fills[i] != _fills[i].name) {
+      return false;
+    }
+  }
+  return true;
+}
+
+/*
+ * Empties the cache, to be filled with the cuts and fills of this run.
+ */
+void run::reset_cache(event_source *in)
+{
+  cache &c = *_cache;
+  c = cache();
+  c.source = in;
+  for (const cut_entry &entry : _cuts) {
+    c.cuts.push_back(entry.c.get());
+  }
+  for (const lua_cut_entry &entry : _lua_cuts) {
+    c.cuts.push_back(entry.c.get());
+  }
+  for (const fill &f : _fills) {
+    c.fills.push_back(f.name);
+  }
+  c.passes.resize(c.cuts.size());
+  c.computed.resize(_fills.size());
+  c.gen_values.resize(_fills.size());
+  c.rec_values.resize(_fills.size());
+}
+
+/*
+ * Returns the key of the histograms of a fill with the enabled cuts.
+ */
+run::cache::memo_key run::key(std::size_t f) const
+{
+  std::vector<bool> enabled;
+  for (const cut_entry &entry : _cuts) {
+    enabled.push_back(entry.enabled);
+  }
+  for (const lua_cut_entry &entry : _lua_cuts) {
+    enabled.push_back(entry.enabled);
+  }
+  const hist::linear_axis<double> axis = _fills[f].before_cuts.axis();
+  return cache::memo_key(enabled, _fills[f].name, axis.min(), axis.max(),
+                         axis.bin_count(), _n_minus_one);
+}
+
+/*
+ * Returns the address of a cut, given its index in the cache.
+ */
+const void *run::cut_id(std::size_t i) const
+{
+  return i < _cuts.size() ? static_cast<const void *>(_cuts[i].c.get())
+                          : _lua_cuts[i - _cuts.size()].c.get();
+}
+
+/*
+ * Checks whether a cut is enabled, given its index in the cache.
+ */
+bool run::cut_enabled(std::size_t i) const
 {
-  in->prepare(*_lua);
-  sol::table e = _lua->create_table();
-  (*_lua)["e"] = e;
-  bool has_gen = in->has_gen();
-  const event &gen = has_gen ? in->gen() : event();
-  in->fill_rec(*_lua, e);
-  bool has_rec = in->has_rec();
-  const event &rec = has_rec ? in->rec() : event();
+  return i < _cuts.size() ? _cuts[i].enabled
+                          : _lua_cuts[i - _cuts.size()].enabled;
+}
 
-  _out.write(e);
+/*
+ * Returns the name of a cut, given its index in the cache.
+ */
+const std::string &run::cut_name(std::size_t i) const
+{
+  return i < _cuts.size() ? _cuts[i].c->name()
+                          : _lua_cuts[i - _cuts.size()].c->name();
+}
 
-  bool passes_cuts = true;
-  if (has_rec) {
-    for (auto c : _cuts) {
-      if (!(*c)(rec)) {
-        passes_cuts = false;
-        break;
+/*
+ * Returns the indices in the cache of the cuts, in the order they are
+ * applied. See set_adaptive_order().
+ */
+std::vector<std::size_t> run::cut_order() const
+{
+  std::vector<std::size_t> order;
+  for (const auto &added : _cut_order) {
+    order.push_back(added.first ? _cuts.size() + added.second : added.second);
+  }
+  if (_adaptive_order) {
+    auto cost = [this](std::size_t i) {
+      auto it = _stats->find(cut_id(i));
+      if (it == _stats->end() || it->second.evaluated == 0) {
+        return 0.0;
+      } else if (it->second.rejected == 0) {
+        return std::numeric_limits<double>::infinity();
       }
+      return it->second.seconds / it->second.rejected;
+    };
+    std::stable_sort(order.begin(), order.end(),
+                     [&](std::size_t a, std::size_t b) {
+                       return cost(a) < cost(b);
+                     });
+  }
+  return order;
+}
+
+/*
+ * Drops the columns of fills that aren't in keep until the columns of count
+ * more fills fit in the cache. They are computed again when needed.
+ */
+void run::make_room(std::size_t count, const std::vector<std::size_t> &keep)
+{
+  cache &c = *_cache;
+  std::size_t needed =
+      c.events * count * sizeof(double) * (c.separate ? 2 : 1);
+  for (std::size_t f = 0; f < _fills.size(); ++f) {
+    if (cache_size() + needed <= _cache_limit) {
+      break;
+    }
+    if (c.computed[f] && std::find(keep.begin(), keep.end(), f) == keep.end()) {
+      c.computed[f] = false;
+      std::vector<double>().swap(c.gen_values[f]);
+      std::vector<double>().swap(c.rec_values[f]);
     }
-    for (auto func : _lua_cuts) {
-      if (!func()) {
-        passes_cuts = false;
-        break;
+  }
+}
+
+/*
+ * Reads all events from the source, computes the values of the given fills
+ * and fills their histograms as the events are read. When building the
+ * cache, the events are also written and every cut is evaluated, unless the
+ * columns don't fit in the cache: the enabled cuts are then applied in the
+ * given order until one fails, and the others are marked as passed. All the
+ * enabled cuts are applied for the N-1 histograms.
+ * Otherwise the results of the cuts are taken from the cache, which must be
+ * valid.
+ */
+void run::read_events(event_source *in, const std::vector<std::size_t> &fills,
+                      bool build, const std::vector<std::size_t> &order)
+{
+  cache &c = *_cache;
+
+  std::vector<sol::function> lua_cuts;
+  if (build) {
+    for (const lua_cut_entry &entry : _lua_cuts) {
+      sol::load_result result = entry.c->load_into(*_lua);
+      if (!result.valid()) {
+        throw sol::error(result.get<std::string>());
       }
+      lua_cuts.push_back(result);
     }
   }
 
-  for (fill &f : _fills) {
-    double gen_val = 0, rec_val = 0;
-    if (has_gen) {
-      gen_val = f.function(gen);
-      f.before_cuts.bin(gen_val);
+  const std::size_t threads = _threads;
+  std::vector<event_slot> batch(BATCH_SIZE * threads);
+  std::vector<char> has_gen(batch.size()), has_rec(batch.size());
+  std::vector<char> same(batch.size());
+  // Results of cut i for the event j of the batch are at i * batch.size() + j
+  std::vector<char> passes(build ? c.cuts.size() * batch.size() : 0);
+  std::size_t count = 0;
+
+  std::size_t position = 0; ///< Number of events read
+  std::size_t first = 0; ///< First event in the columns
+  bool streaming = false; ///< The columns don't fit in the cache
+
+  // Statistics of the cuts in this pass, and of the C++ cuts in each thread
+  std::vector<cut_stats> stats(c.cuts.size());
+  std::vector<std::vector<cut_stats>> thread_stats(
+      threads, std::vector<cut_stats>(_cuts.size()));
+  auto merge_stats = [&]() {
+    for (std::size_t t = 0; t < threads; ++t) {
+      for (std::size_t i = 0; i < _cuts.size(); ++i) {
+        stats[i].evaluated += thread_stats[t][i].evaluated;
+        stats[i].rejected += thread_stats[t][i].rejected;
+        stats[i].seconds += thread_stats[t][i].seconds;
+      }
+    }
+    for (std::size_t i = 0; i < stats.size(); ++i) {
+      cut_stats &total = (*_stats)[c.cuts[i]];
+      total.evaluated += stats[i].evaluated;
+      total.rejected += stats[i].rejected;
+      total.seconds += stats[i].seconds;
+    }
+  };
+
+  // Applies a cut to an event, on this thread
+  auto apply = [&](std::size_t i, const event_slot &slot) {
+    auto start = std::chrono::steady_clock::now();
+    bool pass = i < _cuts.size() ? (*_cuts[i].c)(*slot.rec)
+                                 : bool(lua_cuts[i - _cuts.size()]());
+    stats[i].seconds += std::chrono::duration<double>(
+        std::chrono::steady_clock::now() - start).count();
+    ++stats[i].evaluated;
+    stats[i].rejected += !pass;
+    return pass;
+  };
+
+  // Events before this one are in the histograms
+  std::size_t binned = 0;
+  auto bin_pending = [&]() {
+    fill_from_cache(binned, position, first, fills);
+    binned = position;
+  };
+  std::chrono::steady_clock::time_point last_progress =
+      std::chrono::steady_clock::now();
+
+  // Thread t evaluates the t-th part of the batch
+  auto evaluate_part = [&](std::size_t t) {
+    std::size_t begin = count * t / threads;
+    std::size_t end = count * (t + 1) / threads;
+    evaluate(batch.data() + begin, end - begin, position - first + begin,
+             fills, build && !streaming ? passes.data() + begin : nullptr,
+             batch.size(), thread_stats[t].data());
+  };
+
+  std::mutex mutex;
+  std::condition_variable changed;
+  unsigned generation = 0; ///< Incremented for every batch
+  std::size_t busy = 0; ///< Number of threads processing the batch
+  bool stop = false;
+  std::exception_ptr error;
+
+  std::vector<std::thread> workers;
+  for (std::size_t t = 1; t < threads; ++t) {
+    workers.emplace_back([&, t]() {
+      unsigned done = 0;
+      while (true) {
+        {
+          std::unique_lock<std::mutex> lock(mutex);
+          changed.wait(lock, [&]() { return stop || generation != done; });
+          if (stop) {
+            return;
+          }
+          done = generation;
+        }
+        try {
+          evaluate_part(t);
+        } catch (...) {
+          std::lock_guard<std::mutex> lock(mutex);
+          error = std::current_exception();
+        }
+        {
+          std::lock_guard<std::mutex> lock(mutex);
+          --busy;
+        }
+        changed.notify_all();
+      }
+    });
+  }
+
+  // Waits for the batch to be processed
+  auto wait = [&]() {
+    std::unique_lock<std::mutex> lock(mutex);
+    changed.wait(lock, [&]() { return busy == 0; });
+  };
+  auto stop_workers = [&]() {
+    wait();
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      stop = true;
+    }
+    changed.notify_all();
+    for (std::thread &worker : workers) {
+      worker.join();
+    }
+  };
+  auto drop_columns = [&]() {
+    for (std::size_t f : fills) {
+      c.gen_values[f].clear();
+      c.rec_values[f].clear();
+    }
+  };
+
+  try {
+    do {
+      if (_cancel != nullptr && *_cancel) {
+        throw cancelled();
+      }
+
+      if (build) {
+        in->prepare(*_lua);
+        count = in->read_batch(batch.data(), batch.size(), _lua.get());
+
+        // Lua cuts, or all of them when they aren't kept
+        bool was_separate = c.separate;
+        for (std::size_t i = 0; i < count; ++i) {
+          const event_slot &slot = batch[i];
+          has_gen[i] = slot.gen != nullptr;
+          has_rec[i] = slot.rec != nullptr;
+          same[i] = has_rec[i] && slot.rec == slot.gen;
+          c.separate = c.separate || (has_rec[i] && !same[i]);
+
+          const sol::table &e = slot.fill;
+          (*_lua)["e"] = e;
+          _out.write(e);
+          if (!streaming) {
+            for (std::size_t j = _cuts.size(); j < c.cuts.size(); ++j) {
+              passes[j * batch.size() + i] = has_rec[i] && apply(j, slot);
+            }
+          } else {
+            for (std::size_t j = 0; j < c.cuts.size(); ++j) {
+              passes[j * batch.size() + i] = has_rec[i];
+            }
+            // N-1 histograms need every enabled cut
+            for (std::size_t j = 0; has_rec[i] && j < order.size(); ++j) {
+              if (cut_enabled(order[j]) && !apply(order[j], slot)) {
+                passes[order[j] * batch.size() + i] = false;
+                if (!_n_minus_one) {
+                  break;
+                }
+              }
+            }
+          }
+        }
+        if (c.separate && !was_separate) {
+          for (std::size_t f : fills) {
+            c.rec_values[f].resize(c.gen_values[f].size());
+          }
+        }
+      } else {
+        count = in->read_batch(batch.data(), batch.size(), nullptr);
+        if (position + count > c.events) {
+          throw std::runtime_error("the source changed since it was cached");
+        }
+      }
+
+      // The columns the other threads will write to
+      for (std::size_t f : fills) {
+        c.gen_values[f].resize(position - first + count);
+        if (c.separate) {
+          c.rec_values[f].resize(position - first + count);
+        }
+      }
+
+      {
+        std::lock_guard<std::mutex> lock(mutex);
+        busy = threads - 1;
+        ++generation;
+      }
+      changed.notify_all();
+      evaluate_part(0);
+      wait();
+      if (error) {
+        std::rethrow_exception(error);
+      }
+
+      if (build) {
+        append(c.has_gen, position, has_gen.data(), count);
+        append(c.has_rec, position, has_rec.data(), count);
+        append(c.same, position, same.data(), count);
+        for (std::size_t i = 0; i < c.cuts.size(); ++i) {
+          append(c.passes[i], position, passes.data() + i * batch.size(),
+                 count);
+        }
+        c.events += count;
+      }
+      position += count;
+
+      if (cache_size() > _cache_limit) {
+        // Fill the histograms with the events of the columns and drop them
+        if (!streaming) {
+          std::cerr << "[WARN] The values of the fills need more than "
+                    << (_cache_limit >> 20) << " MB, not caching them"
+                    << std::endl;
+          streaming = true;
+        }
+        bin_pending();
+        drop_columns();
+        first = position;
+      }
+
+      if (_progress && count == batch.size()) {
+        auto now = std::chrono::steady_clock::now();
+        if (position - binned >= _progress_events
+            || now - last_progress >= _progress_interval) {
+          bin_pending();
+          _progress(current_result(fills));
+          last_progress = std::chrono::steady_clock::now();
+        }
+      }
+    } while (count == batch.size());
+  } catch (...) {
+    stop_workers();
+    drop_columns();
+    if (build) {
+      merge_stats();
+    }
+    throw;
+  }
+  stop_workers();
+  if (build) {
+    merge_stats();
+  }
+
+  bin_pending();
+  if (!build && position != c.events) {
+    drop_columns();
+    throw std::runtime_error("the source changed since it was cached");
+  }
+  if (streaming) {
+    drop_columns();
+    return;
+  }
+
+  for (std::size_t f : fills) {
+    c.gen_values[f].shrink_to_fit();
+    c.rec_values[f].shrink_to_fit();
+    c.computed[f] = true;
+  }
+  if (build) {
+    c.valid = true;
+  }
+  std::cerr << "[INFO] Cached " << fills.size() << " fills for " << c.events
+            << " events, using " << (cache_size() >> 20) << " MB"
+            << std::endl;
+}
+
+/*
+ * Computes the values of the fills for events, storing them in the columns
+ * starting at the given index. If passes isn't null, the C++ cuts are
+ * applied too and their results stored with the given stride between cuts,
+ * adding to the statistics of the cuts.
+ */
+void run::evaluate(const event_slot *slots, std::size_t count,
+                   std::size_t column, const std::vector<std::size_t> &fills,
+                   char *passes, std::size_t stride, cut_stats *stats) const
+{
+  cache &c = *_cache;
+
+  if (passes != nullptr) {
+    // One cut at a time, to time them without a clock call per event
+    for (std::size_t j = 0; j < _cuts.size(); ++j) {
+      auto start = std::chrono::steady_clock::now();
+      for (std::size_t i = 0; i < count; ++i) {
+        const event *rec = slots[i].rec;
+        bool pass = rec != nullptr && (*_cuts[j].c)(*rec);
+        passes[j * stride + i] = pass;
+        stats[j].evaluated += rec != nullptr;
+        stats[j].rejected += rec != nullptr && !pass;
+      }
+      stats[j].seconds += std::chrono::duration<double>(
+          std::chrono::steady_clock::now() - start).count();
+    }
+  }
+
+  for (std::size_t i = 0; i < count; ++i) {
+    const event_slot &slot = slots[i];
+    std::size_t index = column + i;
+
+    for (std::size_t f : fills) {
+      if (slot.gen != nullptr) {
+        c.gen_values[f][index] = _fills[f].function(*slot.gen);
+      }
+      if (slot.rec != nullptr && slot.rec != slot.gen) {
+        c.rec_values[f][index] = _fills[f].function(*slot.rec);
+      }
+    }
+  }
+}
+
+/*
+ * Fills the histograms of the given fills with the events from begin to end,
+ * keeping only the ones that pass the enabled cuts. The values of event i
+ * are at index i - column in the columns. The fills are shared between the
+ * threads.
+ *
+ * The N-1 histogram of a cut is filled with the events that pass all the
+ * enabled cuts, like the histogram after cuts, and the ones that fail only
+ * this one.
+ */
+void run::fill_from_cache(std::size_t begin, std::size_t end,
+                          std::size_t column,
+                          const std::vector<std::size_t> &fills)
+{
+  const cache &c = *_cache;
+  if (begin >= end || fills.empty()) {
+    return;
+  }
+
+  // Events that have reconstructed data and pass the cuts
+  std::size_t first_word = begin / 64, last_word = (end + 63) / 64;
+  bitset selected(c.has_rec.begin() + first_word,
+                  c.has_rec.begin() + last_word);
+  auto apply = [&](const bitset &passes) {
+    for (std::size_t w = first_word; w < last_word; ++w) {
+      selected[w - first_word] &= passes[w];
     }
-    if (has_rec && passes_cuts) {
-      rec_val = f.function(rec);
-      f.after_cuts.bin(rec_val);
+  };
+  for (std::size_t i = 0; i < _cuts.size(); ++i) {
+    if (_cuts[i].enabled) {
+      apply(c.passes[i]);
     }
-    if (has_gen && has_rec && passes_cuts) {
-      f.migration.bin(hist::bin2d(gen_val, rec_val));
-      // TODO fake, miss
+  }
+  for (std::size_t i = 0; i < _lua_cuts.size(); ++i) {
+    if (_lua_cuts[i].enabled) {
+      apply(c.passes[_cuts.size() + i]);
+    }
+  }
+
+  // Events that fail exactly one of the enabled cuts
+  bitset failed_one(selected.size());
+  if (_n_minus_one) {
+    for (std::size_t w = first_word; w < last_word; ++w) {
+      std::uint64_t one = 0, two = 0;
+      for (std::size_t i = 0; i < c.cuts.size(); ++i) {
+        if (cut_enabled(i)) {
+          std::uint64_t failed = c.has_rec[w] & ~c.passes[i][w];
+          two |= one & failed;
+          one |= failed;
+        }
+      }
+      failed_one[w - first_word] = one & ~two;
+    }
+  }
+
+  // Events to bin
+  std::vector<std::size_t> gen_events, rec_events;
+  // One per cut, the events that fail only this one
+  std::vector<std::vector<std::size_t>> failed_events(c.cuts.size());
+  bool all_gen = true;
+  for (std::size_t i = begin; i < end; ++i) {
+    if (test(c.has_gen, i)) {
+      gen_events.push_back(i);
+    } else {
+      all_gen = false;
+    }
+    if (test(selected, i - first_word * 64)) {
+      rec_events.push_back(i);
+    } else if (test(failed_one, i - first_word * 64)) {
+      std::size_t j = 0;
+      while (!cut_enabled(j) || test(c.passes[j], i)) {
+        ++j;
+      }
+      failed_events[j].push_back(i);
     }
   }
+
+  auto fill_part = [&](std::size_t t, std::size_t threads) {
+    const std::size_t block_size = 1024;
+    double values[block_size];
+
+    for (std::size_t j = t; j < fills.size(); j += threads) {
+      fill &out = _fills[fills[j]];
+      const std::vector<double> &gen_values = c.gen_values[fills[j]];
+      const std::vector<double> &rec_values = c.rec_values[fills[j]];
+      auto rec_value = [&](std::size_t i) {
+        return c.separate && !test(c.same, i) ? rec_values[i - column]
+                                               : gen_values[i - column];
+      };
+      // Shared by the histogram after cuts and the N-1 histograms
+      hist::histogram passed(out.after_cuts.axis());
+      hist::histogram &after_cuts = _n_minus_one ? passed : out.after_cuts;
+
+      if (all_gen) {
+        out.before_cuts.bin(gen_values.data() + begin - column, end - begin);
+      } else {
+        for (std::size_t k = 0; k < gen_events.size(); k += block_size) {
+          std::size_t n = std::min(block_size, gen_events.size() - k);
+          for (std::size_t l = 0; l < n; ++l) {
+            values[l] = gen_values[gen_events[k + l] - column];
+          }
+          out.before_cuts.bin(values, n);
+        }
+      }
+
+      for (std::size_t k = 0; k < rec_events.size(); k += block_size) {
+        std::size_t n = std::min(block_size, rec_events.size() - k);
+        for (std::size_t l = 0; l < n; ++l) {
+          values[l] = rec_value(rec_events[k + l]);
+        }
+        after_cuts.bin(values, n);
+        for (std::size_t l = 0; l < n; ++l) {
+          std::size_t i = rec_events[k + l];
+          if (test(c.has_gen, i)) {
+            out.migration.bin(hist::bin2d(gen_values[i - column], values[l]));
+            // TODO fake, miss
+          }
+        }
+      }
+
+      if (_n_minus_one) {
+        out.after_cuts.merge(passed);
+        for (std::size_t i = 0; i < out.n_minus_one.size(); ++i) {
+          if (cut_enabled(i)) {
+            out.n_minus_one[i].merge(passed);
+          }
+        }
+        for (std::size_t i = 0; i < out.n_minus_one.size(); ++i) {
+          const std::vector<std::size_t> &events = failed_events[i];
+          for (std::size_t k = 0; k < events.size(); k += block_size) {
+            std::size_t n = std::min(block_size, events.size() - k);
+            for (std::size_t l = 0; l < n; ++l) {
+              values[l] = rec_value(events[k + l]);
+            }
+            out.n_minus_one[i].bin(values, n);
+          }
+        }
+      }
+    }
+  };
+
+  std::size_t threads = std::min<std::size_t>(_threads, fills.size());
+  std::vector<std::thread> workers;
+  for (std::size_t t = 1; t < threads; ++t) {
+    workers.emplace_back(fill_part, t, threads);
+  }
+  fill_part(0, threads);
+  for (std::thread &worker : workers) {
+    worker.join();
+  }
 }
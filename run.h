@@ -1,9 +1,16 @@
 #ifndef RUN_H
 #define RUN_H
 
+#include <atomic>
+#include <chrono>
+#include <cstdint>
 #include <functional>
 #include <map>
 #include <memory>
+#include <stdexcept>
+#include <string>
+#include <tuple>
+#include <utility>
 #include <vector>
 
 #include "sol.hpp"
@@ -22,15 +29,43 @@ public:
     hist::histogram after_cuts;
     hist::histogram before_cuts;
     hist::histogram2d migration;
+    /// By enabled cut, the events passing the other enabled cuts
+    std::map<std::string, hist::histogram> n_minus_one;
+  };
+
+  /// Statistics about the evaluation of a cut
+  struct cut_stats
+  {
+    std::size_t evaluated = 0; ///< Number of events the cut was applied to
+    std::size_t rejected = 0; ///< Number of events that failed it
+    double seconds = 0; ///< Time spent applying it
+  };
+
+  /// A line of the cut flow
+  struct cutflow_step
+  {
+    std::string name;
+    bool enabled;
+    std::size_t passed; ///< Events passing this cut and the enabled ones before
+    cut_stats stats; ///< Gathered over every run with the cut
   };
 
   struct result
   {
     std::map<std::string, item> histos;
+    std::size_t events = 0; ///< Events with reconstructed data
+    std::vector<cutflow_step> cutflow; ///< Empty while events are read
   };
 
   typedef std::function<bool (const event &evt)> cut_fct;
   typedef std::function<double (const event &evt)> fill_fct;
+  typedef std::function<void (const result &partial)> progress_fct;
+
+  /// Thrown when a run is cancelled
+  struct cancelled : std::runtime_error
+  {
+    cancelled() : std::runtime_error("run cancelled") {}
+  };
 
 private:
   struct fill
@@ -40,29 +75,130 @@ private:
     hist::histogram before_cuts;
     hist::histogram after_cuts;
     hist::histogram2d migration;
+    /// One per cut in the order of the cache, empty unless set_n_minus_one()
+    std::vector<hist::histogram> n_minus_one;
   };
 
+  struct cut_entry
+  {
+    std::shared_ptr<cut> c;
+    bool enabled;
+  };
+
+  struct lua_cut_entry
+  {
+    std::shared_ptr<lua_cut> c;
+    bool enabled;
+  };
+
+  /**
+   * \brief Results of the cuts and fills for every event of a source
+   *
+   * Every cut that was added has a bitset telling which events pass it, and
+   * the fills that were asked for have a column with the values computed
+   * for each event. The histograms are also kept for every combination of
+   * enabled cuts they were filled with. The cache is shared by the copies of
+   * a run, and stays valid as long as the same cuts and fills are used with
+   * the same source.
+   */
+  struct cache
+  {
+    typedef std::vector<std::uint64_t> bitset;
+    /// Enabled cuts, name and axis of a fill, and whether N-1 was filled
+    typedef std::tuple<std::vector<bool>, std::string, double, double, int,
+                       bool> memo_key;
+
+    const event_source *source = nullptr;
+    std::vector<const void *> cuts; ///< C++ cuts, then Lua cuts
+    std::vector<std::string> fills;
+    bool valid = false;
+
+    std::size_t events = 0;
+    bitset has_gen, has_rec;
+    bitset same; ///< The reconstructed event is the generated one
+    bool separate = false; ///< Some reconstructed events aren't the same
+    std::vector<bitset> passes; ///< One per cut, in the order of cuts
+
+    std::vector<char> computed; ///< One per fill, the columns are complete
+    std::vector<std::vector<double>> gen_values; ///< One per fill
+    /// One per fill, empty unless separate
+    std::vector<std::vector<double>> rec_values;
+
+    std::map<memo_key, item> memo;
+  };
+
+  /// Number of events read at once
+  static const std::size_t BATCH_SIZE = 256;
+
   std::vector<fill> _fills;
-  std::vector<std::shared_ptr<cut>> _cuts;
+  std::vector<cut_entry> _cuts;
+  std::vector<lua_cut_entry> _lua_cuts;
+  /// Kind (true for Lua) and index of the cuts, in the order they were added
+  std::vector<std::pair<bool, std::size_t>> _cut_order;
+  bool _adaptive_order = false;
+  bool _n_minus_one = false;
+  /// Statistics of the cuts, shared by the copies of a run
+  std::shared_ptr<std::map<const void *, cut_stats>> _stats;
 
   std::shared_ptr<sol::state> _lua;
-  std::vector<sol::function> _lua_cuts;
 
   serializer _out;
 
+  unsigned _threads = 1;
+  std::shared_ptr<cache> _cache;
+  std::size_t _cache_limit = std::size_t(1) << 30;
+
+  progress_fct _progress;
+  std::size_t _progress_events = 0;
+  std::chrono::milliseconds _progress_interval;
+  const std::atomic<bool> *_cancel = nullptr;
+
 public:
   explicit run();
   virtual ~run() {}
 
-  void add(const std::shared_ptr<cut> &c);
-  void add(const std::shared_ptr<lua_cut> &c);
+  void add(const std::shared_ptr<cut> &c, bool enabled = true);
+  void add(const std::shared_ptr<lua_cut> &c, bool enabled = true);
   void add_fill(const std::string &name, const hist::linear_axis<double> &axis,
                 const fill_fct fill);
+  void set_axis(const std::string &name,
+                const hist::linear_axis<double> &axis);
+  void set_threads(unsigned threads);
+  void set_adaptive_order(bool adaptive);
+  void set_n_minus_one(bool fill);
+
+  /// Sets the memory the cache may use, in bytes
+  void set_cache_limit(std::size_t bytes) { _cache_limit = bytes; }
+  std::size_t cache_size() const;
+
+  void set_progress(const progress_fct &fct, std::size_t events,
+                    std::chrono::milliseconds interval);
+  void set_cancel(const std::atomic<bool> *flag);
+
+  std::vector<std::string> fill_names() const;
 
   result operator() (event_source *in);
+  result operator() (event_source *in, const std::vector<std::string> &fills);
 
 private:
-  void process_event(event_source *in);
+  bool cache_valid(const event_source *in) const;
+  void reset_cache(event_source *in);
+  cache::memo_key key(std::size_t fill) const;
+  const void *cut_id(std::size_t cut) const;
+  bool cut_enabled(std::size_t cut) const;
+  const std::string &cut_name(std::size_t cut) const;
+  std::vector<std::size_t> cut_order() const;
+  void make_room(std::size_t count, const std::vector<std::size_t> &keep);
+  void read_events(event_source *in, const std::vector<std::size_t> &fills,
+                   bool build, const std::vector<std::size_t> &order);
+  void evaluate(const event_slot *slots, std::size_t count,
+                std::size_t column, const std::vector<std::size_t> &fills,
+                char *passes, std::size_t stride, cut_stats *stats) const;
+  void fill_from_cache(std::size_t begin, std::size_t end, std::size_t column,
+                       const std::vector<std::size_t> &fills);
+  item current_item(std::size_t fill) const;
+  result current_result(const std::vector<std::size_t> &fills) const;
+  void count_cutflow(const std::vector<std::size_t> &order, result &r) const;
 };
 
 #endif // RUN_H
@@ -44,12 +44,10 @@ void run_config::fill_run(run &r) const
 {
   for (std::vector<cut_info>::const_iterator it = _cuts.begin();
        it != _cuts.end(); ++it) {
-    if (it->enabled) {
-      if (it->c) {
-        r.add(it->c);
-      } else {
-        r.add(it->lc);
-      }
+    if (it->c) {
+      r.add(it->c, it->enabled);
+    } else {
+      r.add(it->lc, it->enabled);
     }
   }
 }
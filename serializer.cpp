@@ -1,6 +1,7 @@
 #include "serializer.h"
 
 #include <cassert>
+#include <cstring>
 
 void serializer::write(const sol::table &event)
 {
@@ -8,6 +9,69 @@ void serializer::write(const sol::table &event)
   print_opcode(detail::opcode::end);
 }
 
+void serializer::write(const record &event)
+{
+  print_table_contents(event);
+  print_opcode(detail::opcode::end);
+}
+
+/**
+ * \brief Defines the names and types used in a record, without writing it.
+ *
+ * The definitions are read with the next event. Names and types get ids in
+ * the order they are first used, so serializers that declared the same
+ * records give the same ids to them. Events that only use declared names and
+ * types are then written the same way by all of them, and can be copied from
+ * one stream to another.
+ */
+void serializer::declare(const record &prototype)
+{
+  if (prototype.has_type()) {
+    type_id(prototype.class_name(), prototype.module_name());
+  }
+  for (const auto &field : prototype.array()) {
+    declare(field.second);
+  }
+  for (const auto &field : prototype.named()) {
+    name_id(field.first);
+    declare(field.second);
+  }
+}
+
+/**
+ * \brief Writes an event read with unserializer::read_raw().
+ *
+ * The names and types it uses must have been declared.
+ */
+void serializer::write_raw(const std::string &bytes)
+{
+  _out.write(bytes.data(), bytes.size());
+}
+
+/**
+ * \brief Defines the names and types known by an unserializer, with the same
+ *        ids.
+ *
+ * Events read with unserializer::read_raw() can then be written with
+ * write_raw(). Nothing may have been written before.
+ */
+void serializer::declare(const unserializer &source)
+{
+  for (const auto &name : source.names()) {
+    print_opcode(detail::opcode::new_name);
+    print_string(name.second);
+    print_number(name.first);
+    _names[name.second] = name.first;
+  }
+  for (const auto &type : source.type_names()) {
+    print_opcode(detail::opcode::new_type);
+    print_string(type.second.first);
+    print_string(type.second.second);
+    print_number(type.first);
+    _types[type.second.first + "@" + type.second.second] = type.first;
+  }
+}
+
 int serializer::name_id(const std::string &name)
 {
   if (_names.count(name) == 0) {
@@ -43,6 +107,30 @@ void serializer::print_string(const std::string &str)
   _out.write(str.data(), str.size());
 }
 
+int serializer::type_id(const std::string &class_name,
+                         const std::string &module_name)
+{
+  if (_types.count(class_name + "@" + module_name) == 0) {
+    // Print type infomation
+    print_opcode(detail::opcode::new_type);
+    print_string(class_name);
+    print_string(module_name);
+    int id = _types.size();
+    print_number(id);
+    // Add the type to the table
+    _types[class_name + "@" + module_name] = id;
+  }
+  return _types.at(class_name + "@" + module_name);
+}
+
+void serializer::print_type(const std::string &class_name,
+                            const std::string &module_name)
+{
+  int id = type_id(class_name, module_name);
+  print_opcode(detail::opcode::metatable);
+  print_number(id);
+}
+
 void serializer::print_table_contents(const sol::table &t)
 {
   // Print type information if it's in the metatable
@@ -50,18 +138,7 @@ void serializer::print_table_contents(const sol::table &t)
       t[sol::metatable_key]["__module"]) {
     std::string class_name = t[sol::metatable_key]["__class"];
     std::string module_name = t[sol::metatable_key]["__module"];
-    if (_types.count(class_name + "@" + module_name) == 0) {
-      // Print type infomation
-      print_opcode(detail::opcode::new_type);
-      print_string(class_name);
-      print_string(module_name);
-      int id = _types.size();
-      print_number(id);
-      // Add the type to the table
-      _types[class_name + "@" + module_name] = id;
-    }
-    print_opcode(detail::opcode::metatable);
-    print_number(_types.at(class_name + "@" + module_name));
+    print_type(class_name, module_name);
   }
   // Print values
   t.for_each([this](const sol::object &key, const sol::object &value) {
@@ -137,16 +214,302 @@ void serializer::print_value(const std::string &name, const sol::object &v)
   }
 }
 
+namespace // anonymous
+{
+  /*
+   * Returns the opcode for a record value, starting from the one used for
+   * false (named_false or array_false).
+   */
+  detail::opcode value_opcode(detail::opcode false_code, const record &v)
+  {
+    int offset = 0;
+    switch (v.type()) {
+    case record::kind::boolean:
+      offset = v.as_boolean() ? 1 : 0;
+      break;
+    case record::kind::number:
+      offset = 2;
+      break;
+    case record::kind::string:
+      offset = 3;
+      break;
+    case record::kind::table:
+      offset = 4;
+      break;
+    case record::kind::nil:
+      throw 0;
+    }
+    return detail::opcode((int) false_code + offset);
+  }
+} // anonymous namespace
+
+void serializer::print_table_contents(const record &t)
+{
+  if (t.has_type()) {
+    print_type(t.class_name(), t.module_name());
+  }
+  // Like in Lua, nil fields don't exist. Array fields come first, as when
+  // iterating over a table with next().
+  for (const auto &field : t.array()) {
+    if (!field.second.is_nil()) {
+      print_opcode(value_opcode(detail::opcode::array_false, field.second));
+      print_number(field.first);
+      print_value(field.second);
+    }
+  }
+  for (const auto &field : t.named()) {
+    if (!field.second.is_nil()) {
+      int id = name_id(field.first);
+      print_opcode(value_opcode(detail::opcode::named_false, field.second));
+      print_number(id);
+      print_value(field.second);
+    }
+  }
+}
+
+/*
+ * Prints what follows the opcode and id of a record value.
+ */
+void serializer::print_value(const record &v)
+{
+  if (v.type() == record::kind::number) {
+    print_number(v.as_number());
+  } else if (v.type() == record::kind::string) {
+    print_string(v.as_string());
+  } else if (v.type() == record::kind::table) {
+    print_table_contents(v);
+    print_opcode(detail::opcode::end);
+  }
+}
+
+/**
+ * \brief Copies a Lua table to a record.
+ *
+ * The record contains what serializer::write(const sol::table &) would write,
+ * including type information. Writing it gives the same event, although named
+ * and array fields may come in a different order. Values that can't be
+ * serialized are reported the same way as by the serializer.
+ */
+record to_record(const sol::table &t)
+{
+  record r = record::table();
+  if (t[sol::metatable_key] && t[sol::metatable_key]["__class"] &&
+      t[sol::metatable_key]["__module"]) {
+    std::string class_name = t[sol::metatable_key]["__class"];
+    std::string module_name = t[sol::metatable_key]["__module"];
+    r.set_type(class_name, module_name);
+  }
+  t.for_each([&r](const sol::object &key, const sol::object &v) {
+    record value;
+    sol::type type = v.get_type();
+    if (type == sol::type::boolean) {
+      value = record(v.as<bool>());
+    } else if (type == sol::type::number) {
+      value = record(v.as<double>());
+    } else if (type == sol::type::string) {
+      value = record(v.as<std::string>());
+    } else if (type == sol::type::table) {
+      value = to_record(v.as<sol::table>());
+    } else {
+      throw 0;
+    }
+
+    if (key.get_type() == sol::type::string) {
+      r.add(key.as<std::string>(), std::move(value));
+    } else {
+      // sol::type::number
+      r.add(key.as<double>(), std::move(value));
+    }
+  });
+  return r;
+}
+
 void unserializer::read(sol::state &lua, sol::table &event, bool &eof)
 {
   event = lua.create_table();
-  read_table_contents(lua, event, &eof);
+  read_table_contents(lua, event, &eof,
+                      _fields.all() ? nullptr : &_fields.root());
+}
+
+void unserializer::read(record &event, bool &eof)
+{
+  event = record::table();
+  read_record_contents(event, &eof,
+                       _fields.all() ? nullptr : &_fields.root());
+}
+
+namespace // anonymous
+{
+  /// Stream buffer reading from memory
+  class memory_buffer : public std::streambuf
+  {
+  public:
+    memory_buffer(const char *begin, const char *end)
+    {
+      setg(const_cast<char *>(begin), const_cast<char *>(begin),
+           const_cast<char *>(end));
+    }
+  };
+} // anonymous namespace
+
+/**
+ * \brief Reads an event without decoding it.
+ *
+ * The bytes of the event are copied to \c bytes, without the definitions of
+ * names and types: they are kept by the unserializer, and a serializer can
+ * write them with serializer::declare(const unserializer &) before writing
+ * the events with serializer::write_raw(). Only the fields given to select()
+ * are decoded, into \c fields.
+ */
+void unserializer::read_raw(std::string &bytes, record &fields, bool &eof)
+{
+  bytes.clear();
+  copy_table_contents(bytes, false);
+
+  memory_buffer buf(bytes.data(), bytes.data() + bytes.size());
+  std::istream in(&buf);
+  std::istream *old_in = _in;
+  _in = &in;
+  fields = record::table();
+  read_record_contents(fields, &eof,
+                       _fields.all() ? nullptr : &_fields.root());
+  _in = old_in;
+}
+
+/**
+ * \brief Reads an event without decoding any of its fields.
+ *
+ * Like read_raw(std::string &, record &, bool &), but nothing is decoded: only
+ * the definitions of names and types are registered. The bytes can be
+ * decoded later with decode().
+ */
+void unserializer::read_raw(std::string &bytes, bool &eof)
+{
+  bytes.clear();
+  copy_table_contents(bytes, false);
+  // An empty event means eof
+  eof = bytes.size() <= 1;
+}
+
+/*
+ * Copies count bytes from the input to the buffer.
+ */
+void unserializer::copy_bytes(std::string &buffer, std::size_t count)
+{
+  std::size_t size = buffer.size();
+  buffer.resize(size + count);
+  _in->read(&buffer[size], count);
+}
+
+/*
+ * Copies a string from the input to the buffer.
+ */
+void unserializer::copy_string(std::string &buffer)
+{
+  copy_bytes(buffer, sizeof(int));
+  unsigned length;
+  std::memcpy(&length, &buffer[buffer.size() - sizeof(int)], sizeof(int));
+  copy_bytes(buffer, length);
+}
+
+/*
+ * Copies the contents of a table from the input to the buffer, without
+ * interpreting them. If definitions is false, the definitions of names and
+ * types are registered instead of being copied.
+ */
+void unserializer::copy_table_contents(std::string &buffer, bool definitions)
+{
+  using detail::opcode;
+  while (true) {
+    char c;
+    _in->get(c);
+    if (!_in->good()) {
+      return;
+    }
+    buffer.push_back(c);
+
+    switch ((opcode) c) {
+    case opcode::end:
+      return;
+    case opcode::new_name:
+      if (definitions) {
+        copy_string(buffer);
+        copy_bytes(buffer, sizeof(int));
+      } else {
+        buffer.pop_back();
+        read_new_name();
+      }
+      break;
+    case opcode::new_type:
+      if (definitions) {
+        copy_string(buffer);
+        copy_string(buffer);
+        copy_bytes(buffer, sizeof(int));
+      } else {
+        buffer.pop_back();
+        read_new_type();
+      }
+      break;
+    case opcode::metatable:
+    case opcode::named_false:
+    case opcode::named_true:
+      copy_bytes(buffer, sizeof(int));
+      break;
+    case opcode::named_number:
+      copy_bytes(buffer, sizeof(int) + sizeof(double));
+      break;
+    case opcode::named_string:
+      copy_bytes(buffer, sizeof(int));
+      copy_string(buffer);
+      break;
+    case opcode::named_table:
+      copy_bytes(buffer, sizeof(int));
+      copy_table_contents(buffer, definitions);
+      break;
+    case opcode::array_false:
+    case opcode::array_true:
+      copy_bytes(buffer, sizeof(double));
+      break;
+    case opcode::array_number:
+      copy_bytes(buffer, 2 * sizeof(double));
+      break;
+    case opcode::array_string:
+      copy_bytes(buffer, sizeof(double));
+      copy_string(buffer);
+      break;
+    case opcode::array_table:
+      copy_bytes(buffer, sizeof(double));
+      copy_table_contents(buffer, definitions);
+      break;
+    }
+  }
+}
+
+/**
+ * \brief Decodes the fields stored between \c begin and \c end into \c t.
+ *
+ * The bytes can be a range of the stream that was already read, or an event
+ * read with read_raw(). The name and type definitions they use must have been
+ * read already; definitions found in the range are skipped.
+ */
+void unserializer::decode(sol::state_view &lua, sol::table &t,
+                          const char *begin, const char *end)
+{
+  memory_buffer buf(begin, end);
+  std::istream in(&buf);
+  std::istream *old_in = _in;
+  _in = &in;
+  _replay = true;
+  read_table_contents(lua, t, nullptr,
+                      _fields.all() ? nullptr : &_fields.root());
+  _replay = false;
+  _in = old_in;
 }
 
 double unserializer::read_double()
 {
   double id;
-  _in.read((char *) &id, sizeof(double));
+  _in->read((char *) &id, sizeof(double));
   return id;
 }
 
@@ -158,7 +521,7 @@ double unserializer::read_id()
 int unserializer::read_int()
 {
   int id;
-  _in.read((char *) &id, sizeof(int));
+  _in->read((char *) &id, sizeof(int));
   return id;
 }
 
@@ -173,43 +536,64 @@ std::string unserializer::read_string()
 {
   unsigned length = read_int();
   std::string data(length, ' ');
-  _in.read(&data[0], length);
+  _in->read(&data[0], length);
   return data;
 }
 
-sol::table &unserializer::read_type_id()
+sol::table &unserializer::read_type_id(sol::state_view &lua)
 {
   int type_id = read_int();
-  assert(_types.count(type_id) != 0);
-  return _types.at(type_id);
+  assert(_type_names.count(type_id) != 0);
+  auto it = _types.find(type_id);
+  if (it == _types.end()) {
+    const auto &names = _type_names.at(type_id);
+    it = _types.emplace(type_id,
+                        load_type(lua, names.first, names.second)).first;
+  }
+  return it->second;
 }
 
 void unserializer::read_new_name()
 {
   std::string name = read_string();
   int id = read_int();
+  if (_replay) {
+    return; // Already known
+  }
   assert(_names.count(id) == 0);
   _names.insert(std::make_pair(id, name));
 }
 
-void unserializer::read_new_type(sol::state &lua)
+void unserializer::read_new_type()
 {
   std::string type_name = read_string();
   std::string module_name = read_string();
   int id = read_int();
-  assert(_types.count(id) == 0);
+  if (_replay) {
+    return; // Already known
+  }
+  assert(_type_names.count(id) == 0);
+  _type_names[id] = std::make_pair(type_name, module_name);
+}
+
+/*
+ * Finds the metatable of a type, loading the module if needed. The metatable
+ * is only needed when creating Lua tables.
+ */
+sol::table unserializer::load_type(sol::state_view &lua,
+                                   const std::string &type_name,
+                                   const std::string &module_name)
+{
   try {
     lua["require"](module_name);
   } catch(sol::error e) {
     std::cerr << "[WARN] Module \"" << module_name << "\" could not be loaded."
               << " Data is safe, but some class members will not be available."
               << std::endl;
-    _types[id] = lua.create_table();
-    return;
+    return lua.create_table();
   }
   try {
     sol::table metatable = lua[type_name];
-    _types[id] = metatable;
     if (metatable["__class"].get<std::string>() != type_name) {
       std::cerr << "[WARN] Class \"" << type_name << "\" could be loaded,"
                 << " but was renamed to \""
@@ -222,17 +606,18 @@ void unserializer::read_new_type(sol::state &lua)
                 << metatable["__module"].get<std::string>() << "\""
                 << std::endl;
     }
+    return metatable;
   } catch(sol::error e) {
     std::cerr << "[WARN] Class \"" << type_name << "\" could not be loaded."
               << " Data is safe, but class members will not be available."
               << std::endl;
-    _types[id] = lua.create_table();
-    return;
+    return lua.create_table();
   }
 }
 
-void unserializer::read_table_contents(sol::state &lua, sol::table &t,
-                                       bool *eof)
+void unserializer::read_table_contents(sol::state_view &lua, sol::table &t,
+                                       bool *eof,
+                                       const field_set::node *fields)
 {
   // An empty event means eof. We set it to true here, and then to false when we
   // encounter a value.
@@ -248,8 +633,8 @@ void unserializer::read_table_contents(sol::state &lua, sol::table &t,
   using detail::opcode;
   while (true) {
     char c;
-    _in.get(c);
-    if (!_in.good()) {
+    _in->get(c);
+    if (!_in->good()) {
       return;
     }
     opcode code = (opcode) c;
@@ -257,6 +642,7 @@ void unserializer::read_table_contents(sol::state &lua, sol::table &t,
     std::string name;
     double id;
     sol::table tab;
+    const field_set::node *child = nullptr;
 
     switch (code) {
     case opcode::end:
@@ -269,62 +655,286 @@ void unserializer::read_table_contents(sol::state &lua, sol::table &t,
       read_new_name();
       break;
     case opcode::new_type:
-      read_new_type(lua);
+      read_new_type();
       break;
     case opcode::metatable:
-      metatable = read_type_id();
+      metatable = read_type_id(lua);
       has_metatable = true;
       break;
     case opcode::named_false:
       ref_eof = false;
-      t[read_name_id()] = false;
+      name = read_name_id();
+      if (select_field(fields, name, code, child)) {
+        t[name] = false;
+      }
       break;
     case opcode::named_true:
       ref_eof = false;
-      t[read_name_id()] = true;
+      name = read_name_id();
+      if (select_field(fields, name, code, child)) {
+        t[name] = true;
+      }
       break;
     case opcode::named_number:
       ref_eof = false;
       name = read_name_id();
-      t[name] = read_double();
+      if (select_field(fields, name, code, child)) {
+        t[name] = read_double();
+      }
       break;
     case opcode::named_string:
       ref_eof = false;
       name = read_name_id();
-      t[name] = read_string();
+      if (select_field(fields, name, code, child)) {
+        t[name] = read_string();
+      }
       break;
     case opcode::named_table:
       ref_eof = false;
       name = read_name_id();
-      tab = lua.create_table();
-      read_table_contents(lua, tab);
-      t[name] = tab;
+      if (select_field(fields, name, code, child)) {
+        tab = lua.create_table();
+        read_table_contents(lua, tab, nullptr, child);
+        t[name] = tab;
+      }
       break;
     case opcode::array_false:
       ref_eof = false;
-      t[read_id()] = false;
+      id = read_id();
+      if (select_field(fields, "[]", code, child)) {
+        t[id] = false;
+      }
       break;
     case opcode::array_true:
       ref_eof = false;
-      t[read_id()] = true;
+      id = read_id();
+      if (select_field(fields, "[]", code, child)) {
+        t[id] = true;
+      }
       break;
     case opcode::array_number:
       ref_eof = false;
       id = read_id();
-      t[id] = read_double();
+      if (select_field(fields, "[]", code, child)) {
+        t[id] = read_double();
+      }
       break;
     case opcode::array_string:
       ref_eof = false;
       id = read_id();
-      t[id] = read_string();
+      if (select_field(fields, "[]", code, child)) {
+        t[id] = read_string();
+      }
       break;
     case opcode::array_table:
       ref_eof = false;
       id = read_id();
-      tab = lua.create_table();
-      read_table_contents(lua, tab);
-      t[id] = tab;
+      if (select_field(fields, "[]", code, child)) {
+        tab = lua.create_table();
+        read_table_contents(lua, tab, nullptr, child);
+        t[id] = tab;
+      }
       break;
     }
   }
 }
+
+void unserializer::read_record_contents(record &r, bool *eof,
+                                        const field_set::node *fields)
+{
+  // See read_table_contents
+  bool fake_eof;
+  bool &ref_eof = (eof != nullptr ? *eof : fake_eof);
+  ref_eof = true;
+
+  using detail::opcode;
+  while (true) {
+    char c;
+    _in->get(c);
+    if (!_in->good()) {
+      return;
+    }
+    opcode code = (opcode) c;
+
+    std::string name;
+    double id;
+    const field_set::node *child = nullptr;
+
+    switch (code) {
+    case opcode::end:
+      return;
+    case opcode::new_name:
+      read_new_name();
+      break;
+    case opcode::new_type:
+      read_new_type();
+      break;
+    case opcode::metatable: {
+      int type_id = read_int();
+      assert(_type_names.count(type_id) != 0);
+      const auto &names = _type_names.at(type_id);
+      r.set_type(names.first, names.second);
+      break;
+    }
+    case opcode::named_false:
+    case opcode::named_true:
+    case opcode::named_number:
+    case opcode::named_string:
+    case opcode::named_table:
+      ref_eof = false;
+      name = read_name_id();
+      if (select_field(fields, name, code, child)) {
+        read_record_value(code, r.add(name, record()), child);
+      }
+      break;
+    case opcode::array_false:
+    case opcode::array_true:
+    case opcode::array_number:
+    case opcode::array_string:
+    case opcode::array_table:
+      ref_eof = false;
+      id = read_id();
+      if (select_field(fields, "[]", code, child)) {
+        read_record_value(code, r.add(id, record()), child);
+      }
+      break;
+    }
+  }
+}
+
+void unserializer::read_record_value(detail::opcode code, record &value,
+                                     const field_set::node *fields)
+{
+  using detail::opcode;
+  switch (code) {
+  case opcode::named_false:
+  case opcode::array_false:
+    value = record(false);
+    break;
+  case opcode::named_true:
+  case opcode::array_true:
+    value = record(true);
+    break;
+  case opcode::named_number:
+  case opcode::array_number:
+    value = record(read_double());
+    break;
+  case opcode::named_string:
+  case opcode::array_string:
+    value = record(read_string());
+    break;
+  case opcode::named_table:
+  case opcode::array_table:
+    value = record::table();
+    read_record_contents(value, nullptr, fields);
+    break;
+  default:
+    break;
+  }
+}
+
+/*
+ * Decides whether the value being read should be decoded. fields describes the
+ * fields needed in the current table (nullptr means all of them). If the value
+ * is needed, child is set to describe the fields needed inside it and true is
+ * returned. Otherwise, the value is skipped.
+ */
+bool unserializer::select_field(const field_set::node *fields,
+                                const std::string &name, detail::opcode code,
+                                const field_set::node *&child)
+{
+  if (fields == nullptr) {
+    child = nullptr;
+    return true;
+  }
+  child = fields->child(name);
+  if (child != nullptr) {
+    if (child->all) {
+      child = nullptr;
+    }
+    return true;
+  }
+  // Opcode and id
+  _skipped_bytes += 1 + (code < detail::opcode::array_false ? sizeof(int)
+                                                            : sizeof(double));
+  _skipped_bytes += skip_value(code);
+  return false;
+}
+
+/*
+ * Skips the contents of a table, returning the number of bytes skipped. Name
+ * and type definitions are still read.
+ */
+std::size_t unserializer::skip_table_contents()
+{
+  std::size_t skipped = 0;
+  using detail::opcode;
+  while (true) {
+    char c;
+    _in->get(c);
+    if (!_in->good()) {
+      return skipped;
+    }
+    opcode code = (opcode) c;
+
+    switch (code) {
+    case opcode::end:
+      return skipped + 1;
+    // Definitions are needed to read the rest of the stream
+    case opcode::new_name:
+      read_new_name();
+      break;
+    case opcode::new_type:
+      read_new_type();
+      break;
+    case opcode::metatable:
+      read_int();
+      skipped += 1 + sizeof(int);
+      break;
+    case opcode::named_false:
+    case opcode::named_true:
+    case opcode::named_number:
+    case opcode::named_string:
+    case opcode::named_table:
+      read_int();
+      skipped += 1 + sizeof(int);
+      skipped += skip_value(code);
+      break;
+    case opcode::array_false:
+    case opcode::array_true:
+    case opcode::array_number:
+    case opcode::array_string:
+    case opcode::array_table:
+      read_id();
+      skipped += 1 + sizeof(double);
+      skipped += skip_value(code);
+      break;
+    }
+  }
+}
+
+/*
+ * Skips a value whose type is given by code, returning the number of bytes
+ * skipped.
+ */
+std::size_t unserializer::skip_value(detail::opcode code)
+{
+  using detail::opcode;
+  switch (code) {
+  case opcode::named_number:
+  case opcode::array_number:
+    _in->ignore(sizeof(double));
+    return sizeof(double);
+  case opcode::named_string:
+  case opcode::array_string: {
+    unsigned length = read_int();
+    _in->ignore(length);
+    return sizeof(int) + length;
+  }
+  case opcode::named_table:
+  case opcode::array_table:
+    return skip_table_contents();
+  default:
+    return 0;
+  }
+}
@@ -7,6 +7,9 @@
 
 #include "sol.hpp"
 
+#include "field_usage.h"
+#include "record.h"
+
 namespace detail
 {
   enum class opcode : unsigned char
@@ -28,6 +31,8 @@ namespace detail
   };
 } // namespace detail
 
+class unserializer;
+
 class serializer
 {
   std::ostream &_out;
@@ -37,38 +42,90 @@ public:
   explicit serializer(std::ostream &out) : _out(out) {}
 
   void write(const sol::table &event);
+  void write(const record &event);
+  void declare(const record &prototype);
+  void declare(const unserializer &source);
+  void write_raw(const std::string &bytes);
 
 private:
   int name_id(const std::string &name);
+  int type_id(const std::string &class_name, const std::string &module_name);
   void print_number(double value);
   void print_number(int value);
   void print_opcode(detail::opcode code);
   void print_string(const std::string &str);
+  void print_type(const std::string &class_name,
+                  const std::string &module_name);
   void print_table_contents(const sol::table &t);
+  void print_table_contents(const record &t);
   void print_value(double id, const sol::object &v);
   void print_value(const std::string &name, const sol::object &v);
+  void print_value(const record &v);
 };
 
+record to_record(const sol::table &t);
+
+/**
+ * \brief Reads events written by a serializer
+ *
+ * Events can be decoded to Lua tables or to records, or copied without being
+ * decoded with read_raw().
+ */
 class unserializer
 {
-  std::istream &_in;
+  std::istream *_in;
   std::map<int, std::string> _names;
+  std::map<int, std::pair<std::string, std::string>> _type_names;
   std::map<int, sol::table> _types;
+  field_set _fields = field_set::everything();
+  std::size_t _skipped_bytes = 0;
+  bool _replay = false;
 public:
-  explicit unserializer(std::istream &in) : _in(in) {}
+  explicit unserializer(std::istream &in) : _in(&in) {}
 
   void read(sol::state &lua, sol::table &event, bool &eof);
+  void read(record &event, bool &eof);
+  void read_raw(std::string &bytes, record &fields, bool &eof);
+  void read_raw(std::string &bytes, bool &eof);
+  void decode(sol::state_view &lua, sol::table &t, const char *begin,
+              const char *end);
+
+  /// Only decode the given fields, skipping over the others
+  void select(const field_set &fields) { _fields = fields; }
+  /// Returns the number of bytes skipped because of select()
+  std::size_t skipped_bytes() const { return _skipped_bytes; }
+
+  /// Returns the names defined so far, by id
+  const std::map<int, std::string> &names() const { return _names; }
+  /// Returns the class and module names of the types defined so far, by id
+  const std::map<int, std::pair<std::string, std::string>> &
+  type_names() const { return _type_names; }
 
 private:
+  void copy_bytes(std::string &buffer, std::size_t count);
+  void copy_string(std::string &buffer);
+  void copy_table_contents(std::string &buffer, bool definitions = true);
   double read_double();
   double read_id();
   int read_int();
   std::string read_name_id();
   std::string read_string();
-  sol::table &read_type_id();
+  sol::table &read_type_id(sol::state_view &lua);
   void read_new_name();
-  void read_new_type(sol::state &lua);
-  void read_table_contents(sol::state &lua, sol::table &t, bool *eof = nullptr);
+  void read_new_type();
+  sol::table load_type(sol::state_view &lua, const std::string &type_name,
+                       const std::string &module_name);
+  void read_table_contents(sol::state_view &lua, sol::table &t,
+                           bool *eof = nullptr,
+                           const field_set::node *fields = nullptr);
+  void read_record_contents(record &r, bool *eof = nullptr,
+                            const field_set::node *fields = nullptr);
+  void read_record_value(detail::opcode code, record &value,
+                         const field_set::node *fields);
+  bool select_field(const field_set::node *fields, const std::string &name,
+                    detail::opcode code, const field_set::node *&child);
+  std::size_t skip_table_contents();
+  std::size_t skip_value(detail::opcode code);
 };
 
 #endif // SERIALIZER_H
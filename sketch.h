@@ -0,0 +1,189 @@
+#ifndef SKETCH_H
+#define SKETCH_H
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <stdexcept>
+#include <vector>
+
+namespace hist
+{
+
+/**
+ * \brief Contiguous range of bucket counters
+ *
+ * Buckets are identified by an integer index. Only the range between the
+ * lowest and highest indices used is stored. When more than a given number of
+ * buckets would be needed, the lowest ones are merged together.
+ */
+class bucket_store
+{
+  int _offset = 0;
+  std::vector<double> _counts;
+
+public:
+  void add(int index, double weight, std::size_t max_buckets);
+
+  bool empty() const { return _counts.empty(); }
+  int min_index() const { return _offset; }
+  int max_index() const { return _offset + int(_counts.size()) - 1; }
+  double count(int index) const { return _counts[index - _offset]; }
+};
+
+/**
+ * \brief Histogram with logarithmically spaced buckets
+ *
+ * The range of the data doesn't need to be known in advance: bucket \c i
+ * contains the absolute values in the interval (gamma^(i-1), gamma^i], where
+ * gamma is chosen such that any value can be recovered with a relative error
+ * smaller than the requested one. Positive and negative values are kept in
+ * separate stores, and (nearly) zero values are counted apart.
+ *
+ * Memory use is bounded by the maximum number of buckets per store. When it is
+ * reached, the buckets closest to zero are merged and lose their precision.
+ *
+ * Two sketches with the same relative error can be merged.
+ */
+class sketch
+{
+public:
+  /// Bucket indices are clamped to [-max_index, max_index]
+  static const int max_index = 1 << 24;
+
+private:
+  double _relative_error;
+  double _gamma, _log_gamma;
+  std::size_t _max_buckets;
+  bucket_store _positive, _negative;
+  double _zero = 0;
+
+public:
+  explicit sketch(double relative_error = 0.01,
+                  std::size_t max_buckets = 2048);
+
+  void bin(double value) { bin(value, 1); }
+  inline void bin(double value, double weight);
+  inline void merge(const sketch &other);
+
+  /// Returns the index of the bucket containing the (positive, finite) value
+  int index(double value) const
+  {
+    double i = std::ceil(std::log(value) / _log_gamma);
+    return std::max(std::min(i, double(max_index)), -double(max_index));
+  }
+  /// Returns the lower edge of bucket \c index
+  double lower_bound(int index) const { return std::pow(_gamma, index - 1); }
+  /// Returns the upper edge of bucket \c index
+  double upper_bound(int index) const { return std::pow(_gamma, index); }
+  /// Returns the value representing bucket \c index
+  double value(int index) const
+  { return 2 * std::pow(_gamma, index) / (_gamma + 1); }
+
+  double relative_error() const { return _relative_error; }
+  std::size_t max_buckets() const { return _max_buckets; }
+  const bucket_store &positive() const { return _positive; }
+  const bucket_store &negative() const { return _negative; }
+  double zero() const { return _zero; }
+
+  bucket_store &positive() { return _positive; }
+  bucket_store &negative() { return _negative; }
+  double &zero() { return _zero; }
+};
+
+inline void bucket_store::add(int index, double weight,
+                              std::size_t max_buckets)
+{
+  if (_counts.empty()) {
+    _offset = index;
+    _counts.push_back(weight);
+    return;
+  }
+
+  if (index < _offset) {
+    // Can't go below the lowest bucket if the store is full
+    int lowest = max_index() - int(max_buckets) + 1;
+    index = std::max(index, lowest);
+    if (index < _offset) {
+      _counts.insert(_counts.begin(), _offset - index, 0);
+      _offset = index;
+    }
+  } else if (index > max_index()) {
+    int lowest = index - int(max_buckets) + 1;
+    if (lowest <= _offset) {
+      _counts.resize(index - _offset + 1, 0);
+    } else {
+      // Merge the lowest buckets, without making room for them first
+      std::vector<double> counts(max_buckets, 0);
+      for (std::size_t i = 0; i < _counts.size(); ++i) {
+        counts[std::max(_offset + int(i), lowest) - lowest] += _counts[i];
+      }
+      _counts.swap(counts);
+      _offset = lowest;
+    }
+  }
+  _counts[index - _offset] += weight;
+}
+
+inline sketch::sketch(double relative_error, std::size_t max_buckets) :
+  _relative_error(relative_error),
+  _gamma((1 + relative_error) / (1 - relative_error)),
+  _log_gamma(std::log(_gamma)),
+  _max_buckets(max_buckets)
+{
+  // Avoid bad parameters
+  if (relative_error <= 0 || relative_error >= 1) {
+    throw std::logic_error("The relative error must be between 0 and 1!");
+  }
+  if (max_buckets == 0) {
+    throw std::logic_error("Cannot make sketch with less than 1 bucket!");
+  }
+}
+
+/**
+ * \brief Increment the bucket corresponding to \arg value.
+ *
+ * \param value   The value to record. NaN and infinities are ignored.
+ * \param weight  A weight.
+ */
+void sketch::bin(double value, double weight)
+{
+  if (!std::isfinite(value)) {
+    return;
+  } else if (value > std::numeric_limits<double>::min()) {
+    _positive.add(index(value), weight, _max_buckets);
+  } else if (value < -std::numeric_limits<double>::min()) {
+    _negative.add(index(-value), weight, _max_buckets);
+  } else {
+    _zero += weight;
+  }
+}
+
+/**
+ * \brief Adds the contents of \arg other to this sketch.
+ *
+ * Both sketches must have the same relative error.
+ */
+void sketch::merge(const sketch &other)
+{
+  if (other._gamma != _gamma) {
+    throw std::logic_error("Cannot merge sketches with different precision!");
+  }
+  if (!other._positive.empty()) {
+    for (int i = other._positive.min_index();
+         i <= other._positive.max_index(); ++i) {
+      _positive.add(i, other._positive.count(i), _max_buckets);
+    }
+  }
+  if (!other._negative.empty()) {
+    for (int i = other._negative.min_index();
+         i <= other._negative.max_index(); ++i) {
+      _negative.add(i, other._negative.count(i), _max_buckets);
+    }
+  }
+  _zero += other._zero;
+}
+
+} // namespace hist
+
+#endif // SKETCH_H
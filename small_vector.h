@@ -0,0 +1,200 @@
+#ifndef SMALL_VECTOR_H
+#define SMALL_VECTOR_H
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <new>
+#include <type_traits>
+
+/**
+ * \brief Preallocated memory handed out in order
+ *
+ * Allocations are never freed one by one: everything is released at once by
+ * clear(). When the arena is full, allocate() returns a null pointer and the
+ * caller is expected to use the heap instead.
+ */
+class arena
+{
+  std::unique_ptr<char[]> _buffer;
+  std::size_t _size, _used = 0;
+
+public:
+  explicit arena(std::size_t bytes) : _buffer(new char[bytes]), _size(bytes) {}
+
+  /// Returns aligned memory for \c bytes bytes, or nullptr if it doesn't fit
+  void *allocate(std::size_t bytes, std::size_t alignment)
+  {
+    std::uintptr_t base = reinterpret_cast<std::uintptr_t>(_buffer.get());
+    std::size_t start = (base + _used + alignment - 1) / alignment * alignment
+                        - base;
+    if (start + bytes > _size) {
+      return nullptr;
+    }
+    _used = start + bytes;
+    return _buffer.get() + start;
+  }
+
+  /// Releases all allocations
+  void clear() { _used = 0; }
+};
+
+/**
+ * \brief Vector storing its first N elements in place
+ *
+ * Larger sizes are stored in an arena if one was given with set_arena() and it
+ * has room, and on the heap otherwise. clear() keeps heap storage, so that a
+ * vector refilled again and again stops allocating once it has seen the
+ * largest size. Arena storage is given up by clear(), because the arena is
+ * expected to be cleared at the same time.
+ *
+ * Only trivially copyable types are supported. Copies don't share the arena of
+ * the original; assignment keeps the arena of the target.
+ */
+template<class T, std::size_t N>
+class small_vector
+{
+  static_assert(std::is_trivially_copyable<T>::value &&
+                std::is_trivially_destructible<T>::value,
+                "small_vector only supports trivially copyable types");
+
+  typename std::aligned_storage<sizeof(T), alignof(T)>::type _inline[N];
+  T *_data = reinterpret_cast<T *>(_inline);
+  std::size_t _size = 0, _capacity = N;
+  bool _on_heap = false;
+  ::arena *_arena = nullptr;
+
+public:
+  typedef T value_type;
+  typedef T *iterator;
+  typedef const T *const_iterator;
+
+  small_vector() = default;
+  small_vector(const small_vector &other) { *this = other; }
+  small_vector(small_vector &&other) noexcept { *this = std::move(other); }
+  ~small_vector() { release(); }
+
+  inline small_vector &operator=(const small_vector &other);
+  inline small_vector &operator=(small_vector &&other) noexcept;
+
+  /// Sets the arena used when the elements don't fit in place
+  void set_arena(::arena *a) { _arena = a; }
+
+  std::size_t size() const { return _size; }
+  std::size_t capacity() const { return _capacity; }
+  bool empty() const { return _size == 0; }
+
+  T &operator[](std::size_t i) { return _data[i]; }
+  const T &operator[](std::size_t i) const { return _data[i]; }
+
+  iterator begin() { return _data; }
+  iterator end() { return _data + _size; }
+  const_iterator begin() const { return _data; }
+  const_iterator end() const { return _data + _size; }
+  const_iterator cbegin() const { return _data; }
+  const_iterator cend() const { return _data + _size; }
+
+  void push_back(const T &value)
+  {
+    if (_size == _capacity) {
+      grow(2 * _capacity);
+    }
+    new (_data + _size) T(value);
+    ++_size;
+  }
+
+  /// Makes room for at least \c capacity elements
+  void reserve(std::size_t capacity)
+  {
+    if (capacity > _capacity) {
+      grow(capacity);
+    }
+  }
+
+  /// Removes all elements, keeping heap storage
+  void clear()
+  {
+    _size = 0;
+    if (!_on_heap) {
+      _data = reinterpret_cast<T *>(_inline);
+      _capacity = N;
+    }
+  }
+
+private:
+  inline void grow(std::size_t capacity);
+
+  void release()
+  {
+    if (_on_heap) {
+      ::operator delete(_data);
+    }
+    _data = reinterpret_cast<T *>(_inline);
+    _capacity = N;
+    _on_heap = false;
+  }
+};
+
+template<class T, std::size_t N>
+small_vector<T, N> &small_vector<T, N>::operator=(const small_vector &other)
+{
+  if (this != &other) {
+    _size = 0;
+    reserve(other._size);
+    std::copy(other.begin(), other.end(), _data);
+    _size = other._size;
+  }
+  return *this;
+}
+
+/*
+ * Takes the heap storage of the other vector. Elements in place or in an arena
+ * are copied.
+ */
+template<class T, std::size_t N>
+small_vector<T, N> &small_vector<T, N>::operator=(small_vector &&other) noexcept
+{
+  if (this != &other) {
+    if (other._on_heap) {
+      release();
+      _data = other._data;
+      _size = other._size;
+      _capacity = other._capacity;
+      _on_heap = true;
+      other._data = reinterpret_cast<T *>(other._inline);
+      other._capacity = N;
+      other._on_heap = false;
+    } else {
+      *this = static_cast<const small_vector &>(other);
+    }
+    other._size = 0;
+  }
+  return *this;
+}
+
+/*
+ * Moves the elements to storage for \c capacity elements, taken from the arena
+ * when possible.
+ */
+template<class T, std::size_t N>
+void small_vector<T, N>::grow(std::size_t capacity)
+{
+  capacity = std::max<std::size_t>(capacity, 1);
+  T *data = nullptr;
+  if (_arena != nullptr) {
+    data = static_cast<T *>(_arena->allocate(capacity * sizeof(T),
+                                             alignof(T)));
+  }
+  bool on_heap = data == nullptr;
+  if (on_heap) {
+    data = static_cast<T *>(::operator new(capacity * sizeof(T)));
+  }
+  std::copy(begin(), end(), data);
+  release();
+  _data = data;
+  _capacity = capacity;
+  _on_heap = on_heap;
+}
+
+#endif // SMALL_VECTOR_H
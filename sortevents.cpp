@@ -0,0 +1,335 @@
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <deque>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <queue>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <tuple>
+#include <vector>
+
+#include <unistd.h>
+
+#include "serializer.h"
+
+namespace // anonymous
+{
+  /// Value of the key field of an event. Events without it come first.
+  struct key
+  {
+    int kind = 0; ///< 0: missing, 1: boolean or number, 2: string
+    double number = 0;
+    std::string string;
+
+    bool operator<(const key &other) const
+    {
+      return std::tie(kind, number, string) <
+             std::tie(other.kind, other.number, other.string);
+    }
+  };
+
+  /// Serialized event with its key
+  struct item
+  {
+    key k;
+    std::string bytes;
+
+    /// Approximate memory used by the item
+    std::size_t size() const
+    {
+      return sizeof(item) + k.string.capacity() + bytes.capacity();
+    }
+  };
+
+  /*
+   * Finds the key of an event in the decoded fields.
+   */
+  key find_key(const record &fields, const std::vector<std::string> &path)
+  {
+    key k;
+    const record *value = &fields;
+    for (const std::string &name : path) {
+      value = value->is_table() ? value->get(name) : nullptr;
+      if (value == nullptr) {
+        return k;
+      }
+    }
+    if (value->type() == record::kind::boolean ||
+        value->type() == record::kind::number) {
+      k.kind = 1;
+      k.number = value->as_number();
+    } else if (value->type() == record::kind::string) {
+      k.kind = 2;
+      k.string = value->as_string();
+    }
+    return k;
+  }
+
+  /*
+   * Writes a string or a number in a run file.
+   */
+  void write_bytes(std::ostream &out, const std::string &data)
+  {
+    std::uint64_t size = data.size();
+    out.write((const char *) &size, sizeof(size));
+    out.write(data.data(), size);
+  }
+
+  bool read_bytes(std::istream &in, std::string &data)
+  {
+    std::uint64_t size;
+    if (!in.read((char *) &size, sizeof(size))) {
+      return false;
+    }
+    data.resize(size);
+    return bool(in.read(&data[0], size));
+  }
+
+  /*
+   * Sorts a batch of events and writes it to a run file.
+   */
+  void write_run(std::vector<item> &batch, const std::string &filename)
+  {
+    std::stable_sort(batch.begin(), batch.end(),
+                     [](const item &a, const item &b) { return a.k < b.k; });
+    std::ofstream out(filename, std::ios::binary);
+    for (const item &i : batch) {
+      out.put((char) i.k.kind);
+      out.write((const char *) &i.k.number, sizeof(double));
+      write_bytes(out, i.k.string);
+      write_bytes(out, i.bytes);
+    }
+    if (!out) {
+      throw std::runtime_error("could not write " + filename);
+    }
+    batch.clear();
+    batch.shrink_to_fit();
+  }
+
+  /// Sorted events read back from a run file
+  class run
+  {
+    std::ifstream _in;
+    std::unique_ptr<char[]> _buffer;
+
+  public:
+    item current;
+
+    explicit run(const std::string &filename) :
+      _buffer(new char[1 << 20])
+    {
+      _in.rdbuf()->pubsetbuf(_buffer.get(), 1 << 20);
+      _in.open(filename, std::ios::binary);
+    }
+
+    /// Reads the next event to current, returns false at the end
+    bool next()
+    {
+      char kind;
+      if (!_in.get(kind)) {
+        return false;
+      }
+      current.k.kind = kind;
+      _in.read((char *) &current.k.number, sizeof(double));
+      return read_bytes(_in, current.k.string) &&
+             read_bytes(_in, current.bytes);
+    }
+  };
+
+  /*
+   * Merges the runs and writes their events in order. Ties are broken by the
+   * order of the runs, which keeps the sort stable.
+   */
+  void merge(const std::vector<std::string> &filenames, serializer &ser)
+  {
+    std::vector<std::unique_ptr<run>> runs;
+    for (const std::string &filename : filenames) {
+      runs.emplace_back(new run(filename));
+    }
+    auto later = [&runs](std::size_t a, std::size_t b) {
+      return std::tie(runs[b]->current.k, b) < std::tie(runs[a]->current.k, a);
+    };
+    std::priority_queue<std::size_t, std::vector<std::size_t>,
+                        decltype(later)> queue(later);
+    for (std::size_t i = 0; i < runs.size(); ++i) {
+      if (runs[i]->next()) {
+        queue.push(i);
+      }
+    }
+    while (!queue.empty() && std::cout) {
+      std::size_t i = queue.top();
+      queue.pop();
+      ser.write_raw(runs[i]->current.bytes);
+      if (runs[i]->next()) {
+        queue.push(i);
+      }
+    }
+  }
+} // anonymous namespace
+
+/*
+ * Reads events from standard input and prints them to standard output, sorted
+ * by the value of a field ("id" unless given with -k, possibly in a subtable
+ * like "a.b"). Events with the same key keep their order; those without it
+ * come first, then booleans and numbers, then strings.
+ *
+ * Events are copied as they are, only the key is decoded. When they don't fit
+ * in the memory budget (-m, in megabytes), sorted runs are written to
+ * temporary files in the directory given with -t (TMPDIR or /tmp by default)
+ * and merged at the end. Runs are sorted and written by -j threads while the
+ * input is read.
+ */
+int main(int argc, char **argv)
+{
+  // Read options
+  std::string field = "id";
+  std::size_t budget = std::size_t(1024) << 20;
+  int workers = std::max(1u, std::thread::hardware_concurrency());
+  std::string directory = std::getenv("TMPDIR") ? std::getenv("TMPDIR")
+                                                : "/tmp";
+  while (argc > 2 && argv[1][0] == '-') {
+    std::string option = argv[1];
+    if (option == "-k") {
+      // Key field
+      field = argv[2];
+    } else if (option == "-m") {
+      // Memory budget in megabytes
+      budget = std::max(1., std::atof(argv[2])) * 1024 * 1024;
+    } else if (option == "-j") {
+      // Threads sorting runs
+      workers = std::max(std::atoi(argv[2]), 1);
+    } else if (option == "-t") {
+      // Directory for the runs
+      directory = argv[2];
+    } else {
+      break;
+    }
+    // Remove the option
+    argv[2] = argv[0];
+    argv += 2;
+    argc -= 2;
+  }
+  if (argc != 1) {
+    std::cout << "Usage: " << argv[0]
+              << " [-k field] [-m megabytes] [-j threads] [-t directory]"
+              << std::endl;
+    return 1;
+  }
+
+  std::vector<std::string> path;
+  std::istringstream parts(field);
+  std::string part;
+  while (std::getline(parts, part, '.')) {
+    path.push_back(part);
+  }
+  field_set fields;
+  fields.add(path);
+
+  unserializer uns(std::cin);
+  uns.select(fields);
+
+  // Every batch being sorted and the one being filled share the budget
+  const std::size_t batch_budget = budget / (workers + 1);
+  std::vector<item> batch;
+  std::size_t batch_size = 0;
+  std::vector<std::string> runs;
+  std::deque<std::thread> threads;
+  std::deque<std::string> errors; // One per run, stable addresses
+
+  auto cleanup = [&]() {
+    for (std::thread &t : threads) {
+      t.join();
+    }
+    threads.clear();
+    for (const std::string &filename : runs) {
+      std::remove(filename.c_str());
+    }
+  };
+
+  // Hands the batch to a thread that writes it to a new run file
+  auto spill = [&]() {
+    std::string filename = directory + "/sortevents-XXXXXX";
+    int fd = mkstemp(&filename[0]);
+    if (fd < 0) {
+      throw std::runtime_error("could not create a file in " + directory);
+    }
+    close(fd);
+    runs.push_back(filename);
+    errors.emplace_back();
+
+    if ((int) threads.size() == workers) {
+      threads.front().join();
+      threads.pop_front();
+    }
+    std::shared_ptr<std::vector<item>> data(
+      new std::vector<item>(std::move(batch)));
+    std::string *run_error = &errors.back();
+    threads.emplace_back([data, filename, run_error]() {
+      try {
+        write_run(*data, filename);
+      } catch (const std::runtime_error &e) {
+        *run_error = e.what();
+      }
+    });
+    batch.clear();
+    batch_size = 0;
+  };
+
+  try {
+    bool eof = false;
+    while (std::cin) {
+      item i;
+      record decoded;
+      uns.read_raw(i.bytes, decoded, eof);
+      if (eof) {
+        break;
+      }
+      i.k = find_key(decoded, path);
+      batch_size += i.size();
+      batch.push_back(std::move(i));
+      if (batch_size >= batch_budget) {
+        spill();
+      }
+    }
+
+    serializer ser(std::cout);
+    ser.declare(uns);
+    if (runs.empty()) {
+      // Everything fits in memory
+      std::stable_sort(batch.begin(), batch.end(),
+                       [](const item &a, const item &b) { return a.k < b.k; });
+      for (const item &i : batch) {
+        ser.write_raw(i.bytes);
+      }
+    } else {
+      if (!batch.empty()) {
+        spill();
+      }
+      for (std::thread &t : threads) {
+        t.join();
+      }
+      threads.clear();
+      for (const std::string &e : errors) {
+        if (!e.empty()) {
+          throw std::runtime_error(e);
+        }
+      }
+      std::cerr << "[INFO] Merging " << runs.size() << " runs" << std::endl;
+      merge(runs, ser);
+    }
+  } catch (const std::runtime_error &e) {
+    std::cerr << "ERROR: " << e.what() << std::endl;
+    cleanup();
+    return 3;
+  }
+
+  cleanup();
+  return 0;
+}
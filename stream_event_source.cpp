@@ -0,0 +1,230 @@
+#include "stream_event_source.h"
+
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+#include <streambuf>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "lorentz.h"
+
+/// Stream buffer reading the mapped file
+class stream_event_source::buffer : public std::streambuf
+{
+public:
+  buffer(const char *begin, const char *end)
+  {
+    setg(const_cast<char *>(begin), const_cast<char *>(begin),
+         const_cast<char *>(end));
+  }
+
+  /// Goes back to the start of the file
+  void rewind() { setg(eback(), eback(), egptr()); }
+
+  /// Returns the number of bytes read so far
+  std::size_t position() const { return gptr() - eback(); }
+};
+
+namespace // anonymous
+{
+  /*
+   * Returns the value of a number field, or 0 if it isn't a number.
+   */
+  double number(const record &r, const std::string &name)
+  {
+    const record *field = r.get(name);
+    return field != nullptr && field->type() == record::kind::number
+           ? field->as_number() : 0;
+  }
+
+  /*
+   * Returns the value of a 4-vector field, as written by vec.new() in
+   * lorentz.lua.
+   */
+  lorentz::vec vec(const record &r, const std::string &name)
+  {
+    const record *field = r.get(name);
+    if (field == nullptr || !field->is_table()) {
+      return lorentz::vec();
+    }
+    return lorentz::vec::txyz(number(*field, "t"), number(*field, "x"),
+                              number(*field, "y"), number(*field, "z"));
+  }
+
+  /*
+   * Fills the energy and direction of a calorimeter from the 4-vectors
+   * written by hlt_parser, which are built with vec.m_e_phi_eta.
+   */
+  void calorimeter(const record &r, const char *plus, const char *minus,
+                   plus_minus &out)
+  {
+    lorentz::vec vp = vec(r, plus);
+    out.plus = vp.t();
+    bool empty = lorentz::spatial_norm(vp) == 0;
+    out.eta_plus = empty ? 0 : lorentz::eta(vp);
+    out.phi_plus = empty ? 0 : lorentz::phi(vp);
+
+    lorentz::vec vm = vec(r, minus);
+    out.minus = vm.t();
+    empty = lorentz::spatial_norm(vm) == 0;
+    out.eta_minus = empty ? 0 : lorentz::eta(vm);
+    out.phi_minus = empty ? 0 : lorentz::phi(vm);
+  }
+
+  /*
+   * Fills an event structure from the fields of a serialized event.
+   */
+  void convert(const record &r, event &e)
+  {
+    e.clear();
+    e.id = number(r, "id");
+
+    const record *tracks = r.get("tracks");
+    if (tracks != nullptr && tracks->is_table()) {
+      e.tracks.reserve(tracks->array().size());
+      const record *t;
+      for (double i = 1; (t = tracks->get(i)) != nullptr; ++i) {
+        if (!t->is_table()) {
+          continue;
+        }
+        track trk;
+        trk.pdgid = number(*t, "pdgid");
+        trk.gpid = number(*t, "gpid");
+        trk.p = vec(*t, "p");
+        trk.charge = number(*t, "q");
+        trk.chi2 = number(*t, "chi2");
+        trk.ndof = number(*t, "ndof");
+        trk.x = lorentz::vec::txyz(0, number(*t, "x"), number(*t, "y"),
+                                   number(*t, "z"));
+        e.add_track(trk);
+      }
+    }
+
+    e.castor_status.restore_energy(number(r, "castor_energy"));
+
+    const record *ecal = r.get("ecal");
+    if (ecal != nullptr && ecal->is_table()) {
+      calorimeter(*ecal, "bp", "bm", e.ecal.barrel);
+      calorimeter(*ecal, "ep", "em", e.ecal.endcap);
+    }
+    const record *hcal = r.get("hcal");
+    if (hcal != nullptr && hcal->is_table()) {
+      calorimeter(*hcal, "bp", "bm", e.hcal.barrel);
+      calorimeter(*hcal, "ep", "em", e.hcal.endcap);
+      calorimeter(*hcal, "fp", "fm", e.hcal.forward);
+    }
+  }
+} // anonymous namespace
+
+/**
+ * \brief Maps \c filename in memory.
+ */
+stream_event_source::stream_event_source(const std::string &filename) :
+  _filename(filename)
+{
+  int fd = open(filename.c_str(), O_RDONLY);
+  struct stat info;
+  if (fd < 0 || fstat(fd, &info) != 0) {
+    std::string error = std::strerror(errno);
+    if (fd >= 0) {
+      close(fd);
+    }
+    throw std::runtime_error("could not open " + filename + ": " + error);
+  }
+  _size = info.st_size;
+  _map = "";
+  if (_size > 0) {
+    void *map = mmap(nullptr, _size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (map == MAP_FAILED) {
+      std::string error = std::strerror(errno);
+      close(fd);
+      throw std::runtime_error("could not map " + filename + ": " + error);
+    }
+    madvise(map, _size, MADV_SEQUENTIAL);
+    _map = (const char *) map;
+  }
+  close(fd);
+
+  _buffer.reset(new buffer(_map, _map + _size));
+  _in.reset(new std::istream(_buffer.get()));
+  _reader.reset(new unserializer(*_in));
+}
+
+stream_event_source::~stream_event_source()
+{
+  if (_size > 0) {
+    munmap((void *) _map, _size);
+  }
+}
+
+bool stream_event_source::end()
+{
+  return _valid && _position + 1 > _events.size();
+}
+
+void stream_event_source::read()
+{
+  _position++;
+  if (_valid) {
+    if (_position < _events.size()) {
+      _events.get(_position, _current);
+    }
+    return;
+  }
+
+  if (_offsets.empty()) {
+    _offsets.push_back(_buffer->position());
+  }
+  bool eof = !*_in;
+  if (!eof) {
+    _reader->read(_record, eof);
+  }
+  if (eof) {
+    // The whole file is in the store
+    _events.shrink_to_fit();
+    _offsets.shrink_to_fit();
+    _valid = true;
+    return;
+  }
+  convert(_record, _current);
+  _events.add(_current);
+  _offsets.push_back(_buffer->position());
+}
+
+/**
+ * \brief Decodes the current event into \c event.
+ */
+void stream_event_source::fill_rec(sol::state &lua, sol::table &event)
+{
+  if (_position >= _events.size()) {
+    return;
+  }
+  _reader->decode(lua, event, _map + _offsets[_position],
+                  _map + _offsets[_position + 1]);
+}
+
+const event &stream_event_source::rec()
+{
+  return _current;
+}
+
+const event &stream_event_source::gen()
+{
+  return _current;
+}
+
+void stream_event_source::reset()
+{
+  _position = -1;
+  if (!_valid) {
+    _buffer->rewind();
+    _in->clear();
+    _reader.reset(new unserializer(*_in));
+    _events.clear();
+    _offsets.clear();
+  }
+}
@@ -0,0 +1,64 @@
+#ifndef STREAM_EVENT_SOURCE_H
+#define STREAM_EVENT_SOURCE_H
+
+#include <istream>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "event.h"
+#include "event_source.h"
+#include "event_store.h"
+#include "record.h"
+#include "serializer.h"
+
+/**
+ * \brief Reads the events of a file written by a serializer
+ *
+ * The file is mapped in memory. The first pass decodes every event once,
+ * converts it to an event structure kept in an event_store, and remembers
+ * where it starts in the file. Later passes take the events from the store
+ * without parsing the file again. fill_rec() decodes the table of the current
+ * event straight from the mapped file, with all its fields.
+ *
+ * The event structure is filled from the fields written by hlt_parser and
+ * readstarlight: \c id, \c tracks (with \c p, \c q, \c chi2, \c ndof, \c x,
+ * \c y, \c z, \c pdgid and \c gpid), \c castor_energy, \c ecal and \c hcal.
+ * Missing fields are left at zero.
+ *
+ * Errors opening the file are reported by throwing a std::runtime_error.
+ */
+class stream_event_source : public event_source
+{
+  class buffer;
+
+  std::string _filename;
+  const char *_map = nullptr;
+  std::size_t _size = 0;
+  std::unique_ptr<buffer> _buffer;
+  std::unique_ptr<std::istream> _in;
+  std::unique_ptr<unserializer> _reader;
+  record _record;
+
+  event_store _events;
+  std::vector<std::size_t> _offsets; ///< Start of every event, and the end
+  event _current;
+  std::size_t _position = -1;
+  bool _valid = false; ///< The whole file was read
+
+  stream_event_source(const stream_event_source &) = delete;
+  stream_event_source &operator=(const stream_event_source &) = delete;
+
+public:
+  explicit stream_event_source(const std::string &filename);
+  ~stream_event_source();
+
+  bool end();
+  void read();
+  void fill_rec(sol::state &lua, sol::table &event);
+  const event &rec();
+  const event &gen();
+  void reset();
+};
+
+#endif // STREAM_EVENT_SOURCE_H